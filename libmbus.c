@@ -44,6 +44,8 @@ static volatile enum MBus_logical_t {
 static volatile bool last_clkin = 1;
 static volatile bool last_din = 1;
 static volatile bool last_dout = 1;
+// DOUT value decided on the previous CLKIN edge, or -1
+static volatile int8_t dout_next = -1;
 static volatile unsigned interrupt_count = 0;
 static volatile enum MBus_error_t error = MBUS_ERR_NO_ERROR;
 
@@ -53,6 +55,15 @@ static          uint8_t  tx_priority = 0;
 static volatile uint8_t  tx_bit_idx = 0;
 static volatile int      tx_byte_idx = 0;
 
+// Set once this node has pulled DOUT low to request the bus
+static volatile bool     tx_requested = false;
+// Queued transmission currently in flight, or NULL for MBus_send
+static struct MBus_tx_t* volatile tx_cur = NULL;
+static struct MBus_tx_t* volatile tx_queue_head = NULL;
+static struct MBus_tx_t* volatile tx_queue_tail = NULL;
+
+static struct MBus_autoreply_t* autoreplies = NULL;
+
 static volatile uint32_t rx_addr = 0;
 static volatile uint8_t  rx_bit_idx = 0;
 static volatile int      rx_byte_idx = 0;
@@ -61,8 +72,44 @@ static volatile unsigned rx_buf_idx;
 static volatile int*     rx_buf_len = &rx_buf_zero;
 static volatile uint8_t* rx_buf = NULL;
 
+// RX buffer picked ahead of the end of the address phase, or -1
+static volatile int      rx_spec_idx = -1;
+// Subscription to the two channels the last address bit may select
+static volatile uint8_t  rx_channel_bits = 0;
+// recv_addrs[rx_buf_idx] is written on the edge after the address phase
+static volatile bool     rx_addr_pending = false;
+static volatile uint32_t rx_recv_addr;
+
+// Used when buffer selection is deferred until the first payload byte
+static volatile bool     rx_claim_deferred = false;
+static volatile uint32_t rx_deferred_addr;
+static volatile uint8_t  rx_first_byte;
+static          int      rx_first_byte_len = 1;
+
+// Last-value cache entry being received into, or -1
+static volatile int      rx_lvc_idx = -1;
+
+// Set while receiving a message for another node in promiscuous mode
+static volatile bool     rx_snooping = false;
+static volatile bool     rx_cb1 = 0;
+
+// Set while receiving a time sync message
+static volatile bool     rx_timesync = false;
+
+// Set while receiving a multicast message, until its group is known
+static volatile bool     rx_multicast = false;
+
 static volatile uint8_t  ack = 0;
 
+static volatile struct MBus_stats_t stats;
+
+// Idle window tracking for MBus_idle_begin / MBus_idle_end
+static volatile bool     idle_signalled = false;
+static          uint32_t idle_start_time;
+// Moving average of idle window lengths, scaled by 2^IDLE_AVG_SHIFT
+static          uint32_t idle_avg = 0;
+#define IDLE_AVG_SHIFT 3
+
 
 static inline void SET_CLKOUT_TO(bool val) {
 	mbus->set_gpio_val(mbus->CLKOUT_gpio, val);
@@ -75,6 +122,7 @@ static inline void SET_CLKOUT_LOW(void) {
 }
 
 static inline void SET_DOUT_TO(bool val) {
+	last_dout = val;
 	mbus->set_gpio_val(mbus->DOUT_gpio, val);
 }
 static inline void SET_DOUT_HIGH(void) {
@@ -85,6 +133,962 @@ static inline void SET_DOUT_LOW(void) {
 }
 
 
+// Edges out of these states may enter REQUEST_INTERRUPT
+static inline bool may_request(enum MBus_state_t s) {
+	return (s == LATCH_SHORT_ADDR) || (s == LATCH_LONG_ADDR) ||
+		(s == LATCH_DATA);
+}
+
+// A requester holds CLKOUT high. Relies on the order of MBus_state_t.
+static inline bool requesting(enum MBus_state_t s) {
+	return (s >= REQUEST_INTERRUPT) && (s <= REQUESTED_INTERRUPT);
+}
+
+// Decides the data bit to drive on the next (DRIVE_DATA) edge
+static inline void tx_prepare_bit(void) {
+	dout_next = !!(tx_buf[tx_byte_idx] & (1 << tx_bit_idx));
+}
+
+
+#if MBUS_CONSTANT_TIME > 0
+static inline uint32_t pad_begin(void) {
+	return mbus->get_cycles ? mbus->get_cycles() : 0;
+}
+
+// Busy-waits until MBUS_CONSTANT_TIME cycles have passed since start
+static inline void pad_end(uint32_t start) {
+	if (mbus->get_cycles == NULL) return;
+	if ((uint32_t) (mbus->get_cycles() - start) > MBUS_CONSTANT_TIME) {
+		stats.constant_time_overruns++;
+		return;
+	}
+	while ((uint32_t) (mbus->get_cycles() - start) < MBUS_CONSTANT_TIME);
+}
+#else
+static inline uint32_t pad_begin(void) {
+	return 0;
+}
+
+static inline void pad_end(uint32_t start) {
+	(void) start;
+}
+#endif
+
+
+static inline void disable_interrupts(void) {
+	if (mbus->disable_interrupts) mbus->disable_interrupts();
+}
+static inline void enable_interrupts(void) {
+	if (mbus->enable_interrupts) mbus->enable_interrupts();
+}
+
+
+#if MBUS_HISTOGRAMS
+static void record_length(int length) {
+	unsigned bin = 0;
+	while ((bin < MBUS_LENGTH_BINS - 1) && (length > (1 << bin))) bin++;
+	stats.recv_length_hist[bin]++;
+}
+
+// Number of RX buffers currently held by the client
+static unsigned held_rx_buffers(void) {
+	unsigned idx, held = 0;
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		if (mbus->recv_buffer_lengths[idx] <= 0) held++;
+	}
+	return held;
+}
+#endif
+
+static inline void use_rx_buffer(unsigned idx) {
+	rx_buf_idx = idx;
+	rx_buf_len = &mbus->recv_buffer_lengths[idx];
+	rx_buf = mbus->recv_buffers[idx];
+}
+
+// Finds an rx buffer of at least min_length bytes. If min_length is 0 the
+// first available buffer is used, otherwise the smallest buffer that fits.
+// Returns -1 if none is available.
+static int find_rx_buffer(int min_length) {
+	unsigned idx;
+	int best_idx = -1;
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		int len = mbus->recv_buffer_lengths[idx];
+		if (len <= 0) continue;
+		if (min_length == 0) {
+			best_idx = idx;
+			break;
+		}
+		if (len < min_length) continue;
+		if ((best_idx < 0) || (len < mbus->recv_buffer_lengths[best_idx])) {
+			best_idx = idx;
+		}
+	}
+	return best_idx;
+}
+
+// As find_rx_buffer, but also gives MBus_recv_buffer_alloc a chance and
+// counts the failure. Returns false if no buffer could be found.
+static bool claim_rx_buffer(int min_length) {
+	int best_idx = find_rx_buffer(min_length);
+	if (best_idx >= 0) {
+		use_rx_buffer(best_idx);
+		return true;
+	}
+
+	if (mbus->MBus_recv_buffer_alloc) {
+		int alloc_idx = mbus->MBus_recv_buffer_alloc(min_length);
+		if (
+				(alloc_idx >= 0) &&
+				(alloc_idx < RX_BUFFER_COUNT) &&
+				(mbus->recv_buffer_lengths[alloc_idx] > 0) &&
+				(mbus->recv_buffer_lengths[alloc_idx] >= min_length)
+		   ) {
+			use_rx_buffer(alloc_idx);
+			stats.recv_buffer_allocs++;
+			return true;
+		}
+	}
+
+	stats.recv_overflows++;
+#if MBUS_HISTOGRAMS
+	if (held_rx_buffers() == RX_BUFFER_COUNT) {
+		stats.recv_occupancy_hist[RX_BUFFER_COUNT]++;
+	} else {
+		// Buffers available, but none long enough for the hint
+		record_length(min_length);
+	}
+#endif
+	return false;
+}
+
+#if MBUS_LVC_ENTRIES > 0
+// Each entry is double-buffered. Messages are received into the inactive half,
+// which becomes current once the message completes successfully. Readers use
+// the sequence number to detect a concurrent update.
+static struct {
+	bool             in_use;
+	uint32_t         addr;
+	uint8_t          key;
+	volatile uint8_t current;
+	volatile unsigned sequence;
+	volatile int     lengths[2];
+	volatile uint8_t data[2][MBUS_LVC_VALUE_LENGTH];
+} lvc[MBUS_LVC_ENTRIES];
+static          unsigned lvc_count = 0;
+static          int      lvc_value_len = MBUS_LVC_VALUE_LENGTH;
+
+static inline unsigned lvc_slot(uint32_t addr, uint8_t key) {
+	return (key ^ (addr >> 24) ^ addr) % MBUS_LVC_ENTRIES;
+}
+
+static bool lvc_begin_receive(uint32_t addr, uint8_t key) {
+	unsigned idx = lvc_slot(addr, key);
+	if (!lvc[idx].in_use) return false;
+	if ((lvc[idx].addr != addr) || (lvc[idx].key != key)) return false;
+
+	rx_lvc_idx = idx;
+	rx_buf = lvc[idx].data[!lvc[idx].current];
+	rx_buf_len = &lvc_value_len;
+	rx_buf[0] = key;
+	return true;
+}
+
+static void lvc_publish(void) {
+	unsigned idx = rx_lvc_idx;
+	uint8_t next = !lvc[idx].current;
+
+	// The tail of a message one byte too long is not caught by the NAK
+	if (rx_byte_idx > MBUS_LVC_VALUE_LENGTH) {
+		stats.recv_overflows++;
+		return;
+	}
+
+	lvc[idx].lengths[next] = rx_byte_idx;
+	lvc[idx].current = next;
+	lvc[idx].sequence++;
+	stats.lvc_updates++;
+}
+#else
+static inline bool lvc_begin_receive(uint32_t addr, uint8_t key) {
+	(void) addr;
+	(void) key;
+	return false;
+}
+
+static inline void lvc_publish(void) {
+}
+#endif
+
+#if MBUS_TRACE_DEPTH > 0
+static struct MBus_trace_entry_t trace_ring[MBUS_TRACE_DEPTH];
+static volatile unsigned trace_head = 0;  // Next record to write
+static volatile unsigned trace_tail = 0;  // Oldest unread record
+static volatile unsigned trace_lost = 0;
+static          uint8_t  trace_last_phase = 0;
+static          uint8_t  trace_last_logical = FORWARD;
+
+// Coarse bus phase of a state. Relies on the order of MBus_state_t.
+static inline uint8_t trace_phase(enum MBus_state_t s) {
+	if (s == IDLE) return 0;
+	if (s <= ARB_RESERVED_LATCH) return 1;
+	if (s <= LATCH_LONG_ADDR) return 2;
+	if (s <= LATCH_DATA) return 3;
+	if (s <= REQUESTED_INTERRUPT) return 4;
+	if (s <= BEGIN_IDLE) return 5;
+	return 6;
+}
+
+// Records the current state if the phase or logical role changed
+static void trace(void) {
+	uint8_t phase = trace_phase(state);
+	struct MBus_trace_entry_t* e;
+
+	if ((phase == trace_last_phase) && (logical == trace_last_logical)) return;
+	trace_last_phase = phase;
+	trace_last_logical = logical;
+
+	if (trace_head - trace_tail == MBUS_TRACE_DEPTH) {
+		// Full, overwrite the oldest record
+		trace_tail++;
+		trace_lost++;
+	}
+	e = &trace_ring[trace_head % MBUS_TRACE_DEPTH];
+	e->time = mbus->get_time ? mbus->get_time() : 0;
+	e->state = state;
+	e->logical = logical;
+	trace_head++;
+}
+#else
+static inline void trace(void) {
+}
+#endif
+
+#if MBUS_TRAFFIC_ENTRIES > 0
+static struct MBus_traffic_entry_t traffic[MBUS_TRAFFIC_ENTRIES];
+static unsigned traffic_used = 0;
+static volatile uint16_t traffic_prefixes = 0;
+// Data bits latched in the current transaction
+static uint32_t traffic_bits = 0;
+
+static inline void traffic_bit(void) {
+	traffic_bits++;
+}
+
+// Called as each transaction completes. Counts it against its destination,
+// replacing the least busy flow if it is not yet tracked (space-saving).
+static void traffic_record(void) {
+	unsigned bytes = traffic_bits >> 3;
+	uint32_t addr;
+	unsigned idx, min_idx = 0;
+
+	if ((traffic_bits == 0) || (tx_byte_idx > 0)) {
+		traffic_bits = 0;
+		return;
+	}
+	traffic_bits = 0;
+
+	// Long addresses are assembled in full, short ones stop after 8 bits
+	if ((rx_addr >> 28) == 0xf) {
+		addr = rx_addr;
+	} else {
+		addr = rx_addr << 24;
+		if (addr >> 28) traffic_prefixes |= 1 << (addr >> 28);
+	}
+
+	for (idx=0; idx < traffic_used; idx++) {
+		if (traffic[idx].addr == addr) {
+			traffic[idx].messages++;
+			traffic[idx].bytes += bytes;
+			return;
+		}
+		if (traffic[idx].messages < traffic[min_idx].messages) min_idx = idx;
+	}
+	if (traffic_used < MBUS_TRAFFIC_ENTRIES) {
+		idx = traffic_used++;
+		traffic[idx].addr = addr;
+		traffic[idx].messages = 1;
+		traffic[idx].bytes = bytes;
+		traffic[idx].overcount = 0;
+		return;
+	}
+	traffic[min_idx].addr = addr;
+	traffic[min_idx].overcount = traffic[min_idx].messages;
+	traffic[min_idx].messages++;
+	traffic[min_idx].bytes += bytes;
+}
+#else
+static inline void traffic_bit(void) {
+}
+
+static inline void traffic_record(void) {
+}
+#endif
+
+#if MBUS_MULTICAST
+static volatile uint32_t multicast_groups[256 / 32];
+
+static inline bool is_multicast(uint32_t addr) {
+	return addr == (uint32_t) MBUS_MULTICAST_CHANNEL << 24;
+}
+
+// Called once the group ID of a multicast message has arrived. Returns true
+// if this node is not a member and should stop receiving.
+static inline bool multicast_reject(void) {
+	uint8_t group = rx_first_byte;
+
+	if (!rx_multicast || rx_snooping) return false;
+	if (multicast_groups[group >> 5] & (1UL << (group & 31))) return false;
+	stats.multicast_filtered++;
+	return true;
+}
+#else
+static inline bool is_multicast(uint32_t addr) {
+	(void) addr;
+	return false;
+}
+
+static inline bool multicast_reject(void) {
+	return false;
+}
+#endif
+
+// A completion callback, queued for MBus_run if MBUS_EVENT_QUEUE > 0
+struct MBus_event_t {
+	enum {
+		EVENT_SEND_DONE,
+		EVENT_TX_DONE,
+		EVENT_RECV,
+		EVENT_SNOOP_RECV,
+		EVENT_ERROR,
+	} type;
+	enum MBus_error_t error;
+	int value;                 // Bytes sent or RX buffer index
+	bool cb0, cb1;
+	struct MBus_tx_t* tx;
+};
+
+static void deliver(const struct MBus_event_t* e) {
+	switch (e->type) {
+		case EVENT_SEND_DONE:
+			mbus->MBus_send_done(e->value, e->error);
+			break;
+		case EVENT_TX_DONE:
+			if (e->tx->done) e->tx->done(e->tx, e->value, e->error);
+			break;
+		case EVENT_RECV:
+			mbus->MBus_recv(e->value);
+			break;
+		case EVENT_SNOOP_RECV:
+			if (mbus->MBus_snoop_recv) {
+				mbus->MBus_snoop_recv(e->value, e->cb0, e->cb1);
+			} else {
+				mbus->MBus_recv(e->value);
+			}
+			break;
+		case EVENT_ERROR:
+			mbus->MBus_error(e->error);
+			break;
+	}
+}
+
+#if MBUS_EVENT_QUEUE > 0
+static struct MBus_event_t events[MBUS_EVENT_QUEUE];
+static volatile unsigned event_head = 0;
+static volatile unsigned event_tail = 0;
+// Slots kept for loopback messages being copied
+static volatile unsigned events_promised = 0;
+
+// Free slots in the event queue, less those kept for loopback messages and
+// for the completion of a requested transmission. Transmissions and receives
+// only go ahead with room for their completion, so the queue never has to
+// drop or reorder one. Interrupts must be disabled.
+static unsigned event_room(void) {
+	unsigned used = (event_head - event_tail) + events_promised +
+		(tx_requested ? 1 : 0);
+	return (used < MBUS_EVENT_QUEUE) ? MBUS_EVENT_QUEUE - used : 0;
+}
+
+// Interrupts must be disabled
+static void post(const struct MBus_event_t* e) {
+	if (event_head - event_tail == MBUS_EVENT_QUEUE) {
+		// Only errors can get here (see post_error)
+		stats.events_dropped++;
+		return;
+	}
+	events[event_head % MBUS_EVENT_QUEUE] = *e;
+	event_head++;
+	if ((event_head - event_tail == 1) && mbus->MBus_events_pending) {
+		mbus->MBus_events_pending();
+	}
+}
+#else
+static inline unsigned event_room(void) {
+	return ~0u;
+}
+
+static inline void post(const struct MBus_event_t* e) {
+	deliver(e);
+}
+#endif
+
+// An error is dropped rather than take a slot kept for a completion, unless
+// it is itself the completion of an MBus_send
+static void post_error(enum MBus_error_t err) {
+	struct MBus_event_t e = { .type = EVENT_ERROR, .error = err };
+#if MBUS_EVENT_QUEUE > 0
+	if ((event_room() == 0) &&
+			!(tx_requested && (tx_cur == NULL) && (tx_byte_idx > 0))) {
+		stats.events_dropped++;
+		return;
+	}
+#endif
+	post(&e);
+}
+
+static void post_send_done(int bytes_sent, enum MBus_error_t err) {
+	struct MBus_event_t e = {
+		.type = EVENT_SEND_DONE, .error = err, .value = bytes_sent };
+	post(&e);
+}
+
+static void post_tx_done(struct MBus_tx_t* tx, int bytes_sent,
+		enum MBus_error_t err) {
+	struct MBus_event_t e = {
+		.type = EVENT_TX_DONE, .error = err, .value = bytes_sent, .tx = tx };
+	post(&e);
+}
+
+static void post_recv(unsigned idx) {
+	struct MBus_event_t e = { .type = EVENT_RECV, .value = idx };
+	post(&e);
+}
+
+static void post_snoop_recv(unsigned idx, bool cb0, bool cb1) {
+	struct MBus_event_t e = {
+		.type = EVENT_SNOOP_RECV, .value = idx, .cb0 = cb0, .cb1 = cb1 };
+	post(&e);
+}
+
+enum MBus_loopback_t {
+	LOOPBACK_NONE,             // Not for this node, bus only
+	LOOPBACK_ONLY,             // For this node only
+	LOOPBACK_ALSO,             // For this node and others on the bus
+};
+
+// loopback() index when the event queue has no room for the message
+#define LOOPBACK_NO_ROOM -2
+
+#if MBUS_LOOPBACK
+// Addresses are sent LSB first but assembled by receivers MSB first
+static uint8_t reverse_bits(uint8_t b) {
+	uint8_t r = 0;
+	unsigned i;
+	for (i=0; i < 8; i++) {
+		if (b & (0x80 >> i)) r |= 1 << i;
+	}
+	return r;
+}
+
+// Decodes the address of an outgoing message as receivers will assemble it
+// (in recv_addrs format). Returns the number of address bytes, or 0 if the
+// message is too short to hold its address.
+static unsigned wire_address(const uint8_t* buf, int length, uint32_t* addr) {
+	unsigned i;
+
+	if (length < 1) return 0;
+	*addr = reverse_bits(buf[0]);
+	if ((*addr >> 4) != 0xf) {
+		*addr <<= 24;
+		return 1;
+	}
+	if (length < 4) return 0;
+	for (i=1; i < 4; i++) *addr = (*addr << 8) | reverse_bits(buf[i]);
+	return 4;
+}
+
+// Which receivers an outgoing message has, decided as the address phase of
+// a receiving node would
+static enum MBus_loopback_t loopback_route(uint32_t addr,
+		const uint8_t* payload, int length) {
+	bool is_short = (addr & 0xffffff) == 0;
+	uint32_t prefix = is_short ? addr >> 28 : (addr >> 4) & 0xffffff;
+	unsigned channel = is_short ? (addr >> 24) & 0xf : addr & 0xf;
+
+	// Like on the bus, messages without payload are not delivered
+	if (length == 0) return LOOPBACK_NONE;
+	if (prefix == (is_short ? mbus->short_prefix : mbus->full_prefix)) {
+		return LOOPBACK_ONLY;
+	}
+	if (prefix != 0) return LOOPBACK_NONE;
+
+	// Enumeration is always between different nodes
+	if (channel == 0) return LOOPBACK_NONE;
+	if (!(mbus->broadcast_channels & (1 << channel))) return LOOPBACK_NONE;
+	if (is_multicast(addr) && !MBus_multicast_member(payload[0])) {
+		return LOOPBACK_NONE;
+	}
+	return LOOPBACK_ALSO;
+}
+
+#if MBUS_EVENT_QUEUE > 0
+// Events a loopback message posts: its delivery and, if it does not also go
+// on the bus, its completion
+static unsigned loopback_events(enum MBus_loopback_t route) {
+	return (route == LOOPBACK_ONLY) ? 2 : 1;
+}
+#endif
+
+// As find_rx_buffer with a length, but skips the buffer of any receive in
+// progress
+static int find_loopback_buffer(int length) {
+	unsigned idx;
+	int best_idx = -1;
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		int len = mbus->recv_buffer_lengths[idx];
+		if (len < length) continue;
+		if ((state != IDLE) && (rx_buf_len == &mbus->recv_buffer_lengths[idx])) {
+			continue;
+		}
+		if ((best_idx < 0) || (len < mbus->recv_buffer_lengths[best_idx])) {
+			best_idx = idx;
+		}
+	}
+	return best_idx;
+}
+
+// Copies a message this node sends to itself into an RX buffer. Returns the
+// route for the bus and sets *idx to the buffer, to -1 if no RX buffer fit
+// (or the message does not loop back), or to LOOPBACK_NO_ROOM if the event
+// queue has no room for its events. The caller reports the delivery.
+static enum MBus_loopback_t loopback(const uint8_t* buf, int length,
+		int* idx) {
+	enum MBus_loopback_t route;
+	uint32_t addr;
+	unsigned addr_len, i;
+
+	*idx = -1;
+	addr_len = wire_address(buf, length, &addr);
+	if (addr_len == 0) return LOOPBACK_NONE;
+	length -= addr_len;
+	route = loopback_route(addr, buf + addr_len, length);
+	if (route == LOOPBACK_NONE) return route;
+
+	// Take the buffer before copying so the handlers cannot claim it. The
+	// reservation is negative so that neither they nor libmbus_pool (which
+	// refills slots of length 0) touch the buffer meanwhile.
+	disable_interrupts();
+#if MBUS_EVENT_QUEUE > 0
+	if (event_room() < loopback_events(route)) {
+		*idx = LOOPBACK_NO_ROOM;
+		stats.events_refused++;
+		enable_interrupts();
+		return route;
+	}
+	events_promised += loopback_events(route);
+#endif
+	*idx = find_loopback_buffer(length);
+	if (*idx >= 0) {
+		mbus->recv_buffer_lengths[*idx] = -1;
+		// A receive about to begin must then claim another buffer
+		if (*idx == rx_spec_idx) rx_spec_idx = -1;
+	} else {
+		stats.recv_overflows++;
+	}
+	enable_interrupts();
+	if (*idx < 0) return route;
+
+	for (i=0; i < (unsigned) length; i++) {
+		mbus->recv_buffers[*idx][i] = buf[addr_len + i];
+	}
+	mbus->recv_addrs[*idx] = addr;
+	mbus->recv_buffer_lengths[*idx] = -length;
+	stats.loopbacks++;
+	return route;
+}
+#else
+static inline enum MBus_loopback_t loopback(const uint8_t* buf, int length,
+		int* idx) {
+	(void) buf;
+	(void) length;
+	*idx = -1;
+	return LOOPBACK_NONE;
+}
+#endif
+
+#if MBUS_TIMESYNC
+// Sync messages are a short broadcast followed by the sender's time, little
+// endian. Addresses are sent LSB first but assembled by receivers MSB first.
+#define TIMESYNC_LENGTH 4
+static uint8_t           timesync_buf[1 + TIMESYNC_LENGTH];
+static struct MBus_tx_t  timesync_tx;
+static          int      timesync_len = TIMESYNC_LENGTH;
+static volatile uint8_t  timesync_rx_buf[TIMESYNC_LENGTH];
+static volatile uint32_t timesync_rx_time;
+static volatile uint32_t timesync_offset = 0;
+static volatile bool     timesync_synced = false;
+
+static inline uint32_t timesync_now(void) {
+	return mbus->get_time() + timesync_offset;
+}
+
+// Called on the edge that ends the address phase of a message this node
+// receives. Sync messages are received into a private buffer.
+static bool timesync_begin_receive(uint32_t addr) {
+	if ((addr != MBUS_TIMESYNC_CHANNEL) || (mbus->get_time == NULL)) {
+		return false;
+	}
+	timesync_rx_time = mbus->get_time();
+	rx_timesync = true;
+	rx_bit_idx = 0;
+	rx_buf = timesync_rx_buf;
+	rx_buf_len = &timesync_len;
+	return true;
+}
+
+// Called on the edge that latches the last address bit this node sends
+static inline void timesync_stamp(void) {
+	uint32_t now;
+	unsigned i;
+
+	if ((tx_cur != &timesync_tx) || (tx_byte_idx != 1) || (tx_bit_idx != 0)) {
+		return;
+	}
+	now = timesync_now();
+	for (i=0; i < TIMESYNC_LENGTH; i++) {
+		timesync_buf[1 + i] = now >> (8 * i);
+	}
+}
+
+static void timesync_publish(void) {
+	uint32_t time = 0;
+	unsigned i;
+
+	if (rx_byte_idx != TIMESYNC_LENGTH) return;
+	for (i=0; i < TIMESYNC_LENGTH; i++) {
+		time |= (uint32_t) timesync_rx_buf[i] << (8 * i);
+	}
+	timesync_offset = time - timesync_rx_time;
+	timesync_synced = true;
+	stats.timesyncs++;
+}
+#else
+static inline bool timesync_begin_receive(uint32_t addr) {
+	(void) addr;
+	return false;
+}
+
+static inline void timesync_stamp(void) {
+}
+
+static inline void timesync_publish(void) {
+}
+#endif
+
+// Called on the edge that ends a transaction, once any queued transmission
+// has had the chance to request the bus
+static void begin_idle(void) {
+	if (tx_requested || (mbus->MBus_idle_begin == NULL)) return;
+
+	idle_signalled = true;
+	if (mbus->get_time) idle_start_time = mbus->get_time();
+	mbus->MBus_idle_begin(idle_avg >> IDLE_AVG_SHIFT);
+}
+
+// Called on the first edge of the next transaction
+static void end_idle(void) {
+	if (!idle_signalled) return;
+	idle_signalled = false;
+
+	if (mbus->get_time) {
+		uint32_t length = mbus->get_time() - idle_start_time;
+		if (length > (UINT32_MAX >> IDLE_AVG_SHIFT)) {
+			length = UINT32_MAX >> IDLE_AVG_SHIFT;
+		}
+		if (idle_avg == 0) {
+			idle_avg = length << IDLE_AVG_SHIFT;
+		} else {
+			// avg += (length - avg) / 2^IDLE_AVG_SHIFT
+			idle_avg += length - (idle_avg >> IDLE_AVG_SHIFT);
+		}
+	}
+	if (mbus->MBus_idle_end) mbus->MBus_idle_end();
+}
+
+static void reset_transaction(void) {
+	tx_bit_idx = 0;
+	tx_byte_idx = 0;
+	rx_addr = 0;
+	rx_bit_idx = 0;
+	rx_byte_idx = 0;
+	rx_buf_len = &rx_buf_zero;
+	rx_buf = NULL;
+	rx_spec_idx = -1;
+	rx_addr_pending = false;
+	rx_claim_deferred = false;
+	rx_lvc_idx = -1;
+	rx_snooping = false;
+	rx_timesync = false;
+	rx_multicast = false;
+	ack = 0;
+	error = MBUS_ERR_NO_ERROR;
+#if MBUS_TRAFFIC_ENTRIES > 0
+	traffic_bits = 0;
+#endif
+}
+
+static void enqueue_tx(struct MBus_tx_t* tx) {
+	tx->next = NULL;
+	tx->queued = true;
+	if (tx_queue_tail) {
+		tx_queue_tail->next = tx;
+	} else {
+		tx_queue_head = tx;
+	}
+	tx_queue_tail = tx;
+}
+
+static void dequeue_tx(void) {
+	struct MBus_tx_t* tx = tx_queue_head;
+	tx_queue_head = tx->next;
+	if (tx_queue_head == NULL) tx_queue_tail = NULL;
+	tx->queued = false;
+}
+
+#if MBUS_LOOPBACK
+// Reports a loopback delivery and, if the message does not also go on the
+// bus, its completion. Both go through the event queue (when enabled) so they
+// stay in order with the events of the interrupt handlers.
+static void post_loopback(enum MBus_loopback_t route, int idx,
+		struct MBus_tx_t* tx, int length) {
+	enum MBus_error_t err = MBUS_ERR_NO_ERROR;
+
+	if (idx == LOOPBACK_NO_ROOM) {
+		// Nothing may be queued, so fail right away like a busy bus
+		if (route != LOOPBACK_ONLY) return;
+		if (tx) {
+			if (tx->done) tx->done(tx, 0, MBUS_ERR_BUS_BUSY);
+		} else {
+			mbus->MBus_send_done(0, MBUS_ERR_BUS_BUSY);
+		}
+		return;
+	}
+	if (idx < 0) {
+		err = MBUS_ERR_RECV_OVERFLOW;
+		length = 0;
+	}
+#if MBUS_EVENT_QUEUE > 0
+	disable_interrupts();
+	events_promised -= loopback_events(route);
+#endif
+	if (idx >= 0) post_recv(idx);
+	if (route == LOOPBACK_ONLY) {
+		if (tx) {
+			post_tx_done(tx, length, err);
+		} else {
+			post_send_done(length, err);
+		}
+	}
+#if MBUS_EVENT_QUEUE > 0
+	enable_interrupts();
+#endif
+}
+#else
+static inline void post_loopback(enum MBus_loopback_t route, int idx,
+		struct MBus_tx_t* tx, int length) {
+	(void) route;
+	(void) idx;
+	(void) tx;
+	(void) length;
+}
+#endif
+
+// Requests the bus for the next queued transmission. Only safe in IDLE.
+static void start_queued_tx(void) {
+	if (tx_requested || (tx_queue_head == NULL)) return;
+	// Waits for MBus_run to make room for its completion
+	if (event_room() == 0) return;
+
+	tx_cur = tx_queue_head;
+	tx_buf = tx_cur->buf;
+	tx_length = tx_cur->length;
+	tx_priority = tx_cur->is_priority;
+	tx_requested = true;
+	logical = TRANSMIT;
+	SET_DOUT_LOW();
+}
+
+// Whether the message being sent is a broadcast. Addresses go out LSB first,
+// so the prefix of a short address is the low nibble of the first byte and a
+// long address is marked by a low nibble of 0xf.
+static bool tx_is_broadcast(void) {
+	if ((tx_buf[0] & 0xf) != 0xf) return (tx_buf[0] & 0xf) == 0;
+	if (tx_length < 4) return false;
+	return ((tx_buf[0] & 0xf0) == 0) && (tx_buf[1] == 0) &&
+		(tx_buf[2] == 0) && ((tx_buf[3] & 0xf) == 0);
+}
+
+// Result of the transmission that just ended. A receiver out of buffer space
+// interjects and leaves CB1 high (NAK), so a message cut short or NAK'd is
+// reported as an RX Overflow. A broadcast need not have any subscriber, so
+// only a unicast is checked for the NAK.
+static enum MBus_error_t tx_result(void) {
+	if (error != MBUS_ERR_NO_ERROR) return error;
+	if (tx_byte_idx < tx_length) return MBUS_ERR_RECV_OVERFLOW;
+	if ((ack == 1) && !tx_is_broadcast()) return MBUS_ERR_RECV_OVERFLOW;
+	return MBUS_ERR_NO_ERROR;
+}
+
+// Called when this node's request for the bus has been resolved
+static void finish_tx(enum MBus_error_t err) {
+	struct MBus_tx_t* tx = tx_cur;
+
+	tx_requested = false;
+	tx_cur = NULL;
+	if (tx == NULL) return;
+
+	if (tx_byte_idx > 0) {
+		dequeue_tx();
+		post_tx_done(tx, tx_byte_idx, err);
+	}
+	// else lost arbitration, leave queued to retry
+}
+
+// Queues the reply of the first registered autoreply that matches the
+// message just received. Returns true if the message was consumed.
+static bool autoreply(uint32_t addr, uint8_t first_byte) {
+	struct MBus_autoreply_t* ar;
+	for (ar=autoreplies; ar != NULL; ar=ar->next) {
+		if (ar->addr != addr) continue;
+		if ((first_byte & ar->mask) != ar->match) continue;
+
+		if (ar->reply.queued) {
+			// Previous reply still pending, it answers this too
+			stats.autoreplies_coalesced++;
+		} else {
+			enqueue_tx(&ar->reply);
+			stats.autoreplies++;
+		}
+		return true;
+	}
+	return false;
+}
+
+// Called once the prefix shows this node may receive the message (or may
+// snoop it). Picks a buffer while the rest of the address arrives so the
+// edge that ends the address phase has less to do. Nothing is held until
+// begin_receive uses it, so it is simply dropped if the message turns out
+// not to be ours. A failure here is not final, begin_receive tries again
+// with MBus_recv_buffer_alloc.
+static void prepare_receive(void) {
+	if (mbus->recv_length_hint || (MBus_lvc_count() > 0)) return;
+	rx_spec_idx = find_rx_buffer(0);
+}
+
+// Called on the second to last address bit of a broadcast. Looks up the
+// subscription to both channels the last bit may select.
+static inline void prepare_channel(void) {
+	rx_channel_bits = (mbus->broadcast_channels >> ((rx_addr & 0x7) << 1)) & 3;
+}
+
+// Called on the last address bit of a broadcast
+static inline void resolve_channel(void) {
+	logical = ((rx_channel_bits >> last_din) & 1) ? RECEIVE : FORWARD;
+}
+
+static inline void flush_recv_addr(void) {
+	if (!rx_addr_pending) return;
+	mbus->recv_addrs[rx_buf_idx] = rx_recv_addr;
+	rx_addr_pending = false;
+}
+
+// Called once the address phase determines this node is a receiver. Claims a
+// buffer now, or if length hints are in use (or for multicast messages),
+// once the first byte arrives.
+static bool begin_receive(uint32_t addr) {
+	rx_bit_idx = 0;
+
+	rx_multicast = is_multicast(addr);
+	if (mbus->recv_length_hint || (MBus_lvc_count() > 0) || rx_multicast) {
+		rx_claim_deferred = true;
+		rx_deferred_addr = addr;
+		rx_buf_len = &rx_first_byte_len;
+		rx_buf = &rx_first_byte;
+		return true;
+	}
+
+	// Valid buffers are never invalidated by the client, so one picked by
+	// prepare_receive is still available
+	if (rx_spec_idx >= 0) {
+		use_rx_buffer(rx_spec_idx);
+	} else if (!claim_rx_buffer(0)) {
+		return false;
+	}
+	rx_recv_addr = addr;
+	rx_addr_pending = true;
+	return true;
+}
+
+// In promiscuous mode, also receives messages for other nodes. These are
+// neither ACK'd nor NAK'd, and are dropped if there is no room for them.
+static void begin_snoop(uint32_t addr) {
+	if (!begin_receive(addr)) return;
+	logical = RECEIVE;
+	rx_snooping = true;
+}
+
+// Stops receiving the current message, which is forwarded without being
+// ACK'd or NAK'd
+static void drop_receive(void) {
+	logical = FORWARD;
+	rx_snooping = false;
+	rx_claim_deferred = false;
+	rx_byte_idx = 0;
+}
+
+// Called once the first payload byte of a deferred receive is complete
+static bool finish_deferred_receive(void) {
+	rx_claim_deferred = false;
+
+	if (lvc_begin_receive(rx_deferred_addr, rx_first_byte)) return true;
+
+	// The first byte of a multicast message is its group, not a hint
+	if (!claim_rx_buffer(
+				(mbus->recv_length_hint && !rx_multicast) ?
+				rx_first_byte : 0)) {
+		return false;
+	}
+	rx_buf[0] = rx_first_byte;
+	mbus->recv_addrs[rx_buf_idx] = rx_deferred_addr;
+	return true;
+}
+
+// NAKs (or, when snooping, drops) a message that has no room in the event
+// queue for its MBus_recv. Not leaving CB1 to the sender is the NAK. No error
+// is posted either, as there is no room for it.
+static void refuse_receive(void) {
+#if MBUS_EVENT_QUEUE > 0
+	stats.events_refused++;
+#endif
+	drop_receive();
+}
+
+// NAKs a message that ended one byte past the end of its RX buffer. The check
+// in LATCH_DATA only runs on the bit after that byte, which it never sent.
+static void reject_overlong(void) {
+	if (rx_snooping) {
+		drop_receive();
+		return;
+	}
+	logical = FORWARD;
+	error = MBUS_ERR_RECV_OVERFLOW;
+	stats.recv_overflows++;
+#if MBUS_HISTOGRAMS
+	if ((rx_lvc_idx < 0) && !rx_timesync) record_length(rx_byte_idx);
+#endif
+}
+
+
 void MBus_init(struct MBus_t *m) {
 	mbus = m;
 
@@ -93,6 +1097,7 @@ void MBus_init(struct MBus_t *m) {
 	last_clkin = 1;
 	last_din = 1;
 	last_dout = 1;
+	dout_next = -1;
 	interrupt_count = 0;
 	error = MBUS_ERR_NO_ERROR;
 
@@ -107,22 +1112,379 @@ void MBus_init(struct MBus_t *m) {
 	rx_byte_idx = 0;
 	rx_buf_len = &rx_buf_zero;
 	rx_buf = NULL;
+	rx_spec_idx = -1;
+	rx_addr_pending = false;
+	rx_claim_deferred = false;
+	rx_first_byte_len = 1;
+	rx_lvc_idx = -1;
+	rx_snooping = false;
+	rx_timesync = false;
+	rx_multicast = false;
 
 	ack = 0;
+
+	tx_requested = false;
+	tx_cur = NULL;
+	tx_queue_head = NULL;
+	tx_queue_tail = NULL;
+	autoreplies = NULL;
+
+	idle_signalled = false;
+	idle_avg = 0;
+
+#if MBUS_TIMESYNC
+	timesync_tx.queued = false;
+	timesync_offset = 0;
+	timesync_synced = false;
+#endif
+
+#if MBUS_TRACE_DEPTH > 0
+	trace_head = 0;
+	trace_tail = 0;
+	trace_lost = 0;
+	trace_last_phase = 0;
+	trace_last_logical = FORWARD;
+#endif
+
+#if MBUS_EVENT_QUEUE > 0
+	event_head = 0;
+	event_tail = 0;
+#endif
+
+#if MBUS_TRAFFIC_ENTRIES > 0
+	traffic_used = 0;
+	traffic_prefixes = 0;
+	traffic_bits = 0;
+#endif
+
+	memset((void*) &stats, 0, sizeof(stats));
+}
+
+void MBus_init_hotjoin(struct MBus_t *m, bool clkin, bool din) {
+	MBus_init(m);
+
+	// Mirror the bus so that this node is transparent from the start
+	last_clkin = clkin;
+	last_din = din;
+	SET_CLKOUT_TO(clkin);
+	SET_DOUT_TO(din);
+
+	// Both lines high (and stable, see libmbus.h) is an idle bus
+	if (clkin && din) return;
+
+	// Otherwise where in a transaction the bus is cannot be told from the
+	// levels. Forward everything as after a synchronization error, which
+	// the next interjection recovers from, but with no error to report.
+	state = ERROR;
+	trace();
+}
+
+#if MBUS_EVENT_QUEUE > 0
+unsigned MBus_run(void) {
+	unsigned n = 0;
+
+	for (;;) {
+		struct MBus_event_t e;
+
+		disable_interrupts();
+		if (event_tail == event_head) {
+			enable_interrupts();
+			break;
+		}
+		e = events[event_tail % MBUS_EVENT_QUEUE];
+		event_tail++;
+		enable_interrupts();
+
+		deliver(&e);
+		n++;
+	}
+
+	// Queued transmissions wait for room for their completion
+	if (n > 0) {
+		disable_interrupts();
+		if (state == IDLE) start_queued_tx();
+		enable_interrupts();
+	}
+	return n;
+}
+#else
+unsigned MBus_run(void) {
+	return 0;
+}
+#endif
+
+const volatile struct MBus_stats_t* MBus_get_stats(void) {
+	return &stats;
+}
+
+void MBus_queue_send(struct MBus_tx_t* tx) {
+	enum MBus_loopback_t route;
+	int idx;
+
+	route = loopback(tx->buf, tx->length, &idx);
+	if (route != LOOPBACK_NONE) post_loopback(route, idx, tx, tx->length);
+	if (route == LOOPBACK_ONLY) return;
+
+	disable_interrupts();
+	enqueue_tx(tx);
+	if (state == IDLE) start_queued_tx();
+	enable_interrupts();
+}
+
+void MBus_autoreply_register(struct MBus_autoreply_t* ar) {
+	ar->reply.queued = false;
+	ar->next = autoreplies;
+	autoreplies = ar;
+}
+
+#if MBUS_LVC_ENTRIES > 0
+int MBus_lvc_register(uint32_t addr, uint8_t key) {
+	unsigned idx = lvc_slot(addr, key);
+	int entry = idx;
+
+	// The first payload byte cannot be both a key and a length hint
+	if (mbus->recv_length_hint) return -1;
+
+	// The handlers match incoming messages against the slot
+	disable_interrupts();
+	if (lvc[idx].in_use) {
+		if ((lvc[idx].addr != addr) || (lvc[idx].key != key)) entry = -1;
+	} else {
+		lvc[idx].addr = addr;
+		lvc[idx].key = key;
+		lvc[idx].current = 0;
+		lvc[idx].sequence = 0;
+		lvc[idx].lengths[0] = 0;
+		lvc[idx].lengths[1] = 0;
+		lvc[idx].in_use = true;
+		lvc_count++;
+	}
+	enable_interrupts();
+
+	return entry;
+}
+
+unsigned MBus_lvc_count(void) {
+	return lvc_count;
+}
+
+int MBus_lvc_read(unsigned entry, uint8_t* buf, unsigned* sequence) {
+	unsigned seq;
+	int length;
+
+	if (entry >= MBUS_LVC_ENTRIES) return -1;
+
+	do {
+		uint8_t cur;
+		int i;
+
+		seq = lvc[entry].sequence;
+		cur = lvc[entry].current;
+		length = lvc[entry].lengths[cur];
+		for (i=0; i < length; i++) {
+			buf[i] = lvc[entry].data[cur][i];
+		}
+	} while (seq != lvc[entry].sequence);
+
+	if (sequence) *sequence = seq;
+	return length;
+}
+#else
+int MBus_lvc_register(uint32_t addr, uint8_t key) {
+	(void) addr;
+	(void) key;
+	return -1;
+}
+
+unsigned MBus_lvc_count(void) {
+	return 0;
+}
+
+int MBus_lvc_read(unsigned entry, uint8_t* buf, unsigned* sequence) {
+	(void) entry;
+	(void) buf;
+	(void) sequence;
+	return -1;
+}
+#endif
+
+#if MBUS_TRACE_DEPTH > 0
+unsigned MBus_trace_read(struct MBus_trace_entry_t* buf, unsigned max,
+		unsigned* lost) {
+	unsigned n = 0;
+
+	disable_interrupts();
+	while ((n < max) && (trace_tail != trace_head)) {
+		buf[n++] = trace_ring[trace_tail % MBUS_TRACE_DEPTH];
+		trace_tail++;
+	}
+	if (lost) *lost = trace_lost;
+	trace_lost = 0;
+	enable_interrupts();
+
+	return n;
+}
+#else
+unsigned MBus_trace_read(struct MBus_trace_entry_t* buf, unsigned max,
+		unsigned* lost) {
+	(void) buf;
+	(void) max;
+	if (lost) *lost = 0;
+	return 0;
+}
+#endif
+
+#if MBUS_TRAFFIC_ENTRIES > 0
+unsigned MBus_traffic_read(struct MBus_traffic_entry_t* buf, unsigned max) {
+	struct MBus_traffic_entry_t copy[MBUS_TRAFFIC_ENTRIES];
+	unsigned used, n, idx;
+
+	disable_interrupts();
+	used = traffic_used;
+	for (idx=0; idx < used; idx++) copy[idx] = traffic[idx];
+	enable_interrupts();
+
+	// Selection sort, both max and the table are small
+	for (n=0; (n < max) && (n < used); n++) {
+		unsigned best = n;
+		for (idx=n + 1; idx < used; idx++) {
+			if (copy[idx].messages > copy[best].messages) best = idx;
+		}
+		buf[n] = copy[best];
+		copy[best] = copy[n];
+	}
+	return n;
+}
+
+uint16_t MBus_traffic_short_prefixes(void) {
+	return traffic_prefixes;
+}
+
+void MBus_traffic_reset(void) {
+	disable_interrupts();
+	traffic_used = 0;
+	traffic_prefixes = 0;
+	enable_interrupts();
+}
+#else
+unsigned MBus_traffic_read(struct MBus_traffic_entry_t* buf, unsigned max) {
+	(void) buf;
+	(void) max;
+	return 0;
+}
+
+uint16_t MBus_traffic_short_prefixes(void) {
+	return 0;
+}
+
+void MBus_traffic_reset(void) {
+}
+#endif
+
+#if MBUS_MULTICAST
+void MBus_multicast_join(uint8_t group) {
+	disable_interrupts();
+	multicast_groups[group >> 5] |= 1UL << (group & 31);
+	enable_interrupts();
+}
+
+void MBus_multicast_leave(uint8_t group) {
+	disable_interrupts();
+	multicast_groups[group >> 5] &= ~(1UL << (group & 31));
+	enable_interrupts();
+}
+
+bool MBus_multicast_member(uint8_t group) {
+	return multicast_groups[group >> 5] & (1UL << (group & 31));
+}
+#else
+void MBus_multicast_join(uint8_t group) {
+	(void) group;
+}
+
+void MBus_multicast_leave(uint8_t group) {
+	(void) group;
+}
+
+bool MBus_multicast_member(uint8_t group) {
+	(void) group;
+	return false;
 }
+#endif
+
+#if MBUS_TIMESYNC
+bool MBus_timesync_broadcast(void) {
+	bool queued = false;
+
+	if (mbus->get_time == NULL) return false;
+
+	disable_interrupts();
+	if (!timesync_tx.queued) {
+		unsigned i;
+		// Short broadcast address, bit-reversed (see above)
+		timesync_buf[0] = 0;
+		for (i=0; i < 8; i++) {
+			if (MBUS_TIMESYNC_CHANNEL & (0x80 >> i)) timesync_buf[0] |= 1 << i;
+		}
+		// The time itself is filled in as the address goes out
+		timesync_tx.buf = timesync_buf;
+		timesync_tx.length = sizeof(timesync_buf);
+		timesync_tx.is_priority = 0;
+		timesync_tx.done = NULL;
+		enqueue_tx(&timesync_tx);
+		if (state == IDLE) start_queued_tx();
+		queued = true;
+	}
+	enable_interrupts();
+
+	return queued;
+}
+
+bool MBus_timesync_valid(void) {
+	return timesync_synced;
+}
+
+uint32_t MBus_timesync_from_local(uint32_t local_time) {
+	return local_time + timesync_offset;
+}
+#else
+bool MBus_timesync_broadcast(void) {
+	return false;
+}
+
+bool MBus_timesync_valid(void) {
+	return false;
+}
+
+uint32_t MBus_timesync_from_local(uint32_t local_time) {
+	return local_time;
+}
+#endif
 
 void MBus_send(uint8_t* buf, int length, uint8_t is_priority) {
-	tx_buf = buf;
-	tx_length = length;
-	tx_priority = is_priority;
+	enum MBus_loopback_t route;
+	int idx;
+
+	route = loopback(buf, length, &idx);
+	if (route != LOOPBACK_NONE) post_loopback(route, idx, NULL, length);
+	if (route == LOOPBACK_ONLY) return;
+
+	disable_interrupts();
+	if ((state == IDLE) && !tx_requested && (event_room() > 0)) {
+		tx_buf = buf;
+		tx_length = length;
+		tx_priority = is_priority;
+		tx_cur = NULL;
+		tx_requested = true;
 
-	if (state == IDLE) {
 		// It is safe to directly change logical model and drive DOUT
 		// here. The state changes to PREARB at the falling edge of
 		// clock the half-period before arbitration resolution
 		logical = TRANSMIT;
 		SET_DOUT_LOW();
+		enable_interrupts();
 	} else {
+		enable_interrupts();
 		// TODO: Handle TX request when bus is busy better. We could
 		// probably check this status at the end of the current
 		// transaction? Currently we just immediately fail.
@@ -131,27 +1493,39 @@ void MBus_send(uint8_t* buf, int length, uint8_t is_priority) {
 }
 
 void MBus_CLKIN_int_handler(int CLKIN_val) {
+	bool clkout_done;
+	uint32_t pad_start;
+
 	if (last_clkin == CLKIN_val) {
 		if (state == ERROR) return;
 		state = ERROR;
 		error = MBUS_ERR_CLOCK_SYNCH_ERROR;
+		trace();
 		return;
 	}
 	last_clkin = CLKIN_val;
 
+	// Forward the clock (and any bit decided on the previous edge) before
+	// anything else, as every node's handler latency adds to the clock's
+	// trip around the ring. Holding CLKOUT for a request only differs from
+	// forwarding on a falling edge, and the latch edges that can start a
+	// request are rising ones once the bus has idled with CLK low, so only
+	// the first transaction after MBus_init may wait for the state update.
+	clkout_done = requesting(state) || CLKIN_val || !may_request(state);
+	if (clkout_done) SET_CLKOUT_TO(CLKIN_val || requesting(state));
+	if (dout_next >= 0) {
+		SET_DOUT_TO(dout_next);
+		dout_next = -1;
+	}
+	pad_start = pad_begin();
+
 	interrupt_count = 0;
 
 	switch (state) {
 		case IDLE:
 			state = PREARB;
-			tx_bit_idx = 0;
-			tx_byte_idx = 0;
-			rx_addr = 0;
-			rx_bit_idx = 0;
-			rx_byte_idx = 0;
-			rx_buf_len = &rx_buf_zero;
-			rx_buf = NULL;
-			ack = 0;
+			reset_transaction();
+			end_idle();
 			break;
 
 		case PREARB:
@@ -160,6 +1534,7 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 
 		case ARBITRATION:
 			state = PRIO_DRIVE;
+			if (tx_priority) dout_next = 1;
 			if (!last_din) {
 				// Lost arbitration or didn't participate
 				logical = FORWARD;
@@ -176,9 +1551,6 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 
 		case PRIO_DRIVE:
 			state = PRIO_LATCH;
-			if (tx_priority) {
-				SET_DOUT_HIGH();
-			}
 			break;
 
 		case PRIO_LATCH:
@@ -208,7 +1580,10 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 			}
 
 			// Beginning of data array is address, jump to sending
-			if (logical == TRANSMIT) state = DRIVE_DATA;
+			if (logical == TRANSMIT) {
+				state = DRIVE_DATA;
+				tx_prepare_bit();
+			}
 			break;
 
 		case ARB_RESERVED_DRIVE:
@@ -234,6 +1609,7 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 			if (rx_bit_idx == 4) {
 				if (rx_addr == 0xf) {
 					state = DRIVE_LONG_ADDR;
+					break;
 				} else if (rx_addr == mbus->short_prefix) {
 					logical = RECEIVE;
 				} else if (rx_addr == 0) {
@@ -241,35 +1617,28 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 				} else {
 					logical = FORWARD;
 				}
+				if ((logical != FORWARD) || mbus->promiscuous_mode) {
+					prepare_receive();
+				}
+			} else if (rx_bit_idx == 7) {
+				if (logical == RECEIVE_BROADCAST) prepare_channel();
 			} else if (rx_bit_idx == 8) {
 				// Short address finished. If long address,
 				// already jumped to *_LONG_ADDR states.
 				state = DRIVE_DATA;
-				if (logical == RECEIVE_BROADCAST) {
-					unsigned channel = rx_addr & 0xf;
-					if (mbus->broadcast_channels &
-							(1 << channel)) {
-						logical = RECEIVE;
-					} else {
-						logical = FORWARD;
-					}
-				}
+				if (logical == RECEIVE_BROADCAST) resolve_channel();
 				if (logical == RECEIVE) {
-					for (rx_buf_idx=0; rx_buf_idx < RX_BUFFER_COUNT; rx_buf_idx++) {
-						if (mbus->recv_buffer_lengths[rx_buf_idx] > 0) {
-							rx_buf_len = &mbus->recv_buffer_lengths[rx_buf_idx];
-							rx_buf = mbus->recv_buffers[rx_buf_idx];
-							break;
-						}
-					}
-					if (rx_buf == NULL) {
+					if (
+							!timesync_begin_receive(rx_addr) &&
+							!begin_receive(rx_addr << 24)
+					   ) {
 						// No available rx buffers
 						state = REQUEST_INTERRUPT;
 						error = MBUS_ERR_RECV_OVERFLOW;
 						break;
 					}
-					mbus->recv_addrs[rx_buf_idx] = (rx_addr << 24);
-					rx_bit_idx = 0;
+				} else if (mbus->promiscuous_mode) {
+					begin_snoop(rx_addr << 24);
 				}
 			}
 			break;
@@ -293,43 +1662,32 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 				} else {
 					logical = FORWARD;
 				}
+				if ((logical != FORWARD) || mbus->promiscuous_mode) {
+					prepare_receive();
+				}
+			} else if (rx_bit_idx == 31) {
+				if (logical == RECEIVE_BROADCAST) prepare_channel();
 			} else if (rx_bit_idx == 32) {
 				state = DRIVE_DATA;
-				if (logical == RECEIVE_BROADCAST) {
-					char channel = rx_addr & 0xf;
-					if (mbus->broadcast_channels &
-							(1 << channel)) {
-						logical = RECEIVE;
-					} else {
-						logical = FORWARD;
-					}
-				}
+				if (logical == RECEIVE_BROADCAST) resolve_channel();
 				if (logical == RECEIVE) {
-					for (rx_buf_idx=0; rx_buf_idx < RX_BUFFER_COUNT; rx_buf_idx++) {
-						if (mbus->recv_buffer_lengths[rx_buf_idx] > 0) {
-							rx_buf_len = &mbus->recv_buffer_lengths[rx_buf_idx];
-							rx_buf = mbus->recv_buffers[rx_buf_idx];
-							break;
-						}
-					}
-					if (rx_buf == NULL) {
+					if (!begin_receive(rx_addr)) {
 						// No available rx buffers
 						state = REQUEST_INTERRUPT;
 						error = MBUS_ERR_RECV_OVERFLOW;
 						break;
 					}
-					mbus->recv_addrs[rx_buf_idx] = rx_addr;
-					rx_bit_idx = 0;
+				} else if (mbus->promiscuous_mode) {
+					begin_snoop(rx_addr);
 				}
 			}
 			break;
 
 		case DRIVE_DATA:
 			state = LATCH_DATA;
+			flush_recv_addr();
 			if (logical == TRANSMIT) {
-				uint8_t bit;
-				bit = !!(tx_buf[tx_byte_idx] & (1 << tx_bit_idx));
-				SET_DOUT_TO(bit);
+				// Bit already driven, see tx_prepare_bit
 				tx_bit_idx++;
 				if (tx_bit_idx == 8) {
 					tx_bit_idx = 0;
@@ -340,10 +1698,14 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 
 		case LATCH_DATA:
 			state = DRIVE_DATA;
+			traffic_bit();
 			if (logical == TRANSMIT) {
+				timesync_stamp();
 				if (tx_byte_idx == tx_length) {
 					state = REQUEST_INTERRUPT;
 					error = MBUS_ERR_NO_ERROR;
+				} else {
+					tx_prepare_bit();
 				}
 			}
 			if (logical == RECEIVE) {
@@ -352,16 +1714,52 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 				// the sender in the ring (it doesn't wait
 				// until 2 bits in to trigger overflow)
 				if (rx_byte_idx > *rx_buf_len) {
+					if (rx_snooping) {
+						drop_receive();
+						break;
+					}
 					state = REQUEST_INTERRUPT;
 					logical = TRANSMIT;
 					error = MBUS_ERR_RECV_OVERFLOW;
+					stats.recv_overflows++;
+#if MBUS_HISTOGRAMS
+					if ((rx_lvc_idx < 0) && !rx_timesync) {
+						record_length(rx_byte_idx);
+					}
+#endif
 					break;
 				}
-				rx_buf[rx_byte_idx] |= last_din << rx_bit_idx;
+				// Never write past the end of the buffer
+				if (rx_byte_idx < *rx_buf_len) {
+					// Buffers are recycled, clear stale contents
+					if (rx_bit_idx == 0) rx_buf[rx_byte_idx] = 0;
+					rx_buf[rx_byte_idx] |= last_din << rx_bit_idx;
+				}
 				rx_bit_idx++;
 				if (rx_bit_idx == 8) {
 					rx_bit_idx = 0;
 					rx_byte_idx++;
+					if (rx_claim_deferred) {
+						if (multicast_reject()) {
+							// Other groups are snooped
+							// like other nodes' messages
+							if (!mbus->promiscuous_mode) {
+								drop_receive();
+								break;
+							}
+							rx_snooping = true;
+						}
+						if (!finish_deferred_receive()) {
+							if (rx_snooping) {
+								drop_receive();
+								break;
+							}
+							state = REQUEST_INTERRUPT;
+							logical = TRANSMIT;
+							error = MBUS_ERR_RECV_OVERFLOW;
+							break;
+						}
+					}
 				}
 			}
 			break;
@@ -379,50 +1777,58 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 
 		case PRE_BEGIN_CONTROL:
 			state = BEGIN_CONTROL;
+			// Fall through
 
 		case BEGIN_CONTROL:
 			state = DRIVE_CB0;
-			break;
-
-		case DRIVE_CB0:
-			state = LATCH_CB0;
 			if (logical == INTERRUPTER) {
 				if (error == MBUS_ERR_NO_ERROR) {
-					SET_DOUT_HIGH(); // EoM;
+					dout_next = 1; // EoM;
 				} else {
-					SET_DOUT_LOW(); // !EoM;
+					dout_next = 0; // !EoM;
 				}
 			}
 			break;
 
+		case DRIVE_CB0:
+			state = LATCH_CB0;
+			break;
+
 		case LATCH_CB0:
 			state = DRIVE_CB1;
 			ack = last_din;
-			if (logical == RECEIVE) {
+			if ((logical == RECEIVE) && (rx_byte_idx > *rx_buf_len)) {
+				reject_overlong();
+			} else if ((logical == RECEIVE) && (rx_lvc_idx < 0) &&
+					!rx_timesync && (event_room() == 0)) {
+				refuse_receive();
+			}
+			if ((logical == RECEIVE) && !rx_snooping) {
 				// Swtich to TX mode to send CB1
 				logical = TRANSMIT;
 			} else if (error == MBUS_ERR_NO_ERROR) {
 				logical = FORWARD;
 			}
-			break;
-
-		case DRIVE_CB1:
-			state = LATCH_CB1;
 			if (logical == INTERRUPTER) {
 				if (error == MBUS_ERR_RECV_OVERFLOW) {
-					SET_DOUT_HIGH(); // Tx/Rx Error
+					dout_next = 1; // Tx/Rx Error
 				}
 			} else if (logical == TRANSMIT) {
 				// Actually the receiver here, but TX'ing CB1
 				if (ack == 1) {
-					SET_DOUT_LOW(); // Ack
+					dout_next = 0; // Ack
 				}
 			}
 			break;
 
+		case DRIVE_CB1:
+			state = LATCH_CB1;
+			break;
+
 		case LATCH_CB1:
 			state = DRIVE_IDLE;
 			logical = FORWARD;
+			rx_cb1 = last_din;
 			if (tx_byte_idx > 0) {
 				// We transmitted
 				ack = last_din;
@@ -437,7 +1843,9 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 			if (last_din == 1) {
 				state = IDLE;
 			} else {
+				// Another request is already pending
 				state = PREARB;
+				reset_transaction();
 			}
 			break;
 
@@ -445,55 +1853,88 @@ void MBus_CLKIN_int_handler(int CLKIN_val) {
 			break;
 	}
 
-	if (
-			(state == REQUEST_INTERRUPT) ||
-			(state == REQUESTING_INTERRUPT) ||
-			(state == REQUESTED_INTERRUPT)
-	   ) {
-		SET_CLKOUT_HIGH();
-	} else {
-		SET_CLKOUT_TO(last_clkin);
+	if (!clkout_done) {
+		SET_CLKOUT_TO(last_clkin || requesting(state));
 	}
 
+	trace();
+
 	if (state == BEGIN_IDLE) {
+		// Messages without payload never reach DRIVE_DATA
+		flush_recv_addr();
+		traffic_record();
 		if (error != MBUS_ERR_NO_ERROR) {
-			mbus->MBus_error(error);
+			post_error(error);
 		} else if (tx_byte_idx > 0) {
-			mbus->MBus_send_done(tx_byte_idx, error);
+			if (tx_cur == NULL) {
+				post_send_done(tx_byte_idx, tx_result());
+			}
+		} else if (rx_lvc_idx >= 0) {
+			lvc_publish();
+		} else if (rx_timesync) {
+			timesync_publish();
+		} else if (rx_snooping) {
+			// Without a whole byte the buffer may not even be
+			// claimed yet (rx_buf_len then points at
+			// rx_first_byte_len), so there is nothing to report
+			if ((rx_byte_idx > 0) && !rx_claim_deferred) {
+				*rx_buf_len = -rx_byte_idx;
+				post_snoop_recv(rx_buf_idx, ack, rx_cb1);
+			} else {
+				drop_receive();
+			}
 		} else if (rx_byte_idx > 0) {
-			*rx_buf_len = -rx_byte_idx;
-			mbus->MBus_recv(rx_buf_idx);
+#if MBUS_HISTOGRAMS
+			record_length(rx_byte_idx);
+			// The buffer just filled is not yet marked as held
+			stats.recv_occupancy_hist[held_rx_buffers()]++;
+#endif
+			if (!autoreply(mbus->recv_addrs[rx_buf_idx], rx_buf[0])) {
+				*rx_buf_len = -rx_byte_idx;
+				post_recv(rx_buf_idx);
+			}
 		}
+		if (tx_requested) finish_tx(tx_result());
+	} else if (state == IDLE) {
+		// Only true on the edge that ends a transaction
+		start_queued_tx();
+		begin_idle();
 	}
+
+	pad_end(pad_start);
 }
 
 void MBus_DIN_int_handler(int DIN_val) {
+	bool forward;
+	uint32_t pad_start;
+
 	if (last_din == DIN_val) {
 		if (state == ERROR) return;
 		state = ERROR;
 		error = MBUS_ERR_DATA_SYNCH_ERROR;
+		trace();
 		return;
 	}
 	last_din = DIN_val;
 
 	if (last_din) interrupt_count++;
 
+	// Forward first, as in MBus_CLKIN_int_handler. The third rising edge
+	// of an interjection moves to PRE_BEGIN_CONTROL, which always forwards.
+	forward = (logical != TRANSMIT) || (interrupt_count >= 3) ||
+		((state >= REQUEST_INTERRUPT) && (state <= BEGIN_CONTROL));
+	if (forward) SET_DOUT_TO(last_din);
+	pad_start = pad_begin();
+
 	if (interrupt_count >= 3) {
 		if (state == REQUESTED_INTERRUPT) {
 			logical = INTERRUPTER;
 		}
 		state = PRE_BEGIN_CONTROL;
+		// A data bit decided before the interjection is never sent
+		dout_next = -1;
+		trace();
 	}
 
-	if (state < REQUEST_INTERRUPT) {
-		if (logical != TRANSMIT) {
-			SET_DOUT_TO(last_din);
-		}
-	} else if (state <= BEGIN_CONTROL) {
-		SET_DOUT_TO(last_din);
-	} else {
-		if (logical != TRANSMIT) {
-			SET_DOUT_TO(last_din);
-		}
-	}
+	pad_end(pad_start);
 }
@@ -32,11 +32,27 @@
  *   whenever the DIN and CLKIN gpios change. These functions are designed to
  *   be called from within an interrupt context, and may call set_gpio_val.
  *
+ *   MBus_init assumes the bus is idle. A node that may start while a
+ *   transaction is in flight (e.g. after a watchdog reset) should call
+ *   MBus_init_hotjoin instead, with the CLKIN and DIN levels sampled just
+ *   before its pin interrupts are enabled. The node forwards both lines
+ *   unchanged from the start. If both are high it joins as an idle node.
+ *   Both lines are also high at points within a transaction, so sample them
+ *   only once they have been stable for longer than the slowest bus clock
+ *   period. Otherwise the node does not take part in the bus until the next
+ *   interjection ends the current transaction, and from there follows the
+ *   control phase into idle like every other node. Sends requested in the
+ *   meantime wait (MBus_queue_send) or fail with MBUS_ERR_BUS_BUSY
+ *   (MBus_send).
+ *
  *   MBus_send will arbitrate for the bus and then write an array of bytes
  *   directly onto the wires (that is, the address must be included as the
  *   first byte(s) given to MBus_send). Upon completion of transmission the
- *   MBus_send_done callback will be called with the result. MBus_send_done
- *   should be treated as an interrupt and perform minimal processing.
+ *   MBus_send_done callback will be called with the result. A message the
+ *   receiver cut short or NAK'd (no RX buffer, or no such node) completes
+ *   with MBUS_ERR_RECV_OVERFLOW; broadcasts are only checked for being cut
+ *   short. MBus_send_done should be treated as an interrupt and perform
+ *   minimal processing.
  *   Only one call to MBus_send may be "live" at any time. The effect of
  *   multiple calls to MBus_send without waiting for an intervening
  *   MBus_send_done is undefined.
@@ -50,17 +66,216 @@
  *   client may do anything with the buffer. To mark a buffer as valid again,
  *   the client simply sets the length to a positive value.
  *   If no buffers are available when a message is addressed to this library,
- *   it will interject the transmission and NAK the message sender indicating
- *   an RX Overflow.
+ *   it will first give the optional MBus_recv_buffer_alloc callback a chance
+ *   to provide one. If it cannot, MBus will interject the transmission and
+ *   NAK the message sender indicating an RX Overflow.
  *   Upon receipt of a whole message, MBus_recv callback is called. This
  *   function should be treated as an interrupt and perform minimal processing.
+ *
+ *   For periodic state updates where only the newest value matters, MBus can
+ *   keep a last-value cache instead (requires MBUS_LVC_ENTRIES > 0). Once an
+ *   address and key (the first payload byte, e.g. a register address) are
+ *   registered with MBus_lvc_register, matching messages overwrite that
+ *   entry rather than claiming an RX buffer and MBus_recv is not called.
+ *   MBus_lvc_read returns the latest value at any time. Registering any
+ *   entry defers RX buffer selection until the first payload byte arrives.
+ *   As that byte is the key, the cache cannot be used together with
+ *   recv_length_hint.
+ *
+ *   Simple queries (e.g. status or ping) can be answered without a round
+ *   trip through the application. Templates registered with
+ *   MBus_autoreply_register are matched when a message completes; on a match
+ *   the message is consumed (its RX buffer stays valid, MBus_recv is not
+ *   called) and the reply is queued.
+ *
+ *   MBus_queue_send is an alternative to MBus_send that never fails with
+ *   MBUS_ERR_BUS_BUSY. Queued transmissions (including automatic replies)
+ *   request the bus in order as soon as it next goes idle and are retried if
+ *   arbitration is lost. Each reports completion through its own callback
+ *   rather than MBus_send_done. Any number may be queued at once.
+ *
+ *   Applications that do heavy work with interrupts masked (e.g. flash
+ *   writes) can avoid delaying the MBus handlers mid-transaction by
+ *   scheduling that work in the idle windows reported by the optional
+ *   MBus_idle_begin and MBus_idle_end callbacks.
+ *
+ *   Applications with an event loop can instead have the completion
+ *   callbacks (MBus_send_done, MBus_recv, MBus_snoop_recv, MBus_error and
+ *   the done callbacks of queued transmissions) run from the loop (requires
+ *   MBUS_EVENT_QUEUE > 0). The handlers then queue an event, and MBus_run
+ *   calls the callbacks of every queued event in order. The optional
+ *   MBus_events_pending callback reports that the queue has become
+ *   non-empty. It is called only on that transition, so the loop must drain
+ *   the queue completely with MBus_run every time. On Linux hosts
+ *   libmbus_eventfd.h turns it into a file descriptor for epoll. The
+ *   handlers never call callbacks directly while the queue is enabled, so
+ *   they always arrive in order and from MBus_run. The one exception is a
+ *   send that fails with MBUS_ERR_BUS_BUSY, which is never queued and still
+ *   reports that from within MBus_send (or, for a loopback message, from
+ *   within MBus_queue_send). While the queue is full, messages are NAK'd,
+ *   queued transmissions wait and MBus_send fails with MBUS_ERR_BUS_BUSY (as
+ *   do loopback messages, see MBUS_LOOPBACK). MBus_error reports that find
+ *   the queue full are dropped; both are counted in MBus_stats_t. One slot
+ *   is kept for the completion of a transmission, so the queue needs at
+ *   least two.
+ *
+ *   To debug timing on a ring, MBus can record its state transitions into a
+ *   trace ring (requires MBUS_TRACE_DEPTH > 0), timestamped with the
+ *   optional get_time callback. Drain it with MBus_trace_read.
+ *
+ *   To see which flows use the bus, any node can count the messages it
+ *   forwards or receives per destination address (requires
+ *   MBUS_TRAFFIC_ENTRIES > 0). Broadcasts are counted per channel. A fixed
+ *   number of flows is tracked. When a new flow arrives with the table full,
+ *   it replaces the flow with the fewest messages and inherits its counts,
+ *   so the busiest flows are always kept ("space-saving"). Every count is
+ *   then an upper bound, too high by at most the entry's overcount. Messages
+ *   this node transmits and messages without payload are not counted. Read
+ *   the busiest flows with MBus_traffic_read, and the short prefixes that
+ *   have been sent to with MBus_traffic_short_prefixes.
+ *
+ *   With MBUS_LOOPBACK, MBus_send and MBus_queue_send recognize messages
+ *   addressed to this node itself. They are copied into the smallest RX
+ *   buffer that fits and the send completes as if the message had been ACK'd
+ *   (or with 0 bytes sent and an RX Overflow if no buffer fits). MBus_recv and
+ *   the completion are reported like those of bus transactions, i.e. through
+ *   the event queue if MBUS_EVENT_QUEUE is enabled and otherwise from within
+ *   the send function. If the event queue has no room, a message for this
+ *   node only fails with MBUS_ERR_BUS_BUSY from within the send function.
+ *   Broadcasts on a subscribed channel other than 0 are delivered locally
+ *   and then sent on the bus; if the bus send fails the local copy has still
+ *   been delivered. Loopback messages bypass autoreplies and the last-value
+ *   cache.
+ *
+ *   To reach a group of nodes with one transaction, send a broadcast on
+ *   MBUS_MULTICAST_CHANNEL whose first payload byte is a group ID (requires
+ *   MBUS_MULTICAST). Nodes subscribe to that channel as usual and join
+ *   groups with MBus_multicast_join. Other nodes stop receiving as soon as
+ *   the group ID has arrived, without claiming an RX buffer, and members
+ *   receive the message (group ID included) like any other. In promiscuous
+ *   mode other groups' messages are snooped instead.
+ *
+ *   Timestamps taken on different nodes can be compared once their clocks
+ *   are aligned (requires MBUS_TIMESYNC). One node, usually the one next to
+ *   the mediator, periodically calls MBus_timesync_broadcast; every node
+ *   subscribed to MBUS_TIMESYNC_CHANNEL then converts its own get_time
+ *   values with MBus_timesync_from_local. Both ends sample get_time on the
+ *   clock edge that ends the address phase rather than when the message is
+ *   queued or delivered, so arbitration and interrupt latency do not matter;
+ *   what remains is a small constant (the clock propagation delay between
+ *   the nodes, plus at most one bus clock period). Only the offset is
+ *   corrected, clock drift is bounded by broadcasting often enough.
  */
 
+/* The options below may also be set on the compiler command line (-D). Some
+ * of them change the layout of struct MBus_t and struct MBus_stats_t, so
+ * libmbus.c, the modules and the application must all be built with the
+ * same values. */
+
 /* This controls the number of RX buffer pointers. For most applications the
  * default value (2) is a good choice. */
+#ifndef RX_BUFFER_COUNT
 #define RX_BUFFER_COUNT 2
+#endif
 _Static_assert(RX_BUFFER_COUNT > 0, "Must have at least one RX buffer slot");
 
+/* This controls the number of entries in the last-value cache (see
+ * MBus_lvc_register). The default value (0) disables the cache. Each
+ * address and key maps to a single entry, so that the handlers look it up
+ * in constant time. Registration fails if that entry is taken, even while
+ * others are free, so allow for more entries than keys. */
+#ifndef MBUS_LVC_ENTRIES
+#define MBUS_LVC_ENTRIES 0
+#endif
+/* Longest message, in bytes, that may be stored in a last-value cache entry */
+#ifndef MBUS_LVC_VALUE_LENGTH
+#define MBUS_LVC_VALUE_LENGTH 4
+#endif
+_Static_assert(MBUS_LVC_VALUE_LENGTH > 0, "LVC entries must hold the key byte");
+
+/* Set to 1 to record histograms of received message lengths and RX buffer
+ * occupancy in struct MBus_stats_t. tools/mbus_bufadvise turns them into a
+ * recommended RX_BUFFER_COUNT and buffer length. */
+#ifndef MBUS_HISTOGRAMS
+#define MBUS_HISTOGRAMS 0
+#endif
+/* Number of message length histogram bins. Bin 0 counts messages of 1 byte,
+ * bin i messages of 2^(i-1)+1 to 2^i bytes and the last bin everything
+ * longer. */
+#ifndef MBUS_LENGTH_BINS
+#define MBUS_LENGTH_BINS 8
+#endif
+_Static_assert(MBUS_LENGTH_BINS >= 2, "Need at least two length bins");
+
+/* This controls the number of entries in the state trace ring (see
+ * MBus_trace_read). The default value (0) disables tracing. Must be a power
+ * of two. */
+#ifndef MBUS_TRACE_DEPTH
+#define MBUS_TRACE_DEPTH 0
+#endif
+_Static_assert((MBUS_TRACE_DEPTH & (MBUS_TRACE_DEPTH - 1)) == 0,
+		"MBUS_TRACE_DEPTH must be a power of two");
+
+/* Set to 1 to enable time synchronization (see MBus_timesync_broadcast).
+ * Sync messages are broadcast on MBUS_TIMESYNC_CHANNEL, which must not be
+ * used for anything else on the ring. */
+#ifndef MBUS_TIMESYNC
+#define MBUS_TIMESYNC 0
+#endif
+#ifndef MBUS_TIMESYNC_CHANNEL
+#define MBUS_TIMESYNC_CHANNEL 7
+#endif
+_Static_assert(MBUS_TIMESYNC_CHANNEL > 0 && MBUS_TIMESYNC_CHANNEL < 16,
+		"Channel 0 is used for enumeration");
+
+/* Set to 1 to enable multicast groups (see MBus_multicast_join). Multicast
+ * messages are broadcasts on MBUS_MULTICAST_CHANNEL whose first payload
+ * byte is the group ID. */
+#ifndef MBUS_MULTICAST
+#define MBUS_MULTICAST 0
+#endif
+#ifndef MBUS_MULTICAST_CHANNEL
+#define MBUS_MULTICAST_CHANNEL 5
+#endif
+_Static_assert(MBUS_MULTICAST_CHANNEL > 0 && MBUS_MULTICAST_CHANNEL < 16,
+		"Channel 0 is used for enumeration");
+
+/* This controls the depth of the completion event queue (see MBus_run). The
+ * default value (0) calls the completion callbacks directly from the
+ * interrupt handlers. Must be a power of two. */
+#ifndef MBUS_EVENT_QUEUE
+#define MBUS_EVENT_QUEUE 0
+#endif
+_Static_assert((MBUS_EVENT_QUEUE & (MBUS_EVENT_QUEUE - 1)) == 0,
+		"MBUS_EVENT_QUEUE must be a power of two");
+_Static_assert(MBUS_EVENT_QUEUE != 1,
+		"One slot is always kept for a transmission's completion");
+
+/* This controls the number of flows tracked by the traffic matrix (see
+ * MBus_traffic_read). The default value (0) disables it. */
+#ifndef MBUS_TRAFFIC_ENTRIES
+#define MBUS_TRAFFIC_ENTRIES 0
+#endif
+
+/* Set to 1 to deliver messages this node sends to itself (its own short or
+ * full prefix, or a broadcast channel it subscribes to) through its local
+ * RX path. Messages to its own prefix then never use the bus, and
+ * broadcasts go to the bus as well. */
+#ifndef MBUS_LOOPBACK
+#define MBUS_LOOPBACK 0
+#endif
+
+/* Set to a number of get_cycles ticks to pad every interrupt handler call to
+ * at least that long (0 disables). The outputs are written at a fixed point
+ * early in each handler, so with the padding neither their timing nor the
+ * latency of the next edge depends on the state, which keeps forwarding
+ * jitter from accumulating around the ring. Callbacks run inside the
+ * handlers and count against the budget; calls that exceed it are counted
+ * in struct MBus_stats_t. tools/mbus_isrbench reports per-state timing. */
+#ifndef MBUS_CONSTANT_TIME
+#define MBUS_CONSTANT_TIME 0
+#endif
+
 enum MBus_error_t {
 	MBUS_ERR_NO_ERROR,
 	MBUS_ERR_BUS_BUSY,
@@ -68,6 +283,102 @@ enum MBus_error_t {
 	MBUS_ERR_DATA_SYNCH_ERROR,
 	MBUS_ERR_RECV_OVERFLOW,
 	MBUS_ERR_INTERRUPTED,
+	MBUS_ERR_TIMEOUT,
+};
+
+// Counters maintained by the library. Read-only to the client.
+struct MBus_stats_t {
+	// Messages received into a buffer provided by MBus_recv_buffer_alloc
+	// that would otherwise have been NAK'd
+	unsigned recv_buffer_allocs;
+	// Messages NAK'd (or, when snooping, dropped) because no (large enough)
+	// RX buffer was available
+	unsigned recv_overflows;
+	// Messages stored in the last-value cache
+	unsigned lvc_updates;
+	// Automatic replies queued
+	unsigned autoreplies;
+	// Matching messages that arrived while their reply was still queued
+	unsigned autoreplies_coalesced;
+	// Time sync messages received (see MBus_timesync_broadcast)
+	unsigned timesyncs;
+#if MBUS_EVENT_QUEUE > 0
+	// Messages NAK'd (snoops dropped, loopback messages failed with
+	// MBUS_ERR_BUS_BUSY) because the event queue had no room for them.
+	// These are not reported through MBus_error.
+	unsigned events_refused;
+	// MBus_error reports dropped because the event queue was full
+	unsigned events_dropped;
+#endif
+#if MBUS_LOOPBACK
+	// Messages this node sent to itself (see MBUS_LOOPBACK)
+	unsigned loopbacks;
+#endif
+#if MBUS_MULTICAST
+	// Multicast messages for groups this node is not in
+	unsigned multicast_filtered;
+#endif
+#if MBUS_CONSTANT_TIME > 0
+	// Handler calls that took longer than MBUS_CONSTANT_TIME
+	unsigned constant_time_overruns;
+#endif
+#if MBUS_HISTOGRAMS
+	// Messages received into an RX buffer, by length (see MBUS_LENGTH_BINS).
+	// Messages NAK'd for not fitting are counted at the shortest length
+	// they are known to have.
+	unsigned recv_length_hist[MBUS_LENGTH_BINS];
+	// Messages addressed to this node by the number of RX buffers held by
+	// the client when they completed. The last bin counts messages NAK'd
+	// because the client held every buffer.
+	unsigned recv_occupancy_hist[RX_BUFFER_COUNT + 1];
+#endif
+};
+
+// One flow of the traffic matrix (see MBus_traffic_read)
+struct MBus_traffic_entry_t {
+	uint32_t addr;             // Formatted as recv_addrs
+	unsigned messages;
+	unsigned bytes;            // Payload bytes, in whole bytes latched
+	unsigned overcount;        // Upper bound on the messages (and their
+	                           // bytes) counted that belong to other flows
+};
+
+// One state trace record. A record is written whenever the bus phase
+// (arbitration, address, data, interjection, control, idle) or the logical
+// role of this node changes.
+struct MBus_trace_entry_t {
+	uint32_t time;             // From get_time, 0 if not provided
+	uint8_t state;             // enum MBus_state_t in libmbus.c
+	uint8_t logical;           // enum MBus_logical_t in libmbus.c
+};
+
+// A transmission for MBus_queue_send. The structure and the buffer it points
+// to must remain valid while it is queued.
+struct MBus_tx_t {
+	uint8_t* buf;              // Address first, as for MBus_send
+	int length;
+	uint8_t is_priority;
+
+	// [OPT] Callback when transmission completes.
+	// May be called from within an interrupt handler.
+	void (*done)(struct MBus_tx_t*, int bytes_sent, enum MBus_error_t);
+
+	// Private
+	volatile bool queued;
+	struct MBus_tx_t* volatile next;
+};
+
+// A reply sent without involving the application whenever a message sent to
+// addr (formatted as recv_addrs) arrives with (first payload byte & mask) ==
+// match. See MBus_autoreply_register.
+struct MBus_autoreply_t {
+	uint32_t addr;
+	uint8_t match;
+	uint8_t mask;
+	struct MBus_tx_t reply;
+
+	// Private
+	struct MBus_autoreply_t* next;
 };
 
 struct MBus_t {
@@ -80,8 +391,10 @@ struct MBus_t {
 	// Bit Vector. Broadcast channels to subscribe to.
 	uint16_t broadcast_channels;
 
-	// Boolean. Call MBus_recv for all messages. Does not ACK messages
-	// that would otherwise have been ignored.
+	// Boolean. Call MBus_recv (or MBus_snoop_recv) for all messages. Does
+	// not ACK messages that would otherwise have been ignored. Messages for
+	// other nodes are silently dropped if no RX buffer is available or they
+	// do not fit.
 	uint8_t promiscuous_mode;
 
 	// [OPT] Static short prefix. This value will be overridden if
@@ -109,6 +422,68 @@ struct MBus_t {
 	// May be called from within an interrupt handler.
 	void (*MBus_error)(enum MBus_error_t);
 
+	// [OPT] Callback when a message is addressed to this node but no RX
+	// buffer is available. The callback may make a buffer of at least
+	// min_length bytes available (min_length is 0 if the length is not
+	// known) by setting recv_buffers[idx] and then recv_buffer_lengths[idx],
+	// in which case it returns idx. Otherwise it returns a negative value
+	// and the message is NAK'd with an RX Overflow.
+	// Called from within an interrupt handler in the middle of a
+	// transaction. It must complete in bounded time well within half a bus
+	// clock period (e.g. popping a block off of a free list).
+	int (*MBus_recv_buffer_alloc)(int min_length);
+
+	// [OPT] Boolean. The first payload byte of every message sent to this
+	// node is a length hint: the total payload length in bytes (including
+	// the hint byte itself), or 0 if unknown. RX buffer selection is
+	// deferred until the hint has been received, and the smallest available
+	// buffer that fits is used. This allows a mix of many small and a few
+	// large buffers. Cannot be combined with the last-value cache, which
+	// uses the same byte as its key (see MBus_lvc_register).
+	bool recv_length_hint;
+
+	// [OPT] Functions that disable and re-enable the CLKIN and DIN
+	// interrupts. Used to protect state shared with the interrupt handlers
+	// when library functions are called outside of an interrupt context.
+	// These may also be called from within MBus callbacks, so they should
+	// restore the previous interrupt state rather than blindly enable.
+	void (*disable_interrupts)(void);
+	void (*enable_interrupts)(void);
+
+	// [OPT] Free-running timestamp for state trace records, idle window
+	// predictions and time sync, in any unit (but the same unit on every
+	// node if time sync is used). Called from within an interrupt handler.
+	uint32_t (*get_time)(void);
+
+	// [OPT] Free-running cycle counter used to pad the handlers when
+	// MBUS_CONSTANT_TIME is set. Should be cheap to read (e.g. a CPU cycle
+	// counter or a fast timer register). Called from within an interrupt
+	// handler.
+	uint32_t (*get_cycles)(void);
+
+	// [OPT] Callbacks when the bus goes idle at the end of a transaction
+	// and when the next transaction begins (PREARB). predicted_idle is a
+	// moving average of recent idle window lengths in get_time units, or
+	// 0 if there is no estimate yet (or get_time is not provided). Not
+	// called for windows this node ends itself by requesting the bus.
+	// Called from within an interrupt handler.
+	void (*MBus_idle_begin)(uint32_t predicted_idle);
+	void (*MBus_idle_end)(void);
+
+	// [OPT] Callback when the completion event queue (see MBUS_EVENT_QUEUE)
+	// becomes non-empty. It is not called again until MBus_run has emptied
+	// the queue. Called from within an interrupt handler, or from within
+	// MBus_send/MBus_queue_send for loopback messages (see MBUS_LOOPBACK).
+	void (*MBus_events_pending)(void);
+
+	// [OPT] Callback when a message for another node has been received in
+	// promiscuous mode, with the control bits that ended it: cb0 is 1 for
+	// a regular end of message and 0 if it was interrupted, in which case
+	// cb1 is 1 for an error; after a regular end cb1 is 0 if the receiver
+	// ACK'd. If not set, MBus_recv is called instead.
+	// May be called from within an interrupt handler.
+	void (*MBus_snoop_recv)(unsigned recv_buf_idx, bool cb0, bool cb1);
+
 	// Note these must be last so that the offset of remaining structure
 	// elements are not affected by changing RX_BUFFER_COUNT
 	//
@@ -121,11 +496,68 @@ struct MBus_t {
 };
 
 void MBus_init(struct MBus_t *); // Pointer must remain valid forever
-void MBus_run(void);
+void MBus_init_hotjoin(struct MBus_t *, bool clkin, bool din);
+unsigned MBus_run(void);
+  // Calls the completion callbacks of all queued events and returns how many
+  // there were. Always returns 0 if the event queue is disabled.
 void MBus_send(uint8_t* buf, int length, uint8_t is_priority);
   // buf pointer must reamin valid until MBus_send_done is called
   // MBus_send_done may be called from this function (e.g. if MBUS_ERR_BUS_BUSY)
 
+const volatile struct MBus_stats_t* MBus_get_stats(void);
+
+void MBus_queue_send(struct MBus_tx_t*);
+  // Structure must not be modified until its done callback is called
+
+void MBus_autoreply_register(struct MBus_autoreply_t*);
+  // Must be called before any matching message may arrive (e.g. before
+  // subscribing to the relevant broadcast channel). Structure must remain
+  // valid forever.
+
+int MBus_lvc_register(uint32_t addr, uint8_t key);
+  // addr is formatted as recv_addrs. Returns the entry index, or -1 if the
+  // cache is disabled, recv_length_hint is set or the entry for addr and key
+  // is already taken by another key (see MBUS_LVC_ENTRIES)
+unsigned MBus_lvc_count(void);
+int MBus_lvc_read(unsigned entry, uint8_t* buf, unsigned* sequence);
+  // Copies the latest value (including the key byte) into buf, which must
+  // hold MBUS_LVC_VALUE_LENGTH bytes, and returns its length (0 if no value
+  // has been received yet), or -1 if entry is not below MBUS_LVC_ENTRIES.
+  // If sequence is not NULL it is set to a number that changes with every
+  // update.
+
+unsigned MBus_trace_read(struct MBus_trace_entry_t* buf, unsigned max,
+		unsigned* lost);
+  // Removes up to max of the oldest trace records into buf and returns how
+  // many were copied. If lost is not NULL it is set to the number of records
+  // overwritten before they could be read since the previous call. Always
+  // returns 0 if tracing is disabled. Dumped as text, one
+  // "<node> <time> <state> <logical>" line per record, the records of all
+  // nodes can be converted by tools/mbus_trace2json for viewing.
+
+unsigned MBus_traffic_read(struct MBus_traffic_entry_t* buf, unsigned max);
+  // Copies up to max of the tracked flows into buf, most messages first, and
+  // returns how many were copied. Always returns 0 if the traffic matrix is
+  // disabled.
+uint16_t MBus_traffic_short_prefixes(void);
+  // Bit n is set if a message to short prefix n has been seen
+void MBus_traffic_reset(void);
+
+void MBus_multicast_join(uint8_t group);
+void MBus_multicast_leave(uint8_t group);
+bool MBus_multicast_member(uint8_t group);
+  // Always false if multicast is disabled
+
+bool MBus_timesync_broadcast(void);
+  // Queues a time sync message carrying this node's time (its synchronized
+  // time if it has received a sync itself). Returns false if time sync is
+  // disabled, get_time is not provided or a sync is still queued.
+bool MBus_timesync_valid(void);
+  // True once a sync message has been received
+uint32_t MBus_timesync_from_local(uint32_t local_time);
+  // Converts a get_time value to the time of the node that sent the last
+  // sync. Returns local_time unchanged if no sync has been received.
+
 void MBus_DIN_int_handler(int DIN_val);
 void MBus_CLKIN_int_handler(int CLKIN_val);
 
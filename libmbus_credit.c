@@ -0,0 +1,204 @@
+#include "libmbus_credit.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define PEERS 16
+
+static struct MBus_t* credit_mbus;
+
+static struct {
+	volatile int credits;      // -1 until the first advertisement
+	volatile unsigned inflight;
+	struct MBus_credit_tx_t* volatile head;
+	struct MBus_credit_tx_t* volatile tail;
+} peers[PEERS];
+
+static uint8_t adv_buf[3];
+static struct MBus_tx_t adv_tx;
+
+static volatile struct MBus_credit_stats_t stats;
+
+
+static inline void disable_interrupts(void) {
+	if (credit_mbus->disable_interrupts) credit_mbus->disable_interrupts();
+}
+static inline void enable_interrupts(void) {
+	if (credit_mbus->enable_interrupts) credit_mbus->enable_interrupts();
+}
+
+// Short broadcast address for a channel as it goes on the wire. Addresses
+// are sent LSB first but assembled by receivers MSB first.
+static uint8_t broadcast_addr(uint8_t channel) {
+	uint8_t addr = 0;
+	unsigned i;
+	for (i=0; i < 8; i++) {
+		if (channel & (0x80 >> i)) addr |= 1 << i;
+	}
+	return addr;
+}
+
+static void message_sent(struct MBus_tx_t*, int, enum MBus_error_t);
+
+// Hands a message to the transmit queue, using a credit. Interrupts must
+// be disabled.
+static void dispatch(struct MBus_credit_tx_t* c) {
+	unsigned p = c->dest & (PEERS - 1);
+
+	if (peers[p].credits > 0) peers[p].credits--;
+	peers[p].inflight++;
+	c->tx.done = message_sent;
+	MBus_queue_send(&c->tx);
+}
+
+// Sends held messages while the receiver has credit. Interrupts must be
+// disabled.
+static void release(unsigned p) {
+	while (peers[p].head && (peers[p].credits != 0)) {
+		struct MBus_credit_tx_t* c = peers[p].head;
+		peers[p].head = c->next;
+		if (peers[p].head == NULL) peers[p].tail = NULL;
+		dispatch(c);
+	}
+}
+
+static void hold(struct MBus_credit_tx_t* c, bool front) {
+	unsigned p = c->dest & (PEERS - 1);
+
+	if (front) {
+		c->next = peers[p].head;
+		peers[p].head = c;
+		if (peers[p].tail == NULL) peers[p].tail = c;
+	} else {
+		c->next = NULL;
+		if (peers[p].tail) {
+			peers[p].tail->next = c;
+		} else {
+			peers[p].head = c;
+		}
+		peers[p].tail = c;
+	}
+}
+
+// Must be first in struct MBus_credit_tx_t, the cast relies on it
+_Static_assert(offsetof(struct MBus_credit_tx_t, tx) == 0,
+		"tx must be the first member");
+
+static void message_sent(struct MBus_tx_t* tx, int bytes_sent,
+		enum MBus_error_t err) {
+	struct MBus_credit_tx_t* c = (struct MBus_credit_tx_t*) tx;
+	unsigned p = c->dest & (PEERS - 1);
+
+	disable_interrupts();
+	peers[p].inflight--;
+	if ((err == MBUS_ERR_RECV_OVERFLOW) && (peers[p].credits < 0)) {
+		// The receiver never advertised, so no advertisement
+		// would ever release the message again
+		stats.failed++;
+	} else if (err == MBUS_ERR_RECV_OVERFLOW) {
+		// Another sender used the credit first. Hold it until the
+		// receiver advertises again, ahead of later messages.
+		peers[p].credits = 0;
+		hold(c, true);
+		stats.overflows++;
+		enable_interrupts();
+		return;
+	}
+	enable_interrupts();
+
+	if (c->done) c->done(c, bytes_sent, err);
+}
+
+
+void MBus_credit_init(struct MBus_t* m) {
+	unsigned p;
+
+	credit_mbus = m;
+	for (p=0; p < PEERS; p++) {
+		peers[p].credits = -1;
+		peers[p].inflight = 0;
+		peers[p].head = NULL;
+		peers[p].tail = NULL;
+	}
+	adv_tx.queued = false;
+	memset((void*) &stats, 0, sizeof(stats));
+}
+
+void MBus_credit_send(struct MBus_credit_tx_t* c) {
+	unsigned p = c->dest & (PEERS - 1);
+
+	disable_interrupts();
+	if ((peers[p].head == NULL) && (peers[p].credits != 0)) {
+		dispatch(c);
+	} else {
+		hold(c, false);
+		stats.held++;
+	}
+	enable_interrupts();
+}
+
+bool MBus_credit_recv(unsigned recv_buf_idx) {
+	volatile uint8_t* buf = credit_mbus->recv_buffers[recv_buf_idx];
+
+	if (credit_mbus->recv_addrs[recv_buf_idx] !=
+			(uint32_t) MBUS_CREDIT_CHANNEL << 24) {
+		return false;
+	}
+	if (credit_mbus->recv_buffer_lengths[recv_buf_idx] > -2) return true;
+
+	MBus_credit_update(buf[0], buf[1]);
+	return true;
+}
+
+bool MBus_credit_advertise(void) {
+	bool queued = false;
+
+	disable_interrupts();
+	if (!adv_tx.queued) {
+		adv_buf[0] = broadcast_addr(MBUS_CREDIT_CHANNEL);
+		adv_buf[1] = credit_mbus->short_prefix & 0xf;
+		adv_buf[2] = MBus_credit_free_buffers();
+		adv_tx.buf = adv_buf;
+		adv_tx.length = sizeof(adv_buf);
+		adv_tx.is_priority = 0;
+		adv_tx.done = NULL;
+		MBus_queue_send(&adv_tx);
+		stats.advertised++;
+		queued = true;
+	}
+	enable_interrupts();
+
+	return queued;
+}
+
+unsigned MBus_credit_free_buffers(void) {
+	unsigned idx, count = 0;
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		if (credit_mbus->recv_buffer_lengths[idx] > 0) count++;
+	}
+	return count;
+}
+
+void MBus_credit_update(uint8_t short_prefix, unsigned credits) {
+	unsigned p = short_prefix & (PEERS - 1);
+
+	disable_interrupts();
+	// Messages already queued were not yet received when the
+	// advertisement was sent, they still need their buffers
+	if (credits > peers[p].inflight) {
+		peers[p].credits = credits - peers[p].inflight;
+	} else {
+		peers[p].credits = 0;
+	}
+	stats.updates++;
+	release(p);
+	enable_interrupts();
+}
+
+int MBus_credit_available(uint8_t short_prefix) {
+	return peers[short_prefix & (PEERS - 1)].credits;
+}
+
+const volatile struct MBus_credit_stats_t* MBus_credit_get_stats(void) {
+	return &stats;
+}
@@ -0,0 +1,97 @@
+#ifndef LIBMBUS_CREDIT_H
+#define LIBMBUS_CREDIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libmbus.h"
+
+/* Credit-based flow control between senders and receivers.
+ *
+ * A message sent to a node with no free RX buffer is NAK'd with an RX
+ * Overflow, which costs a whole bus transaction and only tells the sender
+ * after the fact. With this layer receivers advertise how many RX buffers
+ * they have free, and senders hold messages for a receiver until it has
+ * credit for them, so the bus does not carry messages that would be NAK'd.
+ *
+ * Receivers advertise on broadcast channel MBUS_CREDIT_CHANNEL:
+ *
+ *   <channel broadcast> <short prefix of the receiver> <free RX buffers>
+ *
+ * Advertisements can also be piggybacked on application replies (e.g. as a
+ * field of a status response), with MBus_credit_free_buffers on the
+ * receiver and MBus_credit_update on the sender.
+ *
+ * Each message sent uses one of the receiver's credits. A receiver starts
+ * with unlimited credit until its first advertisement, so nodes that do not
+ * advertise are unaffected. Credits are shared by all senders to a
+ * receiver; if several send at once an overflow is still possible. The
+ * message is then held again (not failed) and the receiver's credit drops
+ * to 0 until its next advertisement. A receiver that never advertised
+ * cannot release it, so there the message fails with the RX Overflow and
+ * the receiver stays unlimited. Flow control applies to short
+ * prefixes only, messages to full prefixes use MBus_queue_send directly.
+ *
+ * Usage:
+ *   Call MBus_credit_init after MBus_init. Senders subscribe to
+ *   MBUS_CREDIT_CHANNEL and pass every message to MBus_credit_recv from the
+ *   MBus_recv callback; it returns true if the message was an
+ *   advertisement. Either way the RX buffer remains the client's to
+ *   release. Receivers call MBus_credit_advertise after releasing RX
+ *   buffers, and periodically so that lost advertisements are replaced.
+ */
+
+#ifndef MBUS_CREDIT_CHANNEL
+#define MBUS_CREDIT_CHANNEL 6
+#endif
+_Static_assert(MBUS_CREDIT_CHANNEL > 0 && MBUS_CREDIT_CHANNEL < 16,
+		"Channel 0 is used for enumeration");
+
+// A transmission for MBus_credit_send. Must remain valid until its done
+// callback is called.
+struct MBus_credit_tx_t {
+	struct MBus_tx_t tx;       // buf, length and is_priority as for
+	                           // MBus_queue_send, done is used internally
+	uint8_t dest;              // Short prefix the message is sent to
+
+	// Callback when transmission completes (with an RX Overflow only if dest
+	// never advertised).
+	// May be called from within an interrupt handler.
+	void (*done)(struct MBus_credit_tx_t*, int bytes_sent, enum MBus_error_t);
+
+	// Private
+	struct MBus_credit_tx_t* next;
+};
+
+// Counters maintained by the layer. Read-only to the client.
+struct MBus_credit_stats_t {
+	// Messages that had to wait for credit
+	unsigned held;
+	// Messages NAK'd anyway (concurrent senders) and held again
+	unsigned overflows;
+	// Messages NAK'd by receivers that never advertised, failed back
+	unsigned failed;
+	// Advertisements sent and received
+	unsigned advertised;
+	unsigned updates;
+};
+
+void MBus_credit_init(struct MBus_t*);
+
+void MBus_credit_send(struct MBus_credit_tx_t*);
+  // Queues the message as soon as dest has credit for it
+
+bool MBus_credit_recv(unsigned recv_buf_idx);
+
+bool MBus_credit_advertise(void);
+  // Queues an advertisement of this node's free RX buffers. Returns false
+  // if the previous one has not been sent yet.
+unsigned MBus_credit_free_buffers(void);
+void MBus_credit_update(uint8_t short_prefix, unsigned credits);
+  // Applies an advertisement received some other way
+
+int MBus_credit_available(uint8_t short_prefix);
+  // Returns the credit left for a receiver, or -1 if it never advertised
+const volatile struct MBus_credit_stats_t* MBus_credit_get_stats(void);
+
+#endif // LIBMBUS_CREDIT_H
@@ -0,0 +1,186 @@
+#include "libmbus_enum.h"
+
+#define ENUM_CMD_RESPONSE   0x1
+#define ENUM_CMD_ENUMERATE  0x2
+#define ENUM_CMD_INVALIDATE 0x3
+
+// Broadcast, channel 0
+#define ENUM_ADDR 0x00
+
+static volatile enum {
+	ENUM_IDLE,
+	ENUM_INVALIDATING,
+	ENUM_ENUMERATING,
+} enum_state = ENUM_IDLE;
+
+static struct MBus_enum_result_t result;
+static void (*enum_done)(const struct MBus_enum_result_t*);
+static unsigned expected;
+static uint32_t (*enum_clock)(void);
+static uint32_t start_time;
+static uint32_t timeout;
+
+static uint8_t next_prefix;
+// Short prefixes that must not be assigned
+static uint16_t skip_prefixes;
+static unsigned retries;
+static uint8_t cmd_buf[2];
+static struct MBus_tx_t cmd_tx;
+
+// Armed once the current command is on the bus, so time spent waiting for
+// the bus does not count against the response timeout
+static volatile bool     deadline_armed;
+static volatile uint32_t deadline;
+
+
+static void finish(enum MBus_error_t err) {
+	enum_state = ENUM_IDLE;
+	result.elapsed = enum_clock() - start_time;
+	result.error = err;
+	if (enum_done) enum_done(&result);
+}
+
+// Moves next_prefix to the first assignable prefix after prefix, or to 0 if
+// there is none. 0 (broadcast) and 0xf (long address) are never assignable.
+static void advance_prefix(uint8_t prefix) {
+	for (prefix++; prefix < 0xf; prefix++) {
+		if (!(skip_prefixes & (1 << prefix))) {
+			next_prefix = prefix;
+			return;
+		}
+	}
+	next_prefix = 0;
+}
+
+static void send_command(uint8_t cmd) {
+	deadline_armed = false;
+	retries = 0;
+	cmd_buf[1] = cmd;
+	MBus_queue_send(&cmd_tx);
+}
+
+static void send_enumerate(void) {
+	if (next_prefix == 0) {
+		// Out of prefixes, the remaining nodes keep their full ones
+		finish(MBUS_ERR_NO_ERROR);
+		return;
+	}
+	send_command((ENUM_CMD_ENUMERATE << 4) | next_prefix);
+}
+
+static void command_sent(struct MBus_tx_t* tx, int bytes_sent, enum MBus_error_t err) {
+	(void) tx;
+	(void) bytes_sent;
+
+	if (err != MBUS_ERR_NO_ERROR) {
+		// Not heard by all nodes, try again
+		if (retries == MBUS_ENUM_RETRIES) {
+			finish(err);
+			return;
+		}
+		retries++;
+		MBus_queue_send(&cmd_tx);
+		return;
+	}
+	result.transactions++;
+
+	if (enum_state == ENUM_INVALIDATING) {
+		enum_state = ENUM_ENUMERATING;
+		send_enumerate();
+		return;
+	}
+	deadline = enum_clock() + timeout;
+	deadline_armed = true;
+}
+
+
+void MBus_enum_start(struct MBus_t* m, bool invalidate, uint16_t in_use,
+		unsigned expected_nodes, uint32_t (*clock)(void),
+		uint32_t response_timeout,
+		void (*done)(const struct MBus_enum_result_t*)) {
+	result.count = 0;
+	result.transactions = 0;
+	result.elapsed = 0;
+	result.error = MBUS_ERR_NO_ERROR;
+	enum_done = done;
+	expected = expected_nodes;
+	enum_clock = clock;
+	start_time = clock();
+	timeout = response_timeout;
+
+	skip_prefixes = in_use | (1 << (m->short_prefix & 0xf));
+	advance_prefix(0);
+	cmd_buf[0] = ENUM_ADDR;
+	cmd_tx.buf = cmd_buf;
+	cmd_tx.length = sizeof(cmd_buf);
+	cmd_tx.is_priority = 0;
+	cmd_tx.done = command_sent;
+
+	if (invalidate) {
+		enum_state = ENUM_INVALIDATING;
+		send_command((ENUM_CMD_INVALIDATE << 4) | 0xf);
+	} else {
+		enum_state = ENUM_ENUMERATING;
+		send_enumerate();
+	}
+}
+
+bool MBus_enum_recv(struct MBus_t* m, unsigned recv_buf_idx) {
+	volatile uint8_t* buf = m->recv_buffers[recv_buf_idx];
+	uint32_t word;
+	unsigned short_prefix;
+
+	if (enum_state != ENUM_ENUMERATING) return false;
+	if (m->recv_addrs[recv_buf_idx] != (ENUM_ADDR << 24)) return false;
+	if (m->recv_buffer_lengths[recv_buf_idx] != -4) return false;
+
+	word = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+		((uint32_t) buf[2] << 8) | buf[3];
+	if ((word >> 28) != ENUM_CMD_RESPONSE) return false;
+	short_prefix = (word >> 4) & 0xf;
+	if (short_prefix != next_prefix) return false;
+
+	result.nodes[result.count].full_prefix = (word >> 8) & 0xfffff;
+	result.nodes[result.count].short_prefix = short_prefix;
+	result.count++;
+	result.transactions++;
+
+	if (
+			(result.count == MBUS_ENUM_MAX_NODES) ||
+			(result.count == expected)
+	   ) {
+		finish(MBUS_ERR_NO_ERROR);
+	} else {
+		advance_prefix(next_prefix);
+		send_enumerate();
+	}
+	return true;
+}
+
+void MBus_enum_poll(void) {
+	if (enum_state != ENUM_ENUMERATING) return;
+	if (!deadline_armed) return;
+
+	if ((int32_t) (enum_clock() - deadline) >= 0) {
+		// Nobody answered, every node has a prefix
+		finish(MBUS_ERR_NO_ERROR);
+	}
+}
+
+bool MBus_enum_busy(void) {
+	return enum_state != ENUM_IDLE;
+}
+
+const struct MBus_enum_result_t* MBus_enum_result(void) {
+	return &result;
+}
+
+int MBus_enum_lookup(uint32_t full_prefix) {
+	unsigned i;
+	for (i=0; i < result.count; i++) {
+		if (result.nodes[i].full_prefix == full_prefix) {
+			return result.nodes[i].short_prefix;
+		}
+	}
+	return -1;
+}
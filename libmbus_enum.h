@@ -0,0 +1,84 @@
+#ifndef LIBMBUS_ENUM_H
+#define LIBMBUS_ENUM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libmbus.h"
+
+/* Bulk enumeration driver for mediators and hosts.
+ *
+ * Assigns short prefixes to every node on the ring that does not yet have
+ * one, and builds a map from full prefix to short prefix. Enumeration uses
+ * the broadcast channel 0 (discovery and enumeration) messages:
+ *
+ *   Invalidate   0x3F           all nodes drop their short prefix
+ *   Enumerate    0x2S           nodes without a short prefix respond, the
+ *                               node that wins arbitration takes prefix S
+ *   Response     0x1FFFFFS0     sent by that node: full prefix F, short S
+ *
+ * The driver issues each Enumerate from the receive path as soon as the
+ * previous response arrives, so a ring of N nodes takes the minimum of 2N
+ * bus transactions (plus one Invalidate, if requested). If the number of
+ * nodes is known in advance the final Enumerate, which nobody answers and
+ * so costs a full response timeout, is skipped as well. There are only 14
+ * assignable short prefixes; on larger rings the remaining nodes keep using
+ * their full prefixes.
+ *
+ * Prefixes are handed out in increasing order, skipping the mediator's own
+ * short prefix and any the caller marks as in use. Without an Invalidate,
+ * nodes that already have a short prefix keep it (and do not respond), so
+ * the caller must mark those in use; with one, only the mediator's own
+ * prefix needs to be skipped. A command the bus fails to deliver is retried
+ * up to MBUS_ENUM_RETRIES times before enumeration finishes with its error.
+ *
+ * Usage:
+ *   The mediator must subscribe to broadcast channel 0. Start enumeration
+ *   with MBus_enum_start. From the MBus_recv callback, pass every message to
+ *   MBus_enum_recv first; it returns true if the message was an enumeration
+ *   response. Either way the RX buffer remains the client's to release. Call
+ *   MBus_enum_poll periodically to detect the end of enumeration. Time is
+ *   measured in caller-defined ticks, read with the clock function given to
+ *   MBus_enum_start. The response timeout starts when each Enumerate has
+ *   been sent, so clock is also called from the send completion, possibly
+ *   from within an interrupt handler. done is called when enumeration
+ *   finishes, possibly from within an interrupt handler.
+ */
+
+#define MBUS_ENUM_MAX_NODES 14
+// Times a failed command is sent again before enumeration gives up
+#ifndef MBUS_ENUM_RETRIES
+#define MBUS_ENUM_RETRIES 3
+#endif
+
+struct MBus_enum_node_t {
+	uint32_t full_prefix;
+	uint8_t short_prefix;
+};
+
+struct MBus_enum_result_t {
+	unsigned count;
+	struct MBus_enum_node_t nodes[MBUS_ENUM_MAX_NODES];
+	unsigned transactions;     // Bus transactions used
+	uint32_t elapsed;          // Ticks from start until done
+	enum MBus_error_t error;   // Why the last command failed if enumeration
+	                           // gave up, MBUS_ERR_NO_ERROR otherwise
+};
+
+void MBus_enum_start(struct MBus_t*, bool invalidate, uint16_t in_use,
+		unsigned expected_nodes, uint32_t (*clock)(void),
+		uint32_t response_timeout,
+		void (*done)(const struct MBus_enum_result_t*));
+  // Bit n of in_use is set if short prefix n must not be assigned. The
+  // mediator's own short prefix is always skipped. expected_nodes may be 0
+  // if unknown.
+
+bool MBus_enum_recv(struct MBus_t*, unsigned recv_buf_idx);
+void MBus_enum_poll(void);
+
+bool MBus_enum_busy(void);
+const struct MBus_enum_result_t* MBus_enum_result(void);
+int MBus_enum_lookup(uint32_t full_prefix);
+  // Returns the short prefix assigned to full_prefix, or -1
+
+#endif // LIBMBUS_ENUM_H
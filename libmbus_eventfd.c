@@ -0,0 +1,71 @@
+#include "libmbus_eventfd.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static struct MBus_t* eventfd_mbus;
+static int event_fd = -1;
+
+static volatile struct MBus_eventfd_stats_t stats;
+
+
+// Called from the interrupt handler context when the queue becomes
+// non-empty
+static void events_pending(void) {
+	uint64_t one = 1;
+	ssize_t ret;
+
+	// Can only fail if the counter would overflow, which needs 2^64 - 1
+	// signals without a dispatch; the fd is readable then anyway
+	ret = write(event_fd, &one, sizeof(one));
+	(void) ret;
+	stats.signals++;
+}
+
+
+int MBus_eventfd_init(struct MBus_t* m) {
+	if (MBUS_EVENT_QUEUE == 0) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	eventfd_mbus = m;
+	memset((void*) &stats, 0, sizeof(stats));
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0) return -1;
+	m->MBus_events_pending = events_pending;
+
+	// Events queued before the callback was set did not signal
+	events_pending();
+	return event_fd;
+}
+
+unsigned MBus_eventfd_dispatch(void) {
+	uint64_t count;
+	unsigned n;
+	ssize_t ret;
+
+	// Clear the fd first, events queued from here on signal it again
+	ret = read(event_fd, &count, sizeof(count));
+	(void) ret;
+
+	n = MBus_run();
+	stats.dispatches++;
+	stats.events += n;
+	if (n > stats.max_batch) stats.max_batch = n;
+	return n;
+}
+
+void MBus_eventfd_close(void) {
+	if (event_fd < 0) return;
+	eventfd_mbus->MBus_events_pending = NULL;
+	close(event_fd);
+	event_fd = -1;
+}
+
+const volatile struct MBus_eventfd_stats_t* MBus_eventfd_get_stats(void) {
+	return &stats;
+}
@@ -0,0 +1,48 @@
+#ifndef LIBMBUS_EVENTFD_H
+#define LIBMBUS_EVENTFD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libmbus.h"
+
+/* Readiness file descriptor for event loops on Linux hosts (simulators,
+ * daemons, bridges), built on the completion event queue (requires
+ * MBUS_EVENT_QUEUE > 0).
+ *
+ * MBus_eventfd_init returns an eventfd that becomes readable whenever
+ * completion events are waiting for MBus_run. Add it to an epoll set (edge-
+ * or level-triggered, EPOLLIN) and call MBus_eventfd_dispatch when it is
+ * readable. That clears the fd before draining the whole queue, so an
+ * event queued while the callbacks run makes the fd readable again rather
+ * than being missed. The fd is written only when the queue becomes
+ * non-empty, so a burst of completions costs one wakeup and one batch, and
+ * an idle bus costs no CPU at all.
+ *
+ * The fd is written from the context that calls the MBus interrupt handlers
+ * (write(2) on an eventfd is async-signal-safe). MBus_eventfd_dispatch must
+ * be called from one thread only.
+ */
+
+// Counters maintained by the helper. Read-only to the client.
+struct MBus_eventfd_stats_t {
+	// Times the fd was made readable
+	unsigned signals;
+	// Calls to MBus_eventfd_dispatch and the events they delivered
+	unsigned dispatches;
+	unsigned events;
+	// Most events delivered by one dispatch
+	unsigned max_batch;
+};
+
+int MBus_eventfd_init(struct MBus_t*);
+  // Call after MBus_init. Sets MBus_events_pending and returns the fd
+  // (non-blocking, close-on-exec, initially readable), or -1 with errno set
+  // (ENOSYS if the event queue is disabled).
+unsigned MBus_eventfd_dispatch(void);
+  // Delivers all queued events and returns how many there were
+void MBus_eventfd_close(void);
+
+const volatile struct MBus_eventfd_stats_t* MBus_eventfd_get_stats(void);
+
+#endif // LIBMBUS_EVENTFD_H
@@ -0,0 +1,126 @@
+#include "libmbus_pool.h"
+
+#include <stddef.h>
+
+
+static inline void enter_critical(struct MBus_pool_t* pool) {
+	if (pool->enter_critical) pool->enter_critical();
+}
+
+static inline void exit_critical(struct MBus_pool_t* pool) {
+	if (pool->exit_critical) pool->exit_critical();
+}
+
+// Sets *idx to the index of the block that block points into. Returns false
+// if it points outside of the pool.
+static inline bool block_index(struct MBus_pool_t* pool, uint8_t* block,
+		unsigned* idx) {
+	if (block < pool->blocks) return false;
+	*idx = (unsigned) (block - pool->blocks) >> pool->block_shift;
+	return *idx < pool->block_count;
+}
+
+// Must be called with the pool locked
+static uint8_t* pop_block(struct MBus_pool_t* pool) {
+	unsigned idx;
+
+	if (pool->free_count == 0) return NULL;
+
+	idx = pool->free_list[--pool->free_count];
+	pool->refcounts[idx] = 1;
+	return pool->blocks + (idx << pool->block_shift);
+}
+
+
+bool MBus_pool_init(struct MBus_pool_t* pool) {
+	unsigned i;
+
+	// Block indices are computed by shifting
+	if ((pool->block_size == 0) ||
+			(pool->block_size & (pool->block_size - 1))) {
+		pool->free_count = 0;
+		return false;
+	}
+	pool->block_shift = 0;
+	while ((1u << pool->block_shift) < pool->block_size) {
+		pool->block_shift++;
+	}
+
+	for (i=0; i < pool->block_count; i++) {
+		pool->refcounts[i] = 0;
+		pool->free_list[i] = i;
+	}
+	pool->free_count = pool->block_count;
+	return true;
+}
+
+uint8_t* MBus_pool_alloc(struct MBus_pool_t* pool) {
+	uint8_t* block;
+
+	enter_critical(pool);
+	block = pop_block(pool);
+	exit_critical(pool);
+
+	return block;
+}
+
+bool MBus_pool_ref(struct MBus_pool_t* pool, uint8_t* block) {
+	unsigned idx;
+	bool ok;
+
+	if (!block_index(pool, block, &idx)) return false;
+
+	enter_critical(pool);
+	// A free block is still on the free list and must not come back to
+	// life, and the count must not wrap to 0
+	ok = (pool->refcounts[idx] > 0) && (pool->refcounts[idx] < UINT8_MAX);
+	if (ok) pool->refcounts[idx]++;
+	exit_critical(pool);
+
+	return ok;
+}
+
+void MBus_pool_unref(struct MBus_pool_t* pool, uint8_t* block) {
+	unsigned idx;
+
+	if (!block_index(pool, block, &idx)) return;
+
+	enter_critical(pool);
+	// A free block would otherwise go on the free list twice
+	if ((pool->refcounts[idx] > 0) && (--pool->refcounts[idx] == 0)) {
+		pool->free_list[pool->free_count++] = idx;
+	}
+	exit_critical(pool);
+}
+
+unsigned MBus_pool_available(struct MBus_pool_t* pool) {
+	return pool->free_count;
+}
+
+int MBus_pool_provide_recv_buffer(struct MBus_pool_t* pool, struct MBus_t* m) {
+	int ret = -1;
+	unsigned idx;
+
+	enter_critical(pool);
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		if (m->recv_buffer_lengths[idx] == 0) {
+			uint8_t* block = pop_block(pool);
+			if (block == NULL) break;
+
+			// Buffer must be in place before the length marks it valid
+			m->recv_buffers[idx] = block;
+			m->recv_buffer_lengths[idx] = pool->block_size;
+			ret = idx;
+			break;
+		}
+	}
+	exit_critical(pool);
+
+	return ret;
+}
+
+int MBus_pool_recv_buffer_alloc(struct MBus_pool_t* pool, struct MBus_t* m,
+		int min_length) {
+	if (min_length > (int) pool->block_size) return -1;
+	return MBus_pool_provide_recv_buffer(pool, m);
+}
@@ -0,0 +1,123 @@
+#ifndef LIBMBUS_POOL_H
+#define LIBMBUS_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libmbus.h"
+
+/* A fixed-block, reference-counted message buffer pool.
+ *
+ * The pool hands out blocks of a single size from caller-provided static
+ * storage. Allocation and release are O(1) and never call malloc, so the pool
+ * is safe to use on the message path, including from within the MBus
+ * callbacks.
+ *
+ * Every block carries a reference count. MBus_pool_alloc returns a block with
+ * one reference, MBus_pool_ref adds one, and MBus_pool_unref drops one; the
+ * block returns to the pool when the last reference is dropped. This allows a
+ * single buffer to be held by e.g. a retry queue, a bridge and an application
+ * consumer at the same time without copying.
+ *
+ * The pool may be used from both interrupt and non-interrupt contexts if the
+ * platform provides enter_critical / exit_critical. These should mask any
+ * interrupt that may touch the pool (typically the MBus GPIO interrupts).
+ * They may be left NULL if the pool is only ever used from one context.
+ *
+ * Usage:
+ *   MBUS_POOL_DEFINE(rx_pool, 8, 64);   // 8 blocks of 64 bytes
+ *   ...
+ *   rx_pool.enter_critical = ...;       // [OPT]
+ *   MBus_pool_init(&rx_pool);
+ *
+ *   TX: Allocate a block, fill it in, and pass it to MBus_send. Drop the
+ *   reference from the MBus_send_done callback.
+ *
+ *   RX: Slots of the MBus struct with a recv_buffer_lengths entry of exactly
+ *   zero are considered empty. MBus_pool_provide_recv_buffer attaches a fresh
+ *   block to an empty slot. To do so whenever MBus runs out of buffers, use
+ *   MBUS_POOL_DEFINE_RECV_ALLOC for the MBus_recv_buffer_alloc callback:
+ *
+ *     MBUS_POOL_DEFINE_RECV_ALLOC(rx_alloc, rx_pool, mbus);
+ *     ...
+ *     mbus.MBus_recv_buffer_alloc = rx_alloc;
+ *
+ *   When a message is received into a pool block the client takes over its
+ *   reference and sets the slot's length to zero, leaving the slot free to
+ *   be refilled.
+ *
+ *   With recv_length_hint enabled, keeping one pool per size class and
+ *   providing from the smallest pool whose block_size is at least min_length
+ *   gives size-class buffer selection.
+ */
+
+struct MBus_pool_t {
+	// Storage. blocks must hold block_count * block_size bytes, the
+	// remaining arrays must hold block_count entries each.
+	uint8_t* blocks;
+	volatile uint8_t* refcounts;
+	volatile uint16_t* free_list;
+
+	// Must be a power of two, MBus_pool_init fails otherwise
+	unsigned block_size;
+	unsigned block_count;
+
+	// [OPT] Functions that mask and unmask any interrupt that uses the pool
+	void (*enter_critical)(void);
+	void (*exit_critical)(void);
+
+	// Private
+	unsigned block_shift;
+	volatile unsigned free_count;
+};
+
+// Defines a pool named _name with static storage for _count blocks of _size
+// bytes. _size must be a power of two.
+#define MBUS_POOL_DEFINE(_name, _count, _size)\
+	_Static_assert((_size) && !((_size) & ((_size) - 1)),\
+			"pool block size must be a power of two");\
+	static uint8_t _name##_blocks[(_count) * (_size)];\
+	static volatile uint8_t _name##_refcounts[_count];\
+	static volatile uint16_t _name##_free_list[_count];\
+	struct MBus_pool_t _name = {\
+		.blocks = _name##_blocks,\
+		.refcounts = _name##_refcounts,\
+		.free_list = _name##_free_list,\
+		.block_size = (_size),\
+		.block_count = (_count),\
+	}
+
+// Defines _fn as an MBus_recv_buffer_alloc callback that refills an empty
+// slot of the MBus struct _mbus from pool _pool (see
+// MBus_pool_recv_buffer_alloc)
+#define MBUS_POOL_DEFINE_RECV_ALLOC(_fn, _pool, _mbus)\
+	static int _fn(int min_length) {\
+		return MBus_pool_recv_buffer_alloc(&(_pool), &(_mbus), min_length);\
+	}
+
+bool MBus_pool_init(struct MBus_pool_t*);
+  // Returns false, leaving the pool empty, if block_size is not a power of
+  // two
+
+uint8_t* MBus_pool_alloc(struct MBus_pool_t*);
+  // Returns NULL if the pool is exhausted
+bool MBus_pool_ref(struct MBus_pool_t*, uint8_t* block);
+  // Returns false, adding no reference, if block is not in the pool, is
+  // free, or already has the maximum of 255 references
+void MBus_pool_unref(struct MBus_pool_t*, uint8_t* block);
+  // block may point anywhere within a block. Dropping a reference the block
+  // does not hold (e.g. a second unref of a freed block, or a pointer outside
+  // of the pool) is ignored.
+
+unsigned MBus_pool_available(struct MBus_pool_t*);
+
+int MBus_pool_provide_recv_buffer(struct MBus_pool_t*, struct MBus_t*);
+  // Returns the index of the refilled slot, or -1 if there is no empty slot
+  // or the pool is exhausted
+int MBus_pool_recv_buffer_alloc(struct MBus_pool_t*, struct MBus_t*,
+		int min_length);
+  // As MBus_pool_provide_recv_buffer, but returns -1 without taking a block
+  // if blocks are shorter than min_length. Has the contract of
+  // MBus_recv_buffer_alloc, see MBUS_POOL_DEFINE_RECV_ALLOC.
+
+#endif // LIBMBUS_POOL_H
@@ -0,0 +1,90 @@
+#include "libmbus_rate.h"
+
+
+static bool is_timing_error(enum MBus_error_t err) {
+	return (err == MBUS_ERR_CLOCK_SYNCH_ERROR) ||
+		(err == MBUS_ERR_DATA_SYNCH_ERROR);
+}
+
+static void back_off(struct MBus_rate_t* r, enum MBus_error_t err) {
+	// The rate that failed is the one on the bus. The target may already
+	// differ if it has not been applied yet, keep it if it is lower.
+	uint32_t hz = r->rate_hz / 2;
+
+	if (hz > r->target_hz) hz = r->target_hz;
+	if (hz < r->min_hz) hz = r->min_hz;
+
+	// Remember the lowest rate that has failed
+	if ((r->ceiling_hz == 0) || (r->rate_hz < r->ceiling_hz)) {
+		r->ceiling_hz = r->rate_hz;
+	}
+
+	r->target_hz = hz;
+	r->clean_streak = 0;
+	r->backoffs++;
+	r->last_backoff_error = err;
+}
+
+static void speed_up(struct MBus_rate_t* r) {
+	uint32_t step = r->step_hz;
+	uint32_t hz;
+
+	// Close only half of the remaining gap to a known failing rate. Once
+	// the gap is closed, forget the ceiling so conditions that have since
+	// improved are eventually probed again.
+	if ((r->ceiling_hz != 0) && (r->target_hz + step >= r->ceiling_hz)) {
+		step = (r->ceiling_hz - r->target_hz) / 2;
+		if (step == 0) {
+			r->ceiling_hz = 0;
+			return;
+		}
+	}
+
+	hz = r->target_hz + step;
+	if (hz > r->max_hz) hz = r->max_hz;
+	if (hz == r->target_hz) return;
+
+	r->target_hz = hz;
+	r->increases++;
+}
+
+
+bool MBus_rate_init(struct MBus_rate_t* r, uint32_t start_hz) {
+	// The clamps in back_off and speed_up would fight each other
+	if (r->min_hz > r->max_hz) return false;
+
+	if (start_hz < r->min_hz) start_hz = r->min_hz;
+	if (start_hz > r->max_hz) start_hz = r->max_hz;
+
+	r->rate_hz = start_hz;
+	r->target_hz = start_hz;
+	r->ceiling_hz = 0;
+	r->increases = 0;
+	r->backoffs = 0;
+	r->last_backoff_error = MBUS_ERR_NO_ERROR;
+	r->clean_streak = 0;
+
+	r->set_clock_rate(start_hz);
+	return true;
+}
+
+void MBus_rate_transaction_done(struct MBus_rate_t* r, enum MBus_error_t err,
+		bool unexpected_interjection) {
+	if (is_timing_error(err) || unexpected_interjection) {
+		back_off(r, is_timing_error(err) ? err : MBUS_ERR_INTERRUPTED);
+		return;
+	}
+	if (err != MBUS_ERR_NO_ERROR) return;
+
+	if (++r->clean_streak >= r->clean_to_increase) {
+		r->clean_streak = 0;
+		speed_up(r);
+	}
+}
+
+void MBus_rate_idle(struct MBus_rate_t* r) {
+	if (r->target_hz == r->rate_hz) return;
+
+	r->rate_hz = r->target_hz;
+	r->set_clock_rate(r->rate_hz);
+}
@@ -0,0 +1,63 @@
+#ifndef LIBMBUS_RATE_H
+#define LIBMBUS_RATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libmbus.h"
+
+/* Adaptive bus clock rate control for software mediators.
+ *
+ * Rather than running the bus at a fixed, conservative clock, a mediator can
+ * let this controller pick the CLK rate. The rate is raised additively after
+ * a run of cleanly completed transactions and cut multiplicatively whenever a
+ * transaction shows signs of timing trouble: a clock or data synchronization
+ * error reported by a node, or an interjection the mediator did not expect.
+ * After a backoff the rate that failed becomes a ceiling that is approached
+ * more carefully, so the controller settles just below the highest rate the
+ * ring sustains instead of oscillating across it.
+ *
+ * Rate changes are never applied mid-transaction. New rates are only handed
+ * to set_clock_rate from MBus_rate_idle, which the mediator must call only
+ * while the bus is idle.
+ *
+ * Usage:
+ *   Fill in the configuration fields and call MBus_rate_init. After every
+ *   transaction call MBus_rate_transaction_done with its outcome, and call
+ *   MBus_rate_idle whenever the bus is idle. The metrics fields may be read
+ *   at any time.
+ */
+
+struct MBus_rate_t {
+	// Configuration
+	uint32_t min_hz;
+	uint32_t max_hz;
+	uint32_t step_hz;             // Additive increase
+	unsigned clean_to_increase;   // Clean transactions per increase
+
+	// Function that changes the CLK rate. Only called while the bus is idle.
+	void (*set_clock_rate)(uint32_t hz);
+
+	// Metrics. Read-only to the client.
+	uint32_t rate_hz;             // Rate currently applied to the bus
+	uint32_t ceiling_hz;          // Lowest rate known to fail, 0 if none
+	unsigned increases;
+	unsigned backoffs;
+	enum MBus_error_t last_backoff_error;
+
+	// Private
+	unsigned clean_streak;
+	uint32_t target_hz;
+};
+
+bool MBus_rate_init(struct MBus_rate_t*, uint32_t start_hz);
+  // Returns false, without setting the clock, if min_hz is above max_hz.
+  // The controller must not be used then.
+
+void MBus_rate_transaction_done(struct MBus_rate_t*, enum MBus_error_t,
+		bool unexpected_interjection);
+  // Errors not caused by timing (e.g. MBUS_ERR_RECV_OVERFLOW) are neutral
+
+void MBus_rate_idle(struct MBus_rate_t*);
+
+#endif // LIBMBUS_RATE_H
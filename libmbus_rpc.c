@@ -0,0 +1,178 @@
+#include "libmbus_rpc.h"
+
+#include <stddef.h>
+
+static struct MBus_t* rpc_mbus;
+static uint32_t reply_addr;
+
+enum rpc_call_state_t {
+	CALL_FREE,
+	CALL_SENDING,
+	CALL_AWAITING_REPLY,
+	CALL_COMPLETING,
+	// Timed out while the request was queued. The slot is freed once the
+	// transmit queue is done with it.
+	CALL_ABANDONED,
+};
+
+static struct rpc_call_t {
+	// Must be first, the send done callback casts back from it
+	struct MBus_tx_t tx;
+
+	volatile enum rpc_call_state_t state;
+	uint8_t tag;
+	uint32_t deadline;
+	void (*done)(unsigned tag, enum MBus_error_t, int recv_buf_idx);
+} calls[MBUS_RPC_SLOTS];
+
+static volatile uint8_t  free_slots[MBUS_RPC_SLOTS];
+static volatile unsigned free_count;
+
+
+static inline void disable_interrupts(void) {
+	if (rpc_mbus->disable_interrupts) rpc_mbus->disable_interrupts();
+}
+static inline void enable_interrupts(void) {
+	if (rpc_mbus->enable_interrupts) rpc_mbus->enable_interrupts();
+}
+
+static inline unsigned slot_of(struct rpc_call_t* c) {
+	return c - calls;
+}
+
+// Atomically moves a call from state from to CALL_COMPLETING, so that only one
+// of a reply, a send error and a timeout completes it.
+static bool take_call(struct rpc_call_t* c, enum rpc_call_state_t from) {
+	bool taken;
+
+	disable_interrupts();
+	taken = (c->state == from);
+	if (taken) c->state = CALL_COMPLETING;
+	enable_interrupts();
+
+	return taken;
+}
+
+static void release_call(struct rpc_call_t* c) {
+	disable_interrupts();
+	c->state = CALL_FREE;
+	free_slots[free_count++] = slot_of(c);
+	enable_interrupts();
+}
+
+// Returns a taken call's slot to the free list and calls its done callback.
+// The slot may be reused by the callback.
+static void complete_call(struct rpc_call_t* c, enum MBus_error_t err, int recv_buf_idx) {
+	void (*done)(unsigned, enum MBus_error_t, int) = c->done;
+	uint8_t tag = c->tag;
+
+	release_call(c);
+	done(tag, err, recv_buf_idx);
+}
+
+static void request_sent(struct MBus_tx_t* tx, int bytes_sent, enum MBus_error_t err) {
+	struct rpc_call_t* c = (struct rpc_call_t*) tx;
+	(void) bytes_sent;
+
+	if (c->state == CALL_ABANDONED) {
+		// Already completed with MBUS_ERR_TIMEOUT, any reply is stale
+		release_call(c);
+		return;
+	}
+	if (err != MBUS_ERR_NO_ERROR) {
+		if (take_call(c, CALL_SENDING)) complete_call(c, err, -1);
+	} else {
+		c->state = CALL_AWAITING_REPLY;
+	}
+}
+
+
+void MBus_rpc_init(struct MBus_t* m, uint32_t addr) {
+	unsigned i;
+
+	rpc_mbus = m;
+	reply_addr = addr;
+
+	for (i=0; i < MBUS_RPC_SLOTS; i++) {
+		calls[i].state = CALL_FREE;
+		calls[i].tag = i;
+		free_slots[i] = i;
+	}
+	free_count = MBUS_RPC_SLOTS;
+}
+
+int MBus_rpc_call(uint8_t* buf, int length, uint8_t is_priority,
+		unsigned tag_offset, uint32_t now, uint32_t timeout,
+		void (*done)(unsigned tag, enum MBus_error_t, int recv_buf_idx)) {
+	struct rpc_call_t* c;
+
+	disable_interrupts();
+	if (free_count == 0) {
+		enable_interrupts();
+		return -1;
+	}
+	c = &calls[free_slots[--free_count]];
+	enable_interrupts();
+
+	// Bump the generation so late replies to the slot's previous call
+	// are not mistaken for replies to this one
+	c->tag = (c->tag + MBUS_RPC_SLOTS) & 0xff;
+	c->deadline = now + timeout;
+	c->done = done;
+	c->state = CALL_SENDING;
+
+	buf[tag_offset] = c->tag;
+	c->tx.buf = buf;
+	c->tx.length = length;
+	c->tx.is_priority = is_priority;
+	c->tx.done = request_sent;
+	MBus_queue_send(&c->tx);
+
+	return c->tag;
+}
+
+bool MBus_rpc_recv(unsigned recv_buf_idx) {
+	struct rpc_call_t* c;
+	uint8_t tag;
+
+	if (rpc_mbus->recv_addrs[recv_buf_idx] != reply_addr) return false;
+	if (rpc_mbus->recv_buffer_lengths[recv_buf_idx] >= 0) return false;
+
+	tag = rpc_mbus->recv_buffers[recv_buf_idx][0];
+	c = &calls[tag & (MBUS_RPC_SLOTS - 1)];
+	if (c->tag != tag) return false;
+	if (!take_call(c, CALL_AWAITING_REPLY)) return false;
+
+	complete_call(c, MBUS_ERR_NO_ERROR, recv_buf_idx);
+	return true;
+}
+
+void MBus_rpc_poll(uint32_t now) {
+	unsigned i;
+
+	for (i=0; i < MBUS_RPC_SLOTS; i++) {
+		struct rpc_call_t* c = &calls[i];
+		bool abandoned;
+
+		if ((int32_t) (now - c->deadline) < 0) continue;
+		if (c->state == CALL_AWAITING_REPLY) {
+			if (take_call(c, CALL_AWAITING_REPLY)) {
+				complete_call(c, MBUS_ERR_TIMEOUT, -1);
+			}
+			continue;
+		}
+		if (c->state != CALL_SENDING) continue;
+
+		// The request still belongs to the transmit queue, so the call
+		// completes now but keeps its slot until request_sent
+		disable_interrupts();
+		abandoned = (c->state == CALL_SENDING);
+		if (abandoned) c->state = CALL_ABANDONED;
+		enable_interrupts();
+		if (abandoned) c->done(c->tag, MBUS_ERR_TIMEOUT, -1);
+	}
+}
+
+unsigned MBus_rpc_outstanding(void) {
+	return MBUS_RPC_SLOTS - free_count;
+}
@@ -0,0 +1,68 @@
+#ifndef LIBMBUS_RPC_H
+#define LIBMBUS_RPC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libmbus.h"
+
+/* Request/response calls over MBus.
+ *
+ * Many MBus exchanges (e.g. register and memory reads) are a request followed
+ * by a reply sent back to an address chosen by the requester. This layer
+ * tracks any number of such calls concurrently in a fixed-size table, so the
+ * bus can be kept busy with outstanding requests.
+ *
+ * Every call is given an 8-bit tag, which MBus_rpc_call writes into the
+ * request at a caller-specified offset. The request format must cause the
+ * responder to echo the tag as the first payload byte of its reply (e.g. the
+ * reply register address of a register read). Replies are matched to calls by
+ * indexing the table with the tag, so correlation is O(1).
+ *
+ * Usage:
+ *   Call MBus_rpc_init after MBus_init with the address replies are sent to
+ *   (formatted as recv_addrs). From the MBus_recv callback, pass every
+ *   message to MBus_rpc_recv first; it returns true if the message completed
+ *   a call. Call MBus_rpc_poll periodically to expire calls whose timeout has
+ *   passed. Time is measured in caller-defined ticks.
+ *
+ *   Each call completes exactly once, through its done callback, with one of:
+ *     MBUS_ERR_NO_ERROR   the reply is in RX buffer recv_buf_idx, which the
+ *                         callback now owns exactly as in MBus_recv
+ *     MBUS_ERR_TIMEOUT    no reply arrived in time; recv_buf_idx is -1
+ *     other               sending the request failed; recv_buf_idx is -1
+ *   The timeout runs from MBus_rpc_call, so it includes time the request
+ *   spends waiting for the bus. A call that times out before its request
+ *   has been sent completes all the same, but the request stays queued and
+ *   its slot (and buf) stay in use until it has gone out.
+ *   The done callback may be called from within an interrupt handler.
+ */
+
+/* This controls the maximum number of outstanding calls. It must be a power
+ * of two no greater than 128. The remaining tag bits hold a generation count
+ * that prevents a late reply from completing a newer call in the same slot. */
+#ifndef MBUS_RPC_SLOTS
+#define MBUS_RPC_SLOTS 8
+#endif
+_Static_assert((MBUS_RPC_SLOTS & (MBUS_RPC_SLOTS - 1)) == 0,
+		"MBUS_RPC_SLOTS must be a power of two");
+_Static_assert(MBUS_RPC_SLOTS <= 128, "Tags must leave room for a generation");
+
+void MBus_rpc_init(struct MBus_t*, uint32_t reply_addr);
+
+int MBus_rpc_call(uint8_t* buf, int length, uint8_t is_priority,
+		unsigned tag_offset, uint32_t now, uint32_t timeout,
+		void (*done)(unsigned tag, enum MBus_error_t, int recv_buf_idx));
+  // Queues buf for transmission with the call's tag written to
+  // buf[tag_offset]. Returns the tag, or -1 if all slots are in use.
+  // buf must remain valid until done is called, or after a timeout until
+  // the call's slot is free again (see MBus_rpc_outstanding).
+
+bool MBus_rpc_recv(unsigned recv_buf_idx);
+void MBus_rpc_poll(uint32_t now);
+
+unsigned MBus_rpc_outstanding(void);
+  // Slots in use, including those of timed out calls whose request is
+  // still queued
+
+#endif // LIBMBUS_RPC_H
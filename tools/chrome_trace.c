@@ -0,0 +1,56 @@
+#include "chrome_trace.h"
+
+#include <stdbool.h>
+
+static FILE* out;
+static bool first;
+
+
+static void event_begin(void) {
+	fprintf(out, "%s\n", first ? "" : ",");
+	first = false;
+}
+
+
+void chrome_trace_begin(FILE* f) {
+	out = f;
+	first = true;
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+}
+
+void chrome_trace_end(void) {
+	fprintf(out, "\n]}\n");
+	fflush(out);
+}
+
+void chrome_trace_track(unsigned track, const char* name) {
+	event_begin();
+	fprintf(out, "{\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"name\":\"thread_name\","
+			"\"args\":{\"name\":\"%s\"}}", track, name);
+	event_begin();
+	fprintf(out, "{\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+			"\"name\":\"thread_sort_index\","
+			"\"args\":{\"sort_index\":%u}}", track, track);
+}
+
+void chrome_trace_slice(unsigned track, const char* name, const char* role,
+		double start_us, double duration_us) {
+	event_begin();
+	fprintf(out, "{\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"name\":\"%s\","
+			"\"ts\":%.3f,\"dur\":%.3f", track, name, start_us, duration_us);
+	if (role) fprintf(out, ",\"args\":{\"role\":\"%s\"}", role);
+	fprintf(out, "}");
+}
+
+void chrome_trace_flow(unsigned id, const char* name,
+		unsigned from_track, double from_us,
+		unsigned to_track, double to_us) {
+	event_begin();
+	fprintf(out, "{\"ph\":\"s\",\"pid\":0,\"tid\":%u,\"name\":\"%s\","
+			"\"cat\":\"msg\",\"id\":%u,\"ts\":%.3f}",
+			from_track, name, id, from_us);
+	event_begin();
+	fprintf(out, "{\"ph\":\"f\",\"bp\":\"e\",\"pid\":0,\"tid\":%u,"
+			"\"name\":\"%s\",\"cat\":\"msg\",\"id\":%u,\"ts\":%.3f}",
+			to_track, name, id, to_us);
+}
@@ -0,0 +1,31 @@
+#ifndef CHROME_TRACE_H
+#define CHROME_TRACE_H
+
+#include <stdio.h>
+
+/* Writer for the Chrome trace-event JSON format, which both chrome://tracing
+ * and the Perfetto UI (ui.perfetto.dev) open directly.
+ *
+ * Each ring node is drawn as one track (a "thread" of a single process) and
+ * each bus phase as a slice on that track. Flow arrows connect a slice on
+ * one track to a slice on another, e.g. a sender's data phase to the
+ * receiver's. Times are in microseconds.
+ *
+ * Only one trace may be written at a time.
+ */
+
+void chrome_trace_begin(FILE*);
+void chrome_trace_end(void);
+
+void chrome_trace_track(unsigned track, const char* name);
+
+void chrome_trace_slice(unsigned track, const char* name, const char* role,
+		double start_us, double duration_us);
+  // role may be NULL. It is shown as an argument of the slice.
+
+void chrome_trace_flow(unsigned id, const char* name,
+		unsigned from_track, double from_us,
+		unsigned to_track, double to_us);
+  // Each end must fall within a slice on its track. id must be unique.
+
+#endif // CHROME_TRACE_H
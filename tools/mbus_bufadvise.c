@@ -0,0 +1,252 @@
+/* RX buffer sizing advisor.
+ *
+ * Reads the histograms recorded with MBUS_HISTOGRAMS (or written by
+ * mbus_txsim -H) and recommends an RX buffer count and length that keep the
+ * probability of NAKing a message with an RX overflow below a target.
+ *
+ * Input is text, one item per line:
+ *
+ *   buffers <RX_BUFFER_COUNT> <buffer length>
+ *   length <bin> <count>          recv_length_hist
+ *   occupancy <held> <count>      recv_occupancy_hist
+ *
+ * Blank lines and lines starting with '#' are ignored. Several dumps (e.g.
+ * from every node, or from several runs) may be concatenated; their counts
+ * are added.
+ *
+ * An overflow happens either because the message does not fit in a buffer
+ * or because the client holds every buffer. The target is split evenly
+ * between the two:
+ *
+ *   - length: the shortest length bin boundary that all but a target
+ *     fraction of the messages fit in
+ *   - count: the number of buffers the client held when messages arrived
+ *     is fitted with a model of the client, which is then used to find the
+ *     fewest buffers for which a message finds them all held with less than
+ *     the target probability. By default each buffer is assumed to be held
+ *     for a while independently of the others (Erlang loss model, held
+ *     count is Poisson distributed with mean a = arrival rate * hold time).
+ *     With -S the client is assumed to process messages one at a time
+ *     (M/M/1/N queue, held count is geometric with ratio rho = arrival
+ *     rate / service rate).
+ *
+ * Both models give the probability of k buffers held as w(k) / sum(w) over
+ * k = 0 .. buffers, with w(k) = a^k / k! or rho^k, and a message finds every
+ * buffer held with probability w(N) / sum(w). The fit only uses messages
+ * that were received, since NAK'd messages are retried and so are counted
+ * several times. Those are the held counts conditioned on not every buffer
+ * being held, for which the maximum likelihood estimate of the parameter is
+ * the one that matches the observed mean.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#define MAX_BINS      32
+#define MAX_BUFFERS   64
+
+static double length_hist[MAX_BINS];
+static double occupancy_hist[MAX_BUFFERS + 1];
+static unsigned length_bins = 0;
+static unsigned buffers = 0;
+static unsigned buffer_length = 0;
+static int sequential = 0;
+
+
+// Largest length counted in a bin, 0 for the open-ended last bin
+static unsigned bin_limit(unsigned bin) {
+	if (bin + 1 >= length_bins) return 0;
+	return 1u << bin;
+}
+
+// Weight of k buffers held, relative to none
+static double weight(double x, unsigned k) {
+	double w = 1;
+	unsigned i;
+	for (i=1; i <= k; i++) w *= sequential ? x : x / i;
+	return w;
+}
+
+// Mean number of buffers held given that fewer than n are
+static double truncated_mean(double x, unsigned n) {
+	double sum = 0, mean = 0;
+	unsigned k;
+	for (k=0; k < n; k++) {
+		double w = weight(x, k);
+		sum += w;
+		mean += k * w;
+	}
+	return mean / sum;
+}
+
+// Probability that a message finds all n buffers held
+static double p_all_held(double x, unsigned n) {
+	double sum = 0;
+	unsigned k;
+	for (k=0; k <= n; k++) sum += weight(x, k);
+	return weight(x, n) / sum;
+}
+
+static void usage(const char* argv0) {
+	fprintf(stderr,
+"usage: %s [-p probability] [-m max_buffers] [-S] [input...]\n"
+"  -p probability   target overflow probability per message (default 1e-3)\n"
+"  -m count         most buffers to recommend (default %u)\n"
+"  -S               the client processes messages one at a time\n",
+		argv0, MAX_BUFFERS);
+	exit(2);
+}
+
+static void read_dump(FILE* in, const char* name) {
+	char line[256];
+	unsigned lineno = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		char kind[16];
+		unsigned a;
+		double b;
+
+		lineno++;
+		if ((line[0] == '#') || (line[strspn(line, " \t\r\n")] == '\0')) {
+			continue;
+		}
+		if (sscanf(line, "%15s %u %lf", kind, &a, &b) != 3) {
+			fprintf(stderr, "%s:%u: bad line\n", name, lineno);
+			exit(1);
+		}
+		if (!strcmp(kind, "buffers")) {
+			if (buffers && (a != buffers)) {
+				fprintf(stderr, "%s:%u: dumps from different buffer counts\n",
+						name, lineno);
+				exit(1);
+			}
+			if ((a < 1) || (a > MAX_BUFFERS)) {
+				fprintf(stderr, "%s:%u: buffer count out of range\n",
+						name, lineno);
+				exit(1);
+			}
+			buffers = a;
+			if (b > buffer_length) buffer_length = b;
+		} else if (!strcmp(kind, "length") && (a < MAX_BINS)) {
+			length_hist[a] += b;
+			if (a >= length_bins) length_bins = a + 1;
+		} else if (!strcmp(kind, "occupancy") && (a <= MAX_BUFFERS)) {
+			occupancy_hist[a] += b;
+		} else {
+			fprintf(stderr, "%s:%u: bad line\n", name, lineno);
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	double target = 1e-3;
+	unsigned max_buffers = MAX_BUFFERS;
+	double messages = 0, tail, held_sum = 0, censored = 0, complete = 0;
+	double x, p_full, p_long;
+	unsigned length = 0, count, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:m:Sh")) != -1) {
+		switch (opt) {
+			case 'p': target = atof(optarg); break;
+			case 'm': max_buffers = atoi(optarg); break;
+			case 'S': sequential = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if ((target <= 0) || (target >= 1) || (max_buffers < 1)) usage(argv[0]);
+
+	if (optind == argc) {
+		read_dump(stdin, "stdin");
+	}
+	for (i=optind; i < (unsigned) argc; i++) {
+		FILE* in = fopen(argv[i], "r");
+		if (in == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		read_dump(in, argv[i]);
+		fclose(in);
+	}
+	if (buffers == 0) {
+		fprintf(stderr, "no \"buffers\" line in input\n");
+		return 1;
+	}
+
+	// Length: walk down from the longest bin until the tail reaches the
+	// target
+	for (i=0; i < length_bins; i++) messages += length_hist[i];
+	if (messages == 0) {
+		fprintf(stderr, "no messages recorded\n");
+		return 1;
+	}
+	tail = 0;
+	for (i=length_bins; i-- > 0;) {
+		if (tail + length_hist[i] > target / 2 * messages) {
+			length = bin_limit(i);
+			break;
+		}
+		tail += length_hist[i];
+	}
+	p_long = tail / messages;
+
+	// Count: fit the model parameter, then extrapolate
+	for (i=0; i < buffers; i++) {
+		held_sum += i * occupancy_hist[i];
+		complete += occupancy_hist[i];
+	}
+	censored = occupancy_hist[buffers];
+	if (complete == 0) {
+		fprintf(stderr, "no received messages in the occupancy histogram\n");
+		return 1;
+	}
+	if (buffers == 1) {
+		// Every received message found the buffer free, only the NAK
+		// rate carries information. Retries make this an overestimate.
+		double blocked = censored / (complete + censored);
+		x = (blocked < 1) ? blocked / (1 - blocked) : 1e6;
+	} else {
+		// The truncated mean grows with x, bisect in log space
+		double lo = 1e-9, hi = 1e6;
+		for (i=0; i < 200; i++) {
+			double mid = sqrt(lo * hi);
+			if (truncated_mean(mid, buffers) < held_sum / complete) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		x = sqrt(lo * hi);
+	}
+	count = 1;
+	while ((count < max_buffers) && (p_all_held(x, count) > target / 2)) {
+		count++;
+	}
+	p_full = p_all_held(x, count);
+
+	printf("messages observed        %.0f\n", messages);
+	printf("NAK'd, all buffers held  %.0f (%.3g%%)\n", censored,
+			100 * censored / (complete + censored));
+	printf("%s %.4f\n", sequential ? "client load rho         " :
+			"offered load a          ", x);
+	printf("\n");
+	printf("current      %u x %u bytes = %u bytes\n", buffers, buffer_length,
+			buffers * buffer_length);
+	if (length == 0) {
+		printf("recommended  %u x (longer than %u) bytes\n", count,
+				1u << (length_bins - 2));
+		printf("  more than %g of messages fall in the open-ended last "
+				"length bin; increase MBUS_LENGTH_BINS\n", target / 2);
+	} else {
+		printf("recommended  %u x %u bytes = %u bytes\n", count, length,
+				count * length);
+	}
+	printf("  P(message too long)    %.3g\n", p_long);
+	printf("  P(all buffers held)    %.3g%s\n", p_full,
+			(p_full > target / 2) ? " (limited by -m)" : "");
+	return 0;
+}
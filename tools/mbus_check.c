@@ -0,0 +1,1274 @@
+/* Edge-level checks of libmbus and its modules.
+ *
+ * Drives one node through whole bus transactions, one CLK or DATA edge at a
+ * time as in mbus_txsim's calibration (-C). The harness plays everything
+ * else on the ring: the nodes upstream that send messages through this one,
+ * the receiver downstream of its own messages, and the mediator that
+ * interjects and runs the control phase. Each check then compares what the
+ * node reported through its callbacks, and what it drove onto the bus,
+ * against libmbus.h.
+ *
+ * Most features are compile-time options, so the checks of an option only
+ * exist in builds that enable it. The check target of the Makefile builds
+ * this program once with the defaults, once per MBUS_* option and once with
+ * all of them, and runs every build. The exit status is non-zero if any
+ * check failed.
+ *
+ * libmbus.c is included directly so the mediator can follow the node's
+ * state, as a real one follows CLKOUT and DOUT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "libmbus.c"
+
+#include "libmbus_pool.h"
+#include "libmbus_rpc.h"
+#include "libmbus_rate.h"
+#include "libmbus_enum.h"
+#include "libmbus_credit.h"
+#include "libmbus_eventfd.h"
+
+#define BUFFER_SIZE 64
+// Edges a transaction may take before the harness gives up on it
+#define MAX_EDGES   (2 * 8 * (4 + BUFFER_SIZE) + 64)
+
+static struct MBus_t node;
+static uint8_t rx_buffers[RX_BUFFER_COUNT][BUFFER_SIZE];
+// Length each RX buffer is given back with once the client is done
+static int rx_lengths[RX_BUFFER_COUNT];
+// Set while a check releases RX buffers itself
+static bool hold_buffers;
+// Tried on every message before it is logged, as a client would
+static bool (*recv_hook)(unsigned idx);
+
+// Bus levels as seen by the node
+static bool clk = 1, din = 1;
+static bool clkout = 1, dout = 1;
+
+static uint32_t time_now;
+static unsigned handler_calls;
+#if MBUS_CONSTANT_TIME > 0
+static uint32_t cycles;
+#endif
+static int irq_depth;
+
+// What the node reported
+static struct {
+	unsigned recvs;
+	int recv_idx;
+	int recv_length;
+	uint32_t recv_addr;
+	uint8_t recv_data[BUFFER_SIZE];
+	unsigned errors;
+	enum MBus_error_t error;
+	unsigned send_dones;
+	int bytes_sent;
+	enum MBus_error_t send_error;
+	unsigned pending;
+	unsigned idle_begins, idle_ends;
+} seen;
+
+static const char* current;
+static unsigned check_count, failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char* what, int line) {
+	check_count++;
+	if (ok) return;
+	failures++;
+	printf("  %s:%d: %s: %s\n", __FILE__, line, current, what);
+}
+
+
+static void set_gpio(unsigned idx, bool val) {
+	if (idx == node.CLKOUT_gpio) clkout = val;
+	if (idx == node.DOUT_gpio) dout = val;
+}
+
+static void mask(void) {
+	irq_depth++;
+}
+static void unmask(void) {
+	irq_depth--;
+}
+
+static uint32_t get_time(void) {
+	return time_now;
+}
+#if MBUS_CONSTANT_TIME > 0
+static uint32_t get_cycles(void) {
+	return cycles++;
+}
+#endif
+
+static void release(unsigned idx) {
+	node.recv_buffer_lengths[idx] = rx_lengths[idx];
+}
+
+static void on_recv(unsigned idx) {
+	int i;
+
+	if (!recv_hook || !recv_hook(idx)) {
+		seen.recvs++;
+		seen.recv_idx = idx;
+		seen.recv_length = -node.recv_buffer_lengths[idx];
+		seen.recv_addr = node.recv_addrs[idx];
+		for (i=0; (i < seen.recv_length) && (i < BUFFER_SIZE); i++) {
+			seen.recv_data[i] = node.recv_buffers[idx][i];
+		}
+	}
+	if (!hold_buffers) release(idx);
+}
+static void on_error(enum MBus_error_t err) {
+	seen.errors++;
+	seen.error = err;
+}
+static void on_send_done(int bytes_sent, enum MBus_error_t err) {
+	seen.send_dones++;
+	seen.bytes_sent = bytes_sent;
+	seen.send_error = err;
+}
+#if MBUS_EVENT_QUEUE > 0
+static void on_events_pending(void) {
+	seen.pending++;
+}
+#endif
+static void on_idle_begin(uint32_t predicted_idle) {
+	(void) predicted_idle;
+	seen.idle_begins++;
+}
+static void on_idle_end(void) {
+	seen.idle_ends++;
+}
+
+// A fresh node with short prefix 1 on an idle bus, with every RX buffer
+// length bytes long
+static void reset_node(int length) {
+	unsigned idx;
+
+	memset(&node, 0, sizeof(node));
+	memset(&seen, 0, sizeof(seen));
+	node.CLKOUT_gpio = 0;
+	node.DOUT_gpio = 1;
+	node.short_prefix = 0x1;
+	node.full_prefix = 0x12345;
+	node.set_gpio_val = set_gpio;
+	node.MBus_send_done = on_send_done;
+	node.MBus_recv = on_recv;
+	node.MBus_error = on_error;
+	node.disable_interrupts = mask;
+	node.enable_interrupts = unmask;
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		rx_lengths[idx] = length;
+		node.recv_buffers[idx] = rx_buffers[idx];
+		node.recv_buffer_lengths[idx] = length;
+	}
+	hold_buffers = false;
+	recv_hook = NULL;
+	time_now = 0;
+
+	clk = 1;
+	din = 1;
+	MBus_init(&node);
+}
+
+
+static void clock_edge(void) {
+	clk = !clk;
+	handler_calls++;
+	MBus_CLKIN_int_handler(clk);
+}
+
+static void data(bool v) {
+	if (din == v) return;
+	din = v;
+	handler_calls++;
+	MBus_DIN_int_handler(din);
+}
+
+// Short address as it goes on the wire: sent LSB first, assembled MSB first
+static uint8_t wire_addr(uint8_t addr) {
+	uint8_t r = 0;
+	unsigned i;
+	for (i=0; i < 8; i++) {
+		if (addr & (0x80 >> i)) r |= 1 << i;
+	}
+	return r;
+}
+
+// Whether the node has requested the bus. DOUT alone does not tell, a
+// receiver leaves its ACK on DOUT until DIN next changes.
+static bool requested(void) {
+	return tx_requested;
+}
+
+// Delivers what the node queued, as the client's main loop would. Does
+// nothing without MBUS_EVENT_QUEUE.
+static void run(void) {
+	MBus_run();
+}
+
+// Mediator: once a requester holds CLK, keeps it high and interjects
+static void interject(void) {
+	unsigned i;
+
+	while (requesting(state) && (state != REQUESTED_INTERRUPT)) clock_edge();
+	if (!clk) clock_edge();
+	for (i=0; i < 3; i++) {
+		data(1);
+		data(0);
+	}
+	data(1);
+}
+
+// Mediator: runs the control phase through to IDLE. cb1 is the CB1 level
+// the rest of the ring returns to the node. Returns the CB1 level the node
+// drives downstream.
+static bool control(bool cb1) {
+	bool out = 1;
+	unsigned i;
+
+	for (i=0; (i < 32) && (state != IDLE); i++) {
+		if (state == LATCH_CB1) {
+			data(cb1);
+			out = dout;
+		} else if (state == DRIVE_IDLE) {
+			data(1);
+		}
+		clock_edge();
+	}
+	CHECK(state == IDLE);
+	return out;
+}
+
+// An upstream node sends a message through this one. addr is addr_bits
+// wide, as receivers assemble it. Returns true if the node ACK'd.
+static bool send_through(uint32_t addr, unsigned addr_bits,
+		const uint8_t* payload, unsigned length) {
+	unsigned i;
+
+	data(0);
+	for (i=0; i < 7; i++) clock_edge();
+	for (i=0; i < addr_bits; i++) {
+		clock_edge();
+		data((addr >> (addr_bits - 1 - i)) & 1);
+		clock_edge();
+	}
+	// A receiver that has to NAK holds CLK high on a falling edge, which
+	// ends the transmission
+	for (i=0; i < 8 * length; i++) {
+		clock_edge();
+		if (!clk && clkout) break;
+		data((payload[i / 8] >> (i % 8)) & 1);
+		clock_edge();
+		if (!clk && clkout) break;
+	}
+	interject();
+	return !control(1);
+}
+
+static bool send_short(uint8_t addr, const uint8_t* payload, unsigned length) {
+	return send_through(addr, 8, payload, length);
+}
+
+// The node sends the message it requested the bus for, to a receiver
+// downstream that ACKs it if ack is set. The mediator cuts the message short
+// after cut bits if cut is non-zero. Returns the number of bytes the node
+// sent, with them in out, or -1 if it had not requested the bus.
+static int capture(uint8_t* out, unsigned max, bool ack, unsigned cut) {
+	unsigned i, bits = 0;
+
+	if (!requested()) return -1;
+	memset(out, 0, max);
+
+	// Nobody upstream competes, and no one asks for priority
+	for (i=0; i < 4; i++) clock_edge();
+	data(0);
+	for (i=0; i < MAX_EDGES; i++) {
+		enum MBus_state_t from = state;
+
+		if (cut && (bits == cut)) break;
+		clock_edge();
+		if (!clk && clkout) break;
+		if ((from == DRIVE_DATA) && (logical == TRANSMIT) &&
+				(bits < 8 * max)) {
+			if (dout) out[bits / 8] |= 1 << (bits % 8);
+			bits++;
+		}
+	}
+	interject();
+	control(!ack);
+	return bits / 8;
+}
+
+
+static void check_receive(void) {
+	static const uint8_t msg[] = { 0xa5, 0x5a, 0x01 };
+	unsigned idx;
+
+	reset_node(BUFFER_SIZE);
+	CHECK(send_short(0x12, msg, 2));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(seen.recv_length == 2);
+	CHECK(seen.recv_addr == 0x12000000);
+	CHECK(memcmp(seen.recv_data, msg, 2) == 0);
+	CHECK(seen.errors == 0);
+
+	// Long address, full prefix
+	CHECK(send_through(0xf0123450, 32, msg, 3));
+	run();
+	CHECK(seen.recvs == 2);
+	CHECK(seen.recv_length == 3);
+	CHECK(seen.recv_addr == 0xf0123450);
+
+	// Forwarded, not for this node
+	CHECK(!send_short(0x32, msg, 2));
+	run();
+	CHECK(seen.recvs == 2);
+	CHECK(seen.errors == 0);
+
+	// No buffer free, the node interjects
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		node.recv_buffer_lengths[idx] = -1;
+	}
+	CHECK(!send_short(0x12, msg, 2));
+	run();
+	CHECK(seen.recvs == 2);
+	CHECK(seen.errors == 1);
+	CHECK(seen.error == MBUS_ERR_RECV_OVERFLOW);
+	CHECK(MBus_get_stats()->recv_overflows == 1);
+}
+
+static void check_overlong(void) {
+	static const uint8_t msg[] = { 1, 2, 3, 4 };
+
+	reset_node(2);
+	CHECK(send_short(0x12, msg, 2));
+	run();
+	CHECK(seen.recvs == 1);
+
+	// One byte too long is only noticed in the control phase
+	CHECK(!send_short(0x12, msg, 3));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(seen.errors == 1);
+	CHECK(seen.error == MBUS_ERR_RECV_OVERFLOW);
+
+	// Longer still, the node interjects
+	CHECK(!send_short(0x12, msg, 4));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(seen.errors == 2);
+	CHECK(MBus_get_stats()->recv_overflows == 2);
+}
+
+static int alloc_calls;
+static int alloc_min_length = -1;
+
+static int alloc_buffer(int min_length) {
+	alloc_calls++;
+	alloc_min_length = min_length;
+	node.recv_buffer_lengths[0] = BUFFER_SIZE;
+	return 0;
+}
+
+static void check_buffer_alloc(void) {
+	static const uint8_t msg[] = { 3, 2, 1 };
+	unsigned idx;
+
+	reset_node(0);
+	alloc_calls = 0;
+	node.MBus_recv_buffer_alloc = alloc_buffer;
+	CHECK(send_short(0x12, msg, 3));
+	run();
+	CHECK(alloc_calls == 1);
+	CHECK(alloc_min_length == 0);
+	CHECK(seen.recvs == 1);
+	CHECK(seen.recv_length == 3);
+	CHECK(MBus_get_stats()->recv_buffer_allocs == 1);
+
+	// Buffers available, the callback is not needed
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) rx_lengths[idx] = BUFFER_SIZE;
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) release(idx);
+	CHECK(send_short(0x12, msg, 3));
+	run();
+	CHECK(alloc_calls == 1);
+	CHECK(seen.recvs == 2);
+}
+
+static void check_length_hint(void) {
+	uint8_t msg[BUFFER_SIZE];
+	unsigned i;
+
+	if (RX_BUFFER_COUNT < 2) return;
+	for (i=0; i < sizeof(msg); i++) msg[i] = i;
+
+	reset_node(4);
+	rx_lengths[1] = 16;
+	release(1);
+	node.recv_length_hint = true;
+
+	// The smallest buffer that fits the length in the first byte
+	msg[0] = 3;
+	CHECK(send_short(0x12, msg, 3));
+	run();
+	CHECK(seen.recv_idx == 0);
+	CHECK(seen.recv_length == 3);
+	msg[0] = 10;
+	CHECK(send_short(0x12, msg, 10));
+	run();
+	CHECK(seen.recv_idx == 1);
+	CHECK(seen.recv_length == 10);
+	CHECK(seen.recv_data[0] == 10);
+
+	// Longer than any buffer
+	msg[0] = 20;
+	CHECK(!send_short(0x12, msg, 20));
+	run();
+	CHECK(seen.recvs == 2);
+	CHECK(seen.error == MBUS_ERR_RECV_OVERFLOW);
+}
+
+static void check_send(void) {
+	uint8_t buf[] = { wire_addr(0x20), 0xaa, 0x55 };
+	uint8_t bcast[] = { wire_addr(0x03), 0x01 };
+	uint8_t out[8];
+
+	reset_node(BUFFER_SIZE);
+	MBus_send(buf, sizeof(buf), 0);
+	CHECK(capture(out, sizeof(out), true, 0) == 3);
+	CHECK(memcmp(out, buf, 3) == 0);
+	run();
+	CHECK(seen.send_dones == 1);
+	CHECK(seen.bytes_sent == 3);
+	CHECK(seen.send_error == MBUS_ERR_NO_ERROR);
+
+	// A unicast the receiver NAKs
+	MBus_send(buf, sizeof(buf), 0);
+	CHECK(capture(out, sizeof(out), false, 0) == 3);
+	run();
+	CHECK(seen.send_dones == 2);
+	CHECK(seen.send_error == MBUS_ERR_RECV_OVERFLOW);
+
+	// A broadcast need not be ACK'd
+	MBus_send(bcast, sizeof(bcast), 0);
+	CHECK(capture(out, sizeof(out), false, 0) == 2);
+	run();
+	CHECK(seen.send_dones == 3);
+	CHECK(seen.send_error == MBUS_ERR_NO_ERROR);
+
+	// Cut short by a receiver
+	MBus_send(buf, sizeof(buf), 0);
+	CHECK(capture(out, sizeof(out), false, 12) == 1);
+	run();
+	CHECK(seen.send_dones == 4);
+	CHECK(seen.send_error == MBUS_ERR_RECV_OVERFLOW);
+
+	// Only one transmission at a time, the second fails right away
+	MBus_send(buf, sizeof(buf), 0);
+	MBus_send(bcast, sizeof(bcast), 0);
+	CHECK(seen.send_dones == 5);
+	CHECK(seen.send_error == MBUS_ERR_BUS_BUSY);
+	CHECK(capture(out, sizeof(out), true, 0) == 3);
+	run();
+	CHECK(seen.send_dones == 6);
+	CHECK(seen.send_error == MBUS_ERR_NO_ERROR);
+	CHECK(seen.errors == 0);
+}
+
+static struct {
+	unsigned calls;
+	int bytes_sent;
+	enum MBus_error_t err;
+} tx_seen;
+
+static void tx_done(struct MBus_tx_t* tx, int bytes_sent,
+		enum MBus_error_t err) {
+	(void) tx;
+	tx_seen.calls++;
+	tx_seen.bytes_sent = bytes_sent;
+	tx_seen.err = err;
+}
+
+static void check_autoreply(void) {
+	static uint8_t reply[] = { 0x04, 0x99 };
+	static struct MBus_autoreply_t ar;
+	uint8_t req[] = { 0x13 }, other[] = { 0x23 };
+	uint8_t out[8];
+
+	reset_node(BUFFER_SIZE);
+	memset(&tx_seen, 0, sizeof(tx_seen));
+	ar.addr = 0x12000000;
+	ar.match = 0x10;
+	ar.mask = 0xf0;
+	ar.reply.buf = reply;
+	ar.reply.length = sizeof(reply);
+	ar.reply.done = tx_done;
+	MBus_autoreply_register(&ar);
+
+	CHECK(send_short(0x12, req, sizeof(req)));
+	run();
+	CHECK(seen.recvs == 0);
+	CHECK(MBus_get_stats()->autoreplies == 1);
+	CHECK(capture(out, sizeof(out), true, 0) == 2);
+	CHECK(memcmp(out, reply, 2) == 0);
+	run();
+	CHECK(tx_seen.calls == 1);
+	CHECK(tx_seen.err == MBUS_ERR_NO_ERROR);
+
+	// Not matched, goes to the client
+	CHECK(send_short(0x12, other, sizeof(other)));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(!requested());
+}
+
+static struct {
+	unsigned calls;
+	unsigned tag;
+	enum MBus_error_t err;
+	int idx;
+	uint8_t data;
+} rpc_seen;
+
+static void rpc_done(unsigned tag, enum MBus_error_t err, int idx) {
+	rpc_seen.calls++;
+	rpc_seen.tag = tag;
+	rpc_seen.err = err;
+	rpc_seen.idx = idx;
+	if (idx >= 0) rpc_seen.data = node.recv_buffers[idx][1];
+}
+
+static void check_rpc(void) {
+	uint8_t req[] = { wire_addr(0x25), 0, 0x77 };
+	uint8_t reply[2], other[] = { 1 };
+	uint8_t out[8];
+	int tag;
+
+	reset_node(BUFFER_SIZE);
+	memset(&rpc_seen, 0, sizeof(rpc_seen));
+	MBus_rpc_init(&node, 0x13000000);
+	recv_hook = MBus_rpc_recv;
+
+	// Request, then the reply
+	tag = MBus_rpc_call(req, sizeof(req), 0, 1, 0, 100, rpc_done);
+	CHECK(tag >= 0);
+	CHECK(capture(out, sizeof(out), true, 0) == 3);
+	CHECK(out[1] == tag);
+	run();
+	CHECK(rpc_seen.calls == 0);
+	reply[0] = tag;
+	reply[1] = 0xab;
+	CHECK(send_short(0x13, reply, sizeof(reply)));
+	run();
+	CHECK(rpc_seen.calls == 1);
+	CHECK(rpc_seen.tag == (unsigned) tag);
+	CHECK(rpc_seen.err == MBUS_ERR_NO_ERROR);
+	CHECK(rpc_seen.idx >= 0);
+	CHECK(rpc_seen.data == 0xab);
+	CHECK(MBus_rpc_outstanding() == 0);
+	CHECK(seen.recvs == 0);
+
+	// No reply in time, a late one goes to the client
+	tag = MBus_rpc_call(req, sizeof(req), 0, 1, 0, 100, rpc_done);
+	CHECK(capture(out, sizeof(out), true, 0) == 3);
+	run();
+	MBus_rpc_poll(99);
+	CHECK(rpc_seen.calls == 1);
+	MBus_rpc_poll(100);
+	CHECK(rpc_seen.calls == 2);
+	CHECK(rpc_seen.err == MBUS_ERR_TIMEOUT);
+	CHECK(rpc_seen.idx == -1);
+	reply[0] = tag;
+	CHECK(send_short(0x13, reply, sizeof(reply)));
+	run();
+	CHECK(rpc_seen.calls == 2);
+	CHECK(seen.recvs == 1);
+
+	// Timed out while the request waits for the bus: completes once, and
+	// the slot stays in use until the request has gone out
+	tag = MBus_rpc_call(req, sizeof(req), 0, 1, 0, 100, rpc_done);
+	CHECK(requested());
+	CHECK(!send_short(0x32, other, sizeof(other)));
+	run();
+	CHECK(requested());
+	MBus_rpc_poll(100);
+	CHECK(rpc_seen.calls == 3);
+	CHECK(rpc_seen.err == MBUS_ERR_TIMEOUT);
+	CHECK(MBus_rpc_outstanding() == 1);
+	CHECK(capture(out, sizeof(out), true, 0) == 3);
+	run();
+	CHECK(rpc_seen.calls == 3);
+	CHECK(MBus_rpc_outstanding() == 0);
+
+	// A request the receiver NAKs fails the call
+	tag = MBus_rpc_call(req, sizeof(req), 0, 1, 0, 100, rpc_done);
+	CHECK(capture(out, sizeof(out), false, 0) == 3);
+	run();
+	CHECK(rpc_seen.calls == 4);
+	CHECK(rpc_seen.err == MBUS_ERR_RECV_OVERFLOW);
+	CHECK(MBus_rpc_outstanding() == 0);
+}
+
+MBUS_POOL_DEFINE(pool, 4, 32);
+MBUS_POOL_DEFINE_RECV_ALLOC(pool_alloc, pool, node);
+
+static void check_pool(void) {
+	static const uint8_t msg[] = { 7, 8, 9 };
+	uint8_t* block;
+
+	reset_node(0);
+	CHECK(MBus_pool_init(&pool));
+	node.MBus_recv_buffer_alloc = pool_alloc;
+	hold_buffers = true;
+
+	CHECK(send_short(0x12, msg, sizeof(msg)));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(seen.recv_length == 3);
+	CHECK(MBus_get_stats()->recv_buffer_allocs == 1);
+	block = (uint8_t*) node.recv_buffers[seen.recv_idx];
+	CHECK((block >= pool_blocks) && (block < pool_blocks + sizeof(pool_blocks)));
+	CHECK(MBus_pool_available(&pool) == 3);
+
+	// The client takes over the reference and frees the slot
+	node.recv_buffer_lengths[seen.recv_idx] = 0;
+	CHECK(MBus_pool_ref(&pool, block));
+	MBus_pool_unref(&pool, block);
+	CHECK(MBus_pool_available(&pool) == 3);
+	MBus_pool_unref(&pool, block);
+	CHECK(MBus_pool_available(&pool) == 4);
+	MBus_pool_unref(&pool, block);
+	CHECK(MBus_pool_available(&pool) == 4);
+	CHECK(!MBus_pool_ref(&pool, block));
+	CHECK(!MBus_pool_ref(&pool, rx_buffers[0]));
+	MBus_pool_unref(&pool, rx_buffers[0]);
+	CHECK(MBus_pool_available(&pool) == 4);
+}
+
+static struct {
+	unsigned calls;
+	enum MBus_error_t err;
+} credit_seen;
+
+static void credit_done(struct MBus_credit_tx_t* c, int bytes_sent,
+		enum MBus_error_t err) {
+	(void) c;
+	(void) bytes_sent;
+	credit_seen.calls++;
+	credit_seen.err = err;
+}
+
+// An advertisement from short prefix prefix, with credits RX buffers free
+static void advertise(uint8_t prefix, uint8_t credits) {
+	uint8_t msg[] = { prefix, credits };
+	send_short(MBUS_CREDIT_CHANNEL, msg, sizeof(msg));
+	run();
+}
+
+static void check_credit(void) {
+	uint8_t buf2[] = { wire_addr(0x20), 0x55 };
+	uint8_t buf3[] = { wire_addr(0x30), 0x66 };
+	static struct MBus_credit_tx_t c2, c3;
+	uint8_t out[8];
+
+	reset_node(BUFFER_SIZE);
+	memset(&credit_seen, 0, sizeof(credit_seen));
+	node.broadcast_channels = 1 << MBUS_CREDIT_CHANNEL;
+	MBus_credit_init(&node);
+	recv_hook = MBus_credit_recv;
+
+	c2.tx.buf = buf2;
+	c2.tx.length = sizeof(buf2);
+	c2.dest = 2;
+	c2.done = credit_done;
+	c3 = c2;
+	c3.tx.buf = buf3;
+	c3.dest = 3;
+
+	// Held without credit, sent once the receiver advertises
+	advertise(2, 0);
+	CHECK(MBus_credit_available(2) == 0);
+	MBus_credit_send(&c2);
+	CHECK(!requested());
+	CHECK(MBus_credit_get_stats()->held == 1);
+	advertise(2, 1);
+	CHECK(capture(out, sizeof(out), true, 0) == 2);
+	run();
+	CHECK(credit_seen.calls == 1);
+	CHECK(credit_seen.err == MBUS_ERR_NO_ERROR);
+	CHECK(seen.recvs == 0);
+
+	// NAK'd after all (another sender took the buffer), held again
+	advertise(2, 1);
+	MBus_credit_send(&c2);
+	CHECK(capture(out, sizeof(out), false, 0) == 2);
+	run();
+	CHECK(credit_seen.calls == 1);
+	CHECK(MBus_credit_get_stats()->overflows == 1);
+	CHECK(!requested());
+	advertise(2, 1);
+	CHECK(capture(out, sizeof(out), true, 0) == 2);
+	run();
+	CHECK(credit_seen.calls == 2);
+	CHECK(credit_seen.err == MBUS_ERR_NO_ERROR);
+
+	// A receiver that never advertised fails it back
+	MBus_credit_send(&c3);
+	CHECK(capture(out, sizeof(out), false, 0) == 2);
+	run();
+	CHECK(credit_seen.calls == 3);
+	CHECK(credit_seen.err == MBUS_ERR_RECV_OVERFLOW);
+	CHECK(MBus_credit_get_stats()->failed == 1);
+	CHECK(!requested());
+}
+
+static uint32_t enum_now;
+static unsigned enum_done_calls;
+
+static uint32_t enum_clock(void) {
+	return enum_now;
+}
+static void enum_done(const struct MBus_enum_result_t* r) {
+	(void) r;
+	enum_done_calls++;
+}
+static bool enum_recv(unsigned idx) {
+	return MBus_enum_recv(&node, idx);
+}
+
+static void check_enum(void) {
+	const struct MBus_enum_result_t* r = MBus_enum_result();
+	uint8_t response[4];
+	uint32_t word;
+	uint8_t out[8];
+	unsigned i;
+
+	reset_node(BUFFER_SIZE);
+	node.broadcast_channels = 1 << 0;
+	recv_hook = enum_recv;
+	enum_now = 0;
+	enum_done_calls = 0;
+
+	// Skips prefix 1 (the mediator's own) and 2 (in use)
+	MBus_enum_start(&node, true, 1 << 2, 0, enum_clock, 10, enum_done);
+	CHECK(capture(out, sizeof(out), false, 0) == 2);
+	CHECK((out[0] == 0x00) && (out[1] == 0x3f));
+	run();
+	CHECK(capture(out, sizeof(out), false, 0) == 2);
+	CHECK((out[0] == 0x00) && (out[1] == 0x23));
+	run();
+
+	word = (1UL << 28) | (0xabcdeUL << 8) | (0x3 << 4);
+	for (i=0; i < 4; i++) response[i] = word >> (24 - 8 * i);
+	CHECK(send_short(0x00, response, sizeof(response)));
+	run();
+	CHECK(r->count == 1);
+	CHECK(capture(out, sizeof(out), false, 0) == 2);
+	CHECK(out[1] == 0x24);
+	run();
+
+	// Nobody answers the second Enumerate
+	enum_now = 9;
+	MBus_enum_poll();
+	CHECK(enum_done_calls == 0);
+	enum_now = 10;
+	MBus_enum_poll();
+	CHECK(enum_done_calls == 1);
+	CHECK(r->error == MBUS_ERR_NO_ERROR);
+	CHECK(r->transactions == 4);
+	CHECK(MBus_enum_lookup(0xabcde) == 3);
+	CHECK(seen.recvs == 0);
+
+	// A command the bus keeps cutting short is given up on
+	MBus_enum_start(&node, false, 0, 0, enum_clock, 10, enum_done);
+	for (i=0; i <= MBUS_ENUM_RETRIES; i++) {
+		CHECK(capture(out, sizeof(out), false, 12) == 1);
+		run();
+	}
+	CHECK(!requested());
+	CHECK(enum_done_calls == 2);
+	CHECK(r->error == MBUS_ERR_RECV_OVERFLOW);
+	CHECK(!MBus_enum_busy());
+}
+
+static void check_hotjoin(void) {
+	static const uint8_t msg[] = { 0x42 };
+	uint8_t buf[] = { wire_addr(0x20), 0x11 };
+	uint8_t out[8];
+	unsigned i;
+
+	// Joining an idle bus, the node may send right away
+	reset_node(BUFFER_SIZE);
+	MBus_init_hotjoin(&node, 1, 1);
+	MBus_send(buf, sizeof(buf), 0);
+	CHECK(seen.send_dones == 0);
+	CHECK(capture(out, sizeof(out), true, 0) == 2);
+	run();
+	CHECK(seen.send_dones == 1);
+	CHECK(seen.send_error == MBUS_ERR_NO_ERROR);
+
+	// Joining mid-transaction, the node forwards until the next
+	// interjection, then takes part as usual
+	reset_node(BUFFER_SIZE);
+	clk = 0;
+	din = 0;
+	MBus_init_hotjoin(&node, clk, din);
+	CHECK(!clkout && !dout);
+	for (i=0; i < 10; i++) {
+		clock_edge();
+		data(i & 1);
+		CHECK(clkout == clk);
+		CHECK(dout == din);
+	}
+	MBus_send(buf, sizeof(buf), 0);
+	CHECK(seen.send_error == MBUS_ERR_BUS_BUSY);
+	interject();
+	control(1);
+	run();
+	CHECK(seen.errors == 0);
+	CHECK(send_short(0x12, msg, sizeof(msg)));
+	run();
+	CHECK(seen.recvs == 1);
+}
+
+static unsigned rate_sets;
+static uint32_t rate_set_hz;
+
+static void set_clock_rate(uint32_t hz) {
+	rate_sets++;
+	rate_set_hz = hz;
+}
+
+static void check_rate(void) {
+	static const uint8_t msg[] = { 1 };
+	struct MBus_rate_t r;
+	unsigned i;
+
+	memset(&r, 0, sizeof(r));
+	r.min_hz = 1000;
+	r.max_hz = 100;
+	r.step_hz = 100;
+	r.clean_to_increase = 2;
+	r.set_clock_rate = set_clock_rate;
+	rate_sets = 0;
+	CHECK(!MBus_rate_init(&r, 500));
+	CHECK(rate_sets == 0);
+
+	r.max_hz = 4000;
+	CHECK(MBus_rate_init(&r, 2000));
+	CHECK((rate_sets == 1) && (rate_set_hz == 2000));
+
+	// Clean transactions raise the rate, applied only once idle
+	reset_node(BUFFER_SIZE);
+	for (i=0; i < 2; i++) {
+		CHECK(send_short(0x12, msg, sizeof(msg)));
+		run();
+		MBus_rate_transaction_done(&r, MBUS_ERR_NO_ERROR, false);
+	}
+	CHECK(r.rate_hz == 2000);
+	MBus_rate_idle(&r);
+	CHECK((rate_sets == 2) && (rate_set_hz == 2100));
+
+	// A clock glitch: the node reports a synchronization error once the
+	// mediator has recovered the bus, and the rate backs off
+	data(0);
+	clock_edge();
+	MBus_CLKIN_int_handler(clk);
+	interject();
+	control(1);
+	run();
+	CHECK(seen.errors == 1);
+	CHECK(seen.error == MBUS_ERR_CLOCK_SYNCH_ERROR);
+	MBus_rate_transaction_done(&r, seen.error, false);
+	CHECK(r.backoffs == 1);
+	CHECK(rate_sets == 2);
+	MBus_rate_idle(&r);
+	CHECK((rate_sets == 3) && (rate_set_hz == 1050));
+	CHECK(r.ceiling_hz == 2100);
+
+	// Errors not caused by timing are neutral
+	MBus_rate_transaction_done(&r, MBUS_ERR_RECV_OVERFLOW, false);
+	CHECK(r.backoffs == 1);
+	MBus_rate_transaction_done(&r, MBUS_ERR_NO_ERROR, true);
+	CHECK(r.backoffs == 2);
+	CHECK(r.last_backoff_error == MBUS_ERR_INTERRUPTED);
+}
+
+#if MBUS_LVC_ENTRIES > 0
+static void check_lvc(void) {
+	static const uint8_t value[] = { 0x40, 7, 8 };
+	static const uint8_t other[] = { 0x41, 1 };
+	uint8_t buf[MBUS_LVC_VALUE_LENGTH + 2];
+	unsigned sequence;
+	int entry, clash;
+	unsigned key;
+
+	reset_node(BUFFER_SIZE);
+	node.recv_length_hint = true;
+	CHECK(MBus_lvc_register(0x12000000, 0x40) == -1);
+	node.recv_length_hint = false;
+
+	entry = MBus_lvc_register(0x12000000, 0x40);
+	CHECK(entry >= 0);
+	CHECK(MBus_lvc_register(0x12000000, 0x40) == entry);
+	CHECK(irq_depth == 0);
+
+	// Values go to the cache, other messages to the client
+	CHECK(send_short(0x12, value, sizeof(value)));
+	run();
+	CHECK(seen.recvs == 0);
+	CHECK(MBus_lvc_read(entry, buf, &sequence) == 3);
+	CHECK(memcmp(buf, value, 3) == 0);
+	CHECK(sequence == 1);
+	CHECK(MBus_get_stats()->lvc_updates == 1);
+	CHECK(send_short(0x12, other, sizeof(other)));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(seen.recv_data[0] == 0x41);
+
+	// Too long for the entry, the old value stays
+	memset(buf, 0x40, sizeof(buf));
+	CHECK(!send_short(0x12, buf, MBUS_LVC_VALUE_LENGTH + 1));
+	run();
+	CHECK(seen.error == MBUS_ERR_RECV_OVERFLOW);
+	CHECK(MBus_lvc_read(entry, buf, &sequence) == 3);
+	CHECK(sequence == 1);
+
+	// Another key for the same entry cannot be registered
+	for (key=0; key < 256; key++) {
+		if ((key != 0x40) && (lvc_slot(0x12000000, key) == (unsigned) entry)) {
+			break;
+		}
+	}
+	clash = (key < 256) ? MBus_lvc_register(0x12000000, key) : -1;
+	CHECK(clash == -1);
+	CHECK(MBus_lvc_read(MBUS_LVC_ENTRIES, buf, NULL) == -1);
+}
+#endif
+
+#if MBUS_HISTOGRAMS
+static void check_histograms(void) {
+	static const uint8_t msg[] = { 1, 2 };
+
+	reset_node(BUFFER_SIZE);
+	CHECK(send_short(0x12, msg, 2));
+	run();
+	CHECK(MBus_get_stats()->recv_length_hist[1] == 1);
+	CHECK(MBus_get_stats()->recv_occupancy_hist[0] == 1);
+}
+#endif
+
+#if MBUS_TRACE_DEPTH > 0
+static void check_trace(void) {
+	static const uint8_t msg[] = { 1 };
+	struct MBus_trace_entry_t t[MBUS_TRACE_DEPTH];
+	unsigned n, lost;
+
+	reset_node(BUFFER_SIZE);
+	node.get_time = get_time;
+	CHECK(send_short(0x12, msg, 1));
+	run();
+	n = MBus_trace_read(t, MBUS_TRACE_DEPTH, &lost);
+	CHECK(n > 0);
+	CHECK(lost == 0);
+	CHECK(MBus_trace_read(t, MBUS_TRACE_DEPTH, &lost) == 0);
+}
+#endif
+
+#if MBUS_TIMESYNC
+static void check_timesync(void) {
+	uint8_t sync[4];
+	uint8_t out[8];
+	uint32_t sent;
+	unsigned i;
+
+	reset_node(BUFFER_SIZE);
+	node.get_time = get_time;
+	node.broadcast_channels = 1 << MBUS_TIMESYNC_CHANNEL;
+
+	// The sender's time maps onto get_time at the end of the address
+	time_now = 1000;
+	for (i=0; i < 4; i++) sync[i] = 50000 >> (8 * i);
+	CHECK(send_short(MBUS_TIMESYNC_CHANNEL, sync, sizeof(sync)));
+	run();
+	CHECK(seen.recvs == 0);
+	CHECK(MBus_timesync_valid());
+	CHECK(MBus_timesync_from_local(1000) == 50000);
+	CHECK(MBus_get_stats()->timesyncs == 1);
+
+	// And is what this node then broadcasts
+	time_now = 2000;
+	CHECK(MBus_timesync_broadcast());
+	CHECK(capture(out, sizeof(out), false, 0) == 5);
+	run();
+	CHECK(out[0] == wire_addr(MBUS_TIMESYNC_CHANNEL));
+	sent = out[1] | (out[2] << 8) | (out[3] << 16) | ((uint32_t) out[4] << 24);
+	CHECK(sent == 51000);
+}
+#endif
+
+#if MBUS_MULTICAST
+static void check_multicast(void) {
+	static const uint8_t member[] = { 7, 1, 2 };
+	static const uint8_t other[] = { 8, 1 };
+
+	reset_node(BUFFER_SIZE);
+	node.broadcast_channels = 1 << MBUS_MULTICAST_CHANNEL;
+	MBus_multicast_join(7);
+	CHECK(MBus_multicast_member(7));
+	CHECK(!MBus_multicast_member(8));
+
+	send_short(MBUS_MULTICAST_CHANNEL, member, sizeof(member));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(seen.recv_length == 3);
+	send_short(MBUS_MULTICAST_CHANNEL, other, sizeof(other));
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(MBus_get_stats()->multicast_filtered == 1);
+	CHECK(seen.errors == 0);
+
+	MBus_multicast_leave(7);
+	CHECK(!MBus_multicast_member(7));
+}
+#endif
+
+#if MBUS_LOOPBACK
+static void check_loopback(void) {
+	uint8_t self[] = { wire_addr(0x12), 5, 6 };
+	uint8_t bcast[] = { wire_addr(0x03), 9 };
+	uint8_t out[8];
+	unsigned idx;
+
+	reset_node(BUFFER_SIZE);
+	node.broadcast_channels = 1 << 3;
+
+	// Its own prefix never uses the bus
+	MBus_send(self, sizeof(self), 0);
+	CHECK(!requested());
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(seen.recv_length == 2);
+	CHECK(seen.recv_addr == 0x12000000);
+	CHECK((seen.recv_data[0] == 5) && (seen.recv_data[1] == 6));
+	CHECK(seen.send_dones == 1);
+	CHECK(seen.bytes_sent == 3);
+	CHECK(seen.send_error == MBUS_ERR_NO_ERROR);
+	CHECK(MBus_get_stats()->loopbacks == 1);
+
+	// A subscribed broadcast goes to both
+	MBus_send(bcast, sizeof(bcast), 0);
+	run();
+	CHECK(seen.recvs == 2);
+	CHECK(seen.send_dones == 1);
+	CHECK(capture(out, sizeof(out), false, 0) == 2);
+	run();
+	CHECK(seen.send_dones == 2);
+	CHECK(seen.send_error == MBUS_ERR_NO_ERROR);
+
+	// No RX buffer free
+	for (idx=0; idx < RX_BUFFER_COUNT; idx++) {
+		node.recv_buffer_lengths[idx] = -1;
+	}
+	MBus_send(self, sizeof(self), 0);
+	run();
+	CHECK(seen.recvs == 2);
+	CHECK(seen.send_dones == 3);
+	CHECK(seen.send_error == MBUS_ERR_RECV_OVERFLOW);
+}
+#endif
+
+#if MBUS_EVENT_QUEUE > 0
+static bool fd_readable(int fd) {
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	return poll(&p, 1, 0) == 1;
+}
+
+static void check_event_queue(void) {
+	static const uint8_t msg[] = { 1, 2 };
+	uint8_t buf[] = { wire_addr(0x20), 0x11 };
+	unsigned i, idx;
+	int fd;
+
+	reset_node(BUFFER_SIZE);
+	node.MBus_events_pending = on_events_pending;
+
+	// Callbacks wait for MBus_run
+	CHECK(send_short(0x12, msg, sizeof(msg)));
+	CHECK(seen.recvs == 0);
+	CHECK(seen.pending == 1);
+	CHECK(MBus_run() == 1);
+	CHECK(seen.recvs == 1);
+
+	// A full queue refuses receives (NAK) and sends, counted once each.
+	// The buffers are handed back early so only the queue runs out.
+	for (i=0; i < MBUS_EVENT_QUEUE; i++) {
+		CHECK(send_short(0x12, msg, sizeof(msg)));
+		for (idx=0; idx < RX_BUFFER_COUNT; idx++) release(idx);
+	}
+	CHECK(seen.pending == 2);
+	CHECK(!send_short(0x12, msg, sizeof(msg)));
+	CHECK(MBus_get_stats()->events_refused == 1);
+	CHECK(MBus_get_stats()->events_dropped == 0);
+	MBus_send(buf, sizeof(buf), 0);
+	CHECK(seen.send_dones == 1);
+	CHECK(seen.send_error == MBUS_ERR_BUS_BUSY);
+	CHECK(!requested());
+	CHECK(MBus_run() == MBUS_EVENT_QUEUE);
+	CHECK(seen.recvs == 1 + MBUS_EVENT_QUEUE);
+	CHECK(seen.errors == 0);
+
+	// The eventfd is readable while events wait
+	fd = MBus_eventfd_init(&node);
+	CHECK(fd >= 0);
+	if (fd < 0) return;
+	CHECK(fd_readable(fd));
+	CHECK(MBus_eventfd_dispatch() == 0);
+	CHECK(!fd_readable(fd));
+	CHECK(send_short(0x12, msg, sizeof(msg)));
+	CHECK(fd_readable(fd));
+	CHECK(MBus_eventfd_dispatch() == 1);
+	CHECK(!fd_readable(fd));
+	CHECK(seen.recvs == 2 + MBUS_EVENT_QUEUE);
+	MBus_eventfd_close();
+}
+#else
+static void check_event_queue(void) {
+	errno = 0;
+	CHECK(MBus_eventfd_init(&node) == -1);
+	CHECK(errno == ENOSYS);
+}
+#endif
+
+#if MBUS_TRAFFIC_ENTRIES > 0
+static void check_traffic(void) {
+	static const uint8_t msg[] = { 1, 2 };
+	struct MBus_traffic_entry_t t[MBUS_TRAFFIC_ENTRIES];
+
+	reset_node(BUFFER_SIZE);
+	send_short(0x30, msg, 2);
+	send_short(0x30, msg, 2);
+	send_short(0x41, msg, 1);
+	run();
+	CHECK(MBus_traffic_read(t, MBUS_TRAFFIC_ENTRIES) == 2);
+	CHECK((t[0].addr == 0x30000000) && (t[0].messages == 2));
+	CHECK(t[0].bytes == 4);
+	CHECK((t[1].addr == 0x41000000) && (t[1].messages == 1));
+	CHECK(MBus_traffic_short_prefixes() == ((1 << 3) | (1 << 4)));
+	MBus_traffic_reset();
+	CHECK(MBus_traffic_read(t, MBUS_TRAFFIC_ENTRIES) == 0);
+}
+#endif
+
+static void check_idle(void) {
+	static const uint8_t msg[] = { 1 };
+
+	reset_node(BUFFER_SIZE);
+	node.get_time = get_time;
+	node.MBus_idle_begin = on_idle_begin;
+	node.MBus_idle_end = on_idle_end;
+	CHECK(send_short(0x12, msg, 1));
+	run();
+	CHECK(seen.idle_begins == 1);
+	CHECK(seen.idle_ends == 0);
+	CHECK(send_short(0x12, msg, 1));
+	run();
+	CHECK(seen.idle_begins == 2);
+	CHECK(seen.idle_ends == 1);
+}
+
+#if MBUS_CONSTANT_TIME > 0
+static void check_constant_time(void) {
+	static const uint8_t msg[] = { 1 };
+	uint32_t start;
+
+	// Every handler call takes at least the budget
+	reset_node(BUFFER_SIZE);
+	node.get_cycles = get_cycles;
+	start = cycles;
+	handler_calls = 0;
+	CHECK(send_short(0x12, msg, 1));
+	CHECK(cycles - start >= handler_calls * MBUS_CONSTANT_TIME);
+	run();
+	CHECK(seen.recvs == 1);
+	CHECK(MBus_get_stats()->constant_time_overruns == 0);
+}
+#endif
+
+
+static const struct {
+	const char* name;
+	void (*run)(void);
+} checks[] = {
+	{ "receive", check_receive },
+	{ "overlong", check_overlong },
+	{ "buffer_alloc", check_buffer_alloc },
+	{ "length_hint", check_length_hint },
+	{ "send", check_send },
+	{ "autoreply", check_autoreply },
+	{ "rpc", check_rpc },
+	{ "pool", check_pool },
+	{ "credit", check_credit },
+	{ "enum", check_enum },
+	{ "hotjoin", check_hotjoin },
+	{ "rate", check_rate },
+	{ "idle", check_idle },
+	{ "event_queue", check_event_queue },
+#if MBUS_HISTOGRAMS
+	{ "histograms", check_histograms },
+#endif
+#if MBUS_TRACE_DEPTH > 0
+	{ "trace", check_trace },
+#endif
+#if MBUS_TIMESYNC
+	{ "timesync", check_timesync },
+#endif
+#if MBUS_MULTICAST
+	{ "multicast", check_multicast },
+#endif
+#if MBUS_LOOPBACK
+	{ "loopback", check_loopback },
+#endif
+#if MBUS_TRAFFIC_ENTRIES > 0
+	{ "traffic", check_traffic },
+#endif
+#if MBUS_CONSTANT_TIME > 0
+	{ "constant_time", check_constant_time },
+#endif
+	// Registered entries outlive MBus_init, so this goes last
+#if MBUS_LVC_ENTRIES > 0
+	{ "lvc", check_lvc },
+#endif
+};
+
+int main(int argc, char** argv) {
+	unsigned i;
+
+	(void) argv;
+	if (argc > 1) {
+		fprintf(stderr, "usage: mbus_check\n");
+		return 2;
+	}
+
+	for (i=0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		unsigned before = failures;
+
+		current = checks[i].name;
+		checks[i].run();
+		CHECK(irq_depth == 0);
+		irq_depth = 0;
+		printf("%-14s %s\n", current, (failures == before) ? "ok" : "FAILED");
+	}
+	printf("%u checks, %u failed\n", check_count, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+/* Aggregate queries over columnar captures written by mbus_decode -o.
+ *
+ * The time range is found by binary search on the sorted timestamp column,
+ * then only the columns a query needs are scanned. Scans are written as
+ * branch-free loops over the mmap'd arrays so the compiler vectorizes them;
+ * group-by uses a small open-addressing table since rings have few
+ * addresses. The scan rate is reported so it can be compared with memory
+ * bandwidth.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mbus_columns.h"
+
+#define GROUPS 4096   // Power of two
+
+struct totals {
+	uint64_t rows;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t acks;
+	uint64_t naks;
+	uint64_t interrupted;
+	uint32_t min_length, max_length;
+};
+
+struct group {
+	bool used;
+	uint32_t address;
+	struct totals t;
+};
+
+static struct group groups[GROUPS];
+static size_t bytes_scanned;
+
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// First row with timestamp >= t
+static size_t lower_bound(const struct mbus_col_reader* r, uint64_t t) {
+	size_t lo = 0, hi = r->rows;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (r->timestamp[mid] < t) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static uint64_t parse_time(const struct mbus_col_reader* r, const char* s) {
+	double v = atof(s);
+	// Seconds if the capture knows its sample rate, samples otherwise
+	return r->sample_rate > 0 ? (uint64_t) (v * r->sample_rate) : (uint64_t) v;
+}
+
+static void add_row(struct totals* t, const struct mbus_col_reader* r,
+		size_t i) {
+	uint8_t c = r->control[i];
+	uint32_t len = r->length[i];
+
+	t->rows++;
+	if (r->error[i]) {
+		t->errors++;
+		return;
+	}
+	t->bytes += len;
+	if (c & MBUS_COL_CB_VALID) {
+		if (!(c & MBUS_COL_CB0)) t->interrupted++;
+		else if (c & MBUS_COL_CB1) t->naks++;
+		else t->acks++;
+	}
+	if ((t->rows - t->errors == 1) || (len < t->min_length)) {
+		t->min_length = len;
+	}
+	if (len > t->max_length) t->max_length = len;
+}
+
+// Totals over [lo, hi), scanning the narrow columns without branches. Like
+// add_row, error rows only count as rows and errors.
+static void scan_all(struct totals* t, const struct mbus_col_reader* r,
+		size_t lo, size_t hi) {
+	uint64_t bytes = 0, errors = 0, acks = 0, naks = 0, interrupted = 0;
+	uint32_t min_length = UINT32_MAX, max_length = 0;
+	size_t i;
+
+	for (i=lo; i < hi; i++) {
+		uint32_t ok = r->error[i] == 0;
+		uint32_t len = r->length[i] & -ok;
+		uint32_t min_candidate = len | (ok - 1);
+		uint8_t c = r->control[i] & -ok;
+		uint8_t valid_end = (c & (MBUS_COL_CB_VALID | MBUS_COL_CB0)) ==
+			(MBUS_COL_CB_VALID | MBUS_COL_CB0);
+
+		bytes += len;
+		errors += !ok;
+		acks += valid_end & !(c & MBUS_COL_CB1);
+		naks += valid_end & !!(c & MBUS_COL_CB1);
+		interrupted += (c & (MBUS_COL_CB_VALID | MBUS_COL_CB0)) ==
+			MBUS_COL_CB_VALID;
+		min_length = min_candidate < min_length ? min_candidate : min_length;
+		max_length = len > max_length ? len : max_length;
+	}
+
+	t->rows = hi - lo;
+	t->bytes = bytes;
+	t->errors = errors;
+	t->acks = acks;
+	t->naks = naks;
+	t->interrupted = interrupted;
+	t->min_length = (t->rows > errors) ? min_length : 0;
+	t->max_length = max_length;
+	bytes_scanned += (hi - lo) * (sizeof(uint32_t) + 2);
+}
+
+// Totals over [lo, hi) for one address, counted as scan_all does
+static void scan_address(struct totals* t, const struct mbus_col_reader* r,
+		size_t lo, size_t hi, uint32_t address) {
+	uint64_t rows = 0, bytes = 0, errors = 0, acks = 0, naks = 0;
+	uint64_t interrupted = 0;
+	uint32_t min_length = UINT32_MAX, max_length = 0;
+	size_t i;
+
+	for (i=lo; i < hi; i++) {
+		uint32_t match = r->address[i] == address;
+		uint32_t ok = match & (r->error[i] == 0);
+		uint32_t len = r->length[i] & -ok;
+		uint32_t min_candidate = len | (ok - 1);
+		uint8_t c = r->control[i] & -ok;
+		uint8_t valid_end = (c & (MBUS_COL_CB_VALID | MBUS_COL_CB0)) ==
+			(MBUS_COL_CB_VALID | MBUS_COL_CB0);
+
+		rows += match;
+		bytes += len;
+		errors += match & !ok;
+		acks += valid_end & !(c & MBUS_COL_CB1);
+		naks += valid_end & !!(c & MBUS_COL_CB1);
+		interrupted += (c & (MBUS_COL_CB_VALID | MBUS_COL_CB0)) ==
+			MBUS_COL_CB_VALID;
+		min_length = min_candidate < min_length ? min_candidate : min_length;
+		max_length = len > max_length ? len : max_length;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->rows = rows;
+	t->bytes = bytes;
+	t->errors = errors;
+	t->acks = acks;
+	t->naks = naks;
+	t->interrupted = interrupted;
+	t->min_length = (rows > errors) ? min_length : 0;
+	t->max_length = max_length;
+	// Error rows have address 0, so they only match broadcast channel 0
+	bytes_scanned += (hi - lo) * (2 * sizeof(uint32_t) + 2);
+}
+
+// Returns NULL if all GROUPS entries are taken by other addresses
+static struct group* find_group(uint32_t address) {
+	unsigned h = (address * 2654435761u) >> 20;
+	unsigned probes;
+	for (probes=0; probes < GROUPS; probes++, h++) {
+		struct group* g = &groups[h & (GROUPS - 1)];
+		if (!g->used) {
+			g->used = true;
+			g->address = address;
+			return g;
+		}
+		if (g->address == address) return g;
+	}
+	return NULL;
+}
+
+static void print_totals(const char* label, const struct totals* t) {
+	printf("%-10s %10llu %12llu %6u %6u %10llu %10llu %10llu %8llu\n", label,
+			(unsigned long long) t->rows, (unsigned long long) t->bytes,
+			t->min_length, t->max_length,
+			(unsigned long long) t->acks, (unsigned long long) t->naks,
+			(unsigned long long) t->interrupted,
+			(unsigned long long) t->errors);
+}
+
+static void format_address(char* buf, size_t size, uint32_t address) {
+	if ((address & 0x00ffffff) == 0) {
+		snprintf(buf, size, "%02x", address >> 24);
+	} else {
+		snprintf(buf, size, "%08x", address);
+	}
+}
+
+static void print_row(const struct mbus_col_reader* r, size_t i) {
+	char addr[16];
+	uint64_t off;
+
+	if (r->sample_rate > 0) {
+		printf("%14.6f", r->timestamp[i] / r->sample_rate);
+	} else {
+		printf("%14llu", (unsigned long long) r->timestamp[i]);
+	}
+	if (r->error[i]) {
+		printf("  error %u\n", r->error[i]);
+		return;
+	}
+	format_address(addr, sizeof(addr), r->address[i]);
+	printf("  %-8s [%3u]", addr, r->length[i]);
+	for (off=r->payload_offset[i]; off < r->payload_offset[i + 1]; off++) {
+		printf(" %02x", r->payload[off]);
+	}
+	printf("\n");
+}
+
+static void usage(const char* argv0) {
+	fprintf(stderr,
+"usage: %s [options] capture_dir\n"
+"  -t from:to       time range (seconds, or samples if the capture has no\n"
+"                   sample rate); either end may be omitted\n"
+"  -a address       only this address (hex, formatted as recv_addrs, so\n"
+"                   short prefix 3 is 3000000)\n"
+"  -g               group by address\n"
+"  -p               print the matching rows\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	struct mbus_col_reader r;
+	const char* range = NULL;
+	bool by_address = false, print = false, have_address = false;
+	uint32_t address = 0;
+	size_t lo, hi, i;
+	struct totals t;
+	double start, elapsed;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:a:gph")) != -1) {
+		switch (opt) {
+			case 't': range = optarg; break;
+			case 'a':
+				address = strtoul(optarg, NULL, 16);
+				have_address = true;
+				break;
+			case 'g': by_address = true; break;
+			case 'p': print = true; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc) usage(argv[0]);
+	if (mbus_col_open(&r, argv[optind])) return 1;
+
+	lo = 0;
+	hi = r.rows;
+	if (range) {
+		const char* colon = strchr(range, ':');
+		if (colon == NULL) usage(argv[0]);
+		if (colon != range) lo = lower_bound(&r, parse_time(&r, range));
+		if (colon[1]) hi = lower_bound(&r, parse_time(&r, colon + 1));
+		if (hi < lo) hi = lo;
+	}
+
+	start = now_seconds();
+	printf("%-10s %10s %12s %6s %6s %10s %10s %10s %8s\n", "address", "rows",
+			"bytes", "min", "max", "ack", "nak", "interrupt", "error");
+	if (by_address) {
+		for (i=lo; i < hi; i++) {
+			struct group* g;
+			if (have_address && (r.address[i] != address)) continue;
+			g = find_group(r.address[i]);
+			if (g == NULL) {
+				fprintf(stderr, "more than %d addresses, narrow the "
+						"range with -t\n", GROUPS);
+				mbus_col_unmap(&r);
+				return 1;
+			}
+			add_row(&g->t, &r, i);
+		}
+		bytes_scanned += (hi - lo) * (2 * sizeof(uint32_t) + 2);
+		for (i=0; i < GROUPS; i++) {
+			char label[16];
+			if (!groups[i].used) continue;
+			format_address(label, sizeof(label), groups[i].address);
+			print_totals(label, &groups[i].t);
+		}
+	} else if (have_address) {
+		char label[16];
+		scan_address(&t, &r, lo, hi, address);
+		format_address(label, sizeof(label), address);
+		print_totals(label, &t);
+	} else {
+		scan_all(&t, &r, lo, hi);
+		print_totals("all", &t);
+	}
+	elapsed = now_seconds() - start;
+
+	if (print) {
+		for (i=lo; i < hi; i++) {
+			if (have_address && (r.address[i] != address)) continue;
+			print_row(&r, i);
+		}
+	}
+
+	fprintf(stderr, "%zu of %zu rows, %.1f MB scanned in %.3f ms (%.2f GB/s)\n",
+			hi - lo, r.rows, bytes_scanned / 1e6, elapsed * 1e3,
+			elapsed > 0 ? bytes_scanned / elapsed / 1e9 : 0);
+	mbus_col_unmap(&r);
+	return 0;
+}
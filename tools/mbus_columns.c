@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#include "mbus_columns.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES  (MBUS_COL_COUNT * MBUS_COL_BUFFERS)
+#define ALIGNMENT     4096   // O_DIRECT needs logical block alignment
+
+_Static_assert(MBUS_COL_CHUNK % ALIGNMENT == 0,
+		"Chunks must be a multiple of the O_DIRECT alignment");
+
+static const char* const col_files[MBUS_COL_COUNT] = {
+	"timestamp.u64",
+	"address.u32",
+	"length.u32",
+	"control.u8",
+	"error.u8",
+	"payload_offset.u64",
+	"payload.bin",
+};
+
+struct col_buffer {
+	uint8_t* data;             // MBUS_COL_CHUNK bytes, ALIGNMENT aligned
+	size_t used;
+	bool busy;                 // Write in flight
+	uint64_t offset;           // File offset of the write in flight
+	uint64_t submit_ns;
+};
+
+struct column {
+	int fd;
+	uint64_t offset;           // File offset of the next chunk written
+	unsigned cur;              // Buffer being filled
+	struct col_buffer bufs[MBUS_COL_BUFFERS];
+};
+
+// io_uring set up with the raw system calls
+struct uring {
+	int fd;
+	bool fixed;                // Buffers are registered
+	unsigned inflight;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe* cqes;
+};
+
+struct mbus_col_writer {
+	char* dir;
+	double sample_rate;
+	uint64_t rows;
+	uint64_t payload_bytes;
+	bool failed;
+	bool direct;
+	uint8_t* region;           // Every column buffer
+	struct uring ring;         // fd is -1 when writing with pwrite
+	struct mbus_col_write_stats stats;
+	uint64_t latency_sum_ns;
+	struct column cols[MBUS_COL_COUNT];
+};
+
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record_latency(struct mbus_col_writer* w, uint64_t start_ns) {
+	uint64_t latency = now_ns() - start_ns;
+	w->latency_sum_ns += latency;
+	if (latency > w->stats.latency_max_ns) w->stats.latency_max_ns = latency;
+}
+
+// Writes synchronously, for the fallback path and to finish short writes
+static void write_sync(struct mbus_col_writer* w, struct column* c,
+		const uint8_t* data, size_t size, uint64_t offset) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = pwrite(c->fd, data + done, size - done, offset + done);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EINVAL) && (fcntl(c->fd, F_GETFL) & O_DIRECT)) {
+				// Not block aligned (the rest of a short write)
+				fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_DIRECT);
+				continue;
+			}
+			w->failed = true;
+			break;
+		}
+		done += n;
+	}
+	w->stats.sync_writes++;
+}
+
+static int uring_setup(struct uring* r, unsigned entries) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size) {
+			r->sq_ring_size = r->cq_ring_size;
+		}
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) goto fail_sq;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto fail_cq;
+
+	r->sq_head = (unsigned*) ((char*) r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned*) ((char*) r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned*) ((char*) r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*) ((char*) r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned*) ((char*) r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned*) ((char*) r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned*) ((char*) r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) ((char*) r->cq_ring + p.cq_off.cqes);
+	r->inflight = 0;
+	return 0;
+
+fail_cq:
+	if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+fail_sq:
+	munmap(r->sq_ring, r->sq_ring_size);
+fail:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+static void uring_free(struct uring* r) {
+	if (r->fd < 0) return;
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+// Queues a write of a full (or, at close, final) buffer and submits it
+static void submit(struct mbus_col_writer* w, unsigned col, unsigned b) {
+	struct uring* r = &w->ring;
+	struct column* c = &w->cols[col];
+	struct col_buffer* buf = &c->bufs[b];
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[idx];
+	int ret;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t) buf->data;
+	sqe->len = buf->used;
+	sqe->off = c->offset;
+	if (r->fixed) sqe->buf_index = col * MBUS_COL_BUFFERS + b;
+	sqe->user_data = col * MBUS_COL_BUFFERS + b;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	buf->busy = true;
+	buf->offset = c->offset;
+	buf->submit_ns = now_ns();
+	r->inflight++;
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0) w->failed = true;
+}
+
+// Handles completed writes, waiting for at least one if wait is set
+static void reap(struct mbus_col_writer* w, bool wait) {
+	struct uring* r = &w->ring;
+	unsigned head, tail;
+
+	if (wait) {
+		int ret;
+		do {
+			ret = syscall(__NR_io_uring_enter, r->fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+		} while ((ret < 0) && (errno == EINTR));
+		if (ret < 0) w->failed = true;
+	}
+
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+		struct column* c = &w->cols[cqe->user_data / MBUS_COL_BUFFERS];
+		struct col_buffer* buf = &c->bufs[cqe->user_data % MBUS_COL_BUFFERS];
+		size_t written = cqe->res > 0 ? (size_t) cqe->res : 0;
+
+		if (written < buf->used) {
+			// Error or short write, finish it synchronously
+			write_sync(w, c, buf->data + written, buf->used - written,
+					buf->offset + written);
+		}
+		record_latency(w, buf->submit_ns);
+		w->stats.writes++;
+		w->stats.bytes += buf->used;
+		buf->busy = false;
+		buf->used = 0;
+		r->inflight--;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Hands the current buffer of a column to the kernel and moves on to the
+// next one, waiting if every buffer is still being written
+static void flush_col(struct mbus_col_writer* w, unsigned col) {
+	struct column* c = &w->cols[col];
+	struct col_buffer* buf = &c->bufs[c->cur];
+
+	if (buf->used == 0) return;
+
+	if (w->ring.fd < 0) {
+		uint64_t start = now_ns();
+		write_sync(w, c, buf->data, buf->used, c->offset);
+		record_latency(w, start);
+		w->stats.writes++;
+		w->stats.bytes += buf->used;
+		c->offset += buf->used;
+		buf->used = 0;
+		return;
+	}
+
+	submit(w, col, c->cur);
+	c->offset += buf->used;
+	c->cur = (c->cur + 1) % MBUS_COL_BUFFERS;
+	reap(w, false);
+	if (c->bufs[c->cur].busy) {
+		uint64_t start = now_ns();
+		w->stats.stalls++;
+		while (c->bufs[c->cur].busy && !w->failed) reap(w, true);
+		w->stats.stall_ns += now_ns() - start;
+	}
+}
+
+static void put(struct mbus_col_writer* w, enum mbus_col_id id,
+		const void* value, size_t size) {
+	struct column* c = &w->cols[id];
+	const uint8_t* p = value;
+
+	while (size) {
+		struct col_buffer* buf = &c->bufs[c->cur];
+		size_t n = MBUS_COL_CHUNK - buf->used;
+		if (n > size) n = size;
+		memcpy(buf->data + buf->used, p, n);
+		buf->used += n;
+		p += n;
+		size -= n;
+		if (buf->used == MBUS_COL_CHUNK) flush_col(w, id);
+	}
+}
+
+static char* path_join(const char* dir, const char* file) {
+	size_t len = strlen(dir) + strlen(file) + 2;
+	char* path = malloc(len);
+	if (path) snprintf(path, len, "%s/%s", dir, file);
+	return path;
+}
+
+// Sets up io_uring, falling back to plain writes and then to pwrite
+static void setup_writes(struct mbus_col_writer* w) {
+	struct iovec iovs[RING_ENTRIES];
+	unsigned i, b;
+
+	w->stats.method = "pwrite";
+	if (uring_setup(&w->ring, RING_ENTRIES)) return;
+	w->stats.method = "io_uring";
+
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		for (b=0; b < MBUS_COL_BUFFERS; b++) {
+			iovs[i * MBUS_COL_BUFFERS + b].iov_base = w->cols[i].bufs[b].data;
+			iovs[i * MBUS_COL_BUFFERS + b].iov_len = MBUS_COL_CHUNK;
+		}
+	}
+	// Fails if the buffers exceed RLIMIT_MEMLOCK
+	if (syscall(__NR_io_uring_register, w->ring.fd, IORING_REGISTER_BUFFERS,
+				iovs, RING_ENTRIES) == 0) {
+		w->ring.fixed = true;
+		w->stats.method = "io_uring, registered buffers";
+	}
+}
+
+
+struct mbus_col_writer* mbus_col_create(const char* dir, double sample_rate,
+		bool direct) {
+	struct mbus_col_writer* w = calloc(1, sizeof(*w));
+	uint64_t zero = 0;
+	unsigned i, b;
+
+	if (w == NULL) return NULL;
+	for (i=0; i < MBUS_COL_COUNT; i++) w->cols[i].fd = -1;
+	w->ring.fd = -1;
+	w->dir = strdup(dir);
+	w->sample_rate = sample_rate;
+	if (w->dir == NULL) goto fail;
+	if (posix_memalign((void**) &w->region, ALIGNMENT,
+				(size_t) RING_ENTRIES * MBUS_COL_CHUNK)) {
+		w->region = NULL;
+		errno = ENOMEM;
+		goto fail;
+	}
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		for (b=0; b < MBUS_COL_BUFFERS; b++) {
+			w->cols[i].bufs[b].data = w->region +
+				(size_t) (i * MBUS_COL_BUFFERS + b) * MBUS_COL_CHUNK;
+		}
+	}
+
+	if ((mkdir(dir, 0777) < 0) && (errno != EEXIST)) goto fail;
+	w->direct = direct;
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		char* path = path_join(dir, col_files[i]);
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+		if (path == NULL) goto fail;
+		w->cols[i].fd = open(path, flags | (w->direct ? O_DIRECT : 0), 0666);
+		if ((w->cols[i].fd < 0) && w->direct && (errno == EINVAL)) {
+			// The file system does not support O_DIRECT
+			w->direct = false;
+			w->cols[i].fd = open(path, flags, 0666);
+		}
+		free(path);
+		if (w->cols[i].fd < 0) goto fail;
+	}
+
+	setup_writes(w);
+	put(w, MBUS_COL_PAYLOAD_OFFSET, &zero, sizeof(zero));
+	return w;
+
+fail:
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		if (w->cols[i].fd >= 0) close(w->cols[i].fd);
+	}
+	free(w->region);
+	free(w->dir);
+	free(w);
+	return NULL;
+}
+
+void mbus_col_append(struct mbus_col_writer* w, uint64_t timestamp,
+		uint32_t address, uint32_t length, uint8_t control, uint8_t error,
+		const uint8_t* payload) {
+	put(w, MBUS_COL_TIMESTAMP, &timestamp, sizeof(timestamp));
+	put(w, MBUS_COL_ADDRESS, &address, sizeof(address));
+	put(w, MBUS_COL_LENGTH, &length, sizeof(length));
+	put(w, MBUS_COL_CONTROL, &control, sizeof(control));
+	put(w, MBUS_COL_ERROR, &error, sizeof(error));
+	put(w, MBUS_COL_PAYLOAD, payload, length);
+	w->payload_bytes += length;
+	put(w, MBUS_COL_PAYLOAD_OFFSET, &w->payload_bytes,
+			sizeof(w->payload_bytes));
+	w->rows++;
+
+	// Only reads the completion ring, keeps the latencies accurate
+	if ((w->ring.fd >= 0) && (w->ring.inflight > 0)) reap(w, false);
+}
+
+int mbus_col_close(struct mbus_col_writer* w,
+		struct mbus_col_write_stats* stats) {
+	char* path = path_join(w->dir, "meta.txt");
+	FILE* meta;
+	unsigned i;
+	int ret;
+
+	// The last chunks are partial. O_DIRECT needs whole blocks, so they
+	// are written without it once everything before them has landed.
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		struct column* c = &w->cols[i];
+		if (w->direct && (c->bufs[c->cur].used % ALIGNMENT)) continue;
+		flush_col(w, i);
+	}
+	while ((w->ring.fd >= 0) && (w->ring.inflight > 0) && !w->failed) {
+		reap(w, true);
+	}
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		struct column* c = &w->cols[i];
+		if (c->bufs[c->cur].used == 0) continue;
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_DIRECT);
+		write_sync(w, c, c->bufs[c->cur].data, c->bufs[c->cur].used,
+				c->offset);
+		w->stats.writes++;
+		w->stats.bytes += c->bufs[c->cur].used;
+	}
+	uring_free(&w->ring);
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		if (close(w->cols[i].fd) < 0) w->failed = true;
+	}
+
+	meta = path ? fopen(path, "w") : NULL;
+	if (meta) {
+		fprintf(meta, "version %d\nrows %llu\nsample_rate %.17g\n",
+				MBUS_COL_VERSION, (unsigned long long) w->rows,
+				w->sample_rate);
+		if (fclose(meta)) w->failed = true;
+	} else {
+		w->failed = true;
+	}
+
+	if (stats) {
+		*stats = w->stats;
+		stats->direct = w->direct;
+		stats->latency_mean_ns = w->stats.writes ?
+			w->latency_sum_ns / w->stats.writes : 0;
+	}
+	ret = w->failed ? -1 : 0;
+	free(path);
+	free(w->region);
+	free(w->dir);
+	free(w);
+	return ret;
+}
+
+static int map_col(struct mbus_col_reader* r, const char* dir,
+		enum mbus_col_id id, size_t expected) {
+	char* path = path_join(dir, col_files[id]);
+	struct stat st;
+	int fd;
+
+	if (path == NULL) return -1;
+	fd = open(path, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		perror(path);
+		if (fd >= 0) close(fd);
+		free(path);
+		return -1;
+	}
+	if ((size_t) st.st_size < expected) {
+		fprintf(stderr, "%s: truncated\n", path);
+		close(fd);
+		free(path);
+		return -1;
+	}
+	r->map_sizes[id] = st.st_size;
+	if (st.st_size > 0) {
+		r->maps[id] = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (r->maps[id] == MAP_FAILED) {
+			perror(path);
+			r->maps[id] = NULL;
+			close(fd);
+			free(path);
+			return -1;
+		}
+		// Scans are sequential
+		madvise(r->maps[id], st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	free(path);
+	return 0;
+}
+
+int mbus_col_open(struct mbus_col_reader* r, const char* dir) {
+	char* path = path_join(dir, "meta.txt");
+	unsigned long long rows = 0;
+	char line[128];
+	int version = 0;
+	FILE* meta;
+
+	memset(r, 0, sizeof(*r));
+	meta = path ? fopen(path, "r") : NULL;
+	if (meta == NULL) {
+		perror(path ? path : dir);
+		free(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), meta)) {
+		sscanf(line, "version %d", &version);
+		sscanf(line, "rows %llu", &rows);
+		sscanf(line, "sample_rate %lf", &r->sample_rate);
+	}
+	fclose(meta);
+	free(path);
+	if (version != MBUS_COL_VERSION) {
+		fprintf(stderr, "%s: unsupported version %d\n", dir, version);
+		return -1;
+	}
+	r->rows = rows;
+
+	if (
+			map_col(r, dir, MBUS_COL_TIMESTAMP, rows * sizeof(uint64_t)) ||
+			map_col(r, dir, MBUS_COL_ADDRESS, rows * sizeof(uint32_t)) ||
+			map_col(r, dir, MBUS_COL_LENGTH, rows * sizeof(uint32_t)) ||
+			map_col(r, dir, MBUS_COL_CONTROL, rows) ||
+			map_col(r, dir, MBUS_COL_ERROR, rows) ||
+			map_col(r, dir, MBUS_COL_PAYLOAD_OFFSET,
+				(rows + 1) * sizeof(uint64_t)) ||
+			map_col(r, dir, MBUS_COL_PAYLOAD, 0)
+	   ) {
+		mbus_col_unmap(r);
+		return -1;
+	}
+	r->timestamp = r->maps[MBUS_COL_TIMESTAMP];
+	r->address = r->maps[MBUS_COL_ADDRESS];
+	r->length = r->maps[MBUS_COL_LENGTH];
+	r->control = r->maps[MBUS_COL_CONTROL];
+	r->error = r->maps[MBUS_COL_ERROR];
+	r->payload_offset = r->maps[MBUS_COL_PAYLOAD_OFFSET];
+	r->payload = r->maps[MBUS_COL_PAYLOAD];
+	return 0;
+}
+
+void mbus_col_unmap(struct mbus_col_reader* r) {
+	unsigned i;
+	for (i=0; i < MBUS_COL_COUNT; i++) {
+		if (r->maps[i]) munmap(r->maps[i], r->map_sizes[i]);
+		r->maps[i] = NULL;
+	}
+}
@@ -0,0 +1,113 @@
+#ifndef MBUS_COLUMNS_H
+#define MBUS_COLUMNS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Columnar store for decoded bus traffic.
+ *
+ * A capture is a directory holding one file per column. Every file is a
+ * plain array of native-endian fixed-width values with no header, so a
+ * column can be mmap'd and scanned as an array (and the compiler can
+ * vectorize the scan). Row i of every column belongs to the same message:
+ *
+ *   timestamp.u64        sample index of the start of the transaction
+ *   address.u32          address, formatted as recv_addrs
+ *   length.u32           payload length in bytes
+ *   control.u8           MBUS_COL_CB0 | MBUS_COL_CB1 | MBUS_COL_CB_VALID
+ *   error.u8             enum MBus_error_t, or 0 for a message
+ *   payload_offset.u64   rows + 1 entries, row i's payload is
+ *                        payload.bin[offset[i] .. offset[i + 1])
+ *   payload.bin          all payloads back to back
+ *   meta.txt             "rows", "sample_rate" and "version" lines
+ *
+ * Rows are in transaction order, so timestamp is sorted and time ranges can
+ * be found by binary search. Error rows have a zero address and length.
+ *
+ * The writer buffers each column and writes it in MBUS_COL_CHUNK byte
+ * chunks. meta.txt is only written by mbus_col_close, so its row count
+ * tells which rows are complete even if a capture was cut short.
+ *
+ * Chunks are written asynchronously through io_uring (set up with the raw
+ * system calls), from buffers registered with the kernel when RLIMIT_MEMLOCK
+ * allows, so appending never waits for the disk unless all
+ * MBUS_COL_BUFFERS buffers of a column are still being written. Buffers and
+ * chunks are aligned for O_DIRECT, which bypasses the page cache so long
+ * captures do not evict everything else. Without io_uring (old kernels,
+ * seccomp) the writer falls back to pwrite; the file format is the same
+ * either way.
+ */
+
+#define MBUS_COL_VERSION   1
+#define MBUS_COL_CHUNK     (1 << 18)
+#define MBUS_COL_BUFFERS   4     // Per column
+
+#define MBUS_COL_CB0       0x1
+#define MBUS_COL_CB1       0x2
+#define MBUS_COL_CB_VALID  0x4
+
+enum mbus_col_id {
+	MBUS_COL_TIMESTAMP,
+	MBUS_COL_ADDRESS,
+	MBUS_COL_LENGTH,
+	MBUS_COL_CONTROL,
+	MBUS_COL_ERROR,
+	MBUS_COL_PAYLOAD_OFFSET,
+	MBUS_COL_PAYLOAD,
+	MBUS_COL_COUNT,
+};
+
+struct mbus_col_writer;
+
+// How a capture was written, filled in by mbus_col_close
+struct mbus_col_write_stats {
+	const char* method;        // "io_uring, registered buffers",
+	                           // "io_uring" or "pwrite"
+	bool direct;               // O_DIRECT was used
+	uint64_t writes;
+	uint64_t bytes;
+	// Writes (or their remainders) done with pwrite: all of them on the
+	// fallback path, otherwise short writes and O_DIRECT's partial tails
+	uint64_t sync_writes;
+	// Appends that waited for a buffer to be written, and for how long.
+	// Waiting is what could back up the decoder and make it drop messages.
+	uint64_t stalls;
+	uint64_t stall_ns;
+	// Submission to completion, or pwrite duration on the fallback path
+	uint64_t latency_mean_ns;
+	uint64_t latency_max_ns;
+};
+
+struct mbus_col_writer* mbus_col_create(const char* dir, double sample_rate,
+		bool direct);
+  // Returns NULL (with errno set) on failure. direct requests O_DIRECT,
+  // which is silently not used if the file system does not support it.
+void mbus_col_append(struct mbus_col_writer*, uint64_t timestamp,
+		uint32_t address, uint32_t length, uint8_t control, uint8_t error,
+		const uint8_t* payload);
+int mbus_col_close(struct mbus_col_writer*, struct mbus_col_write_stats*);
+  // Returns 0, or -1 if any write failed. Stats may be NULL.
+
+// A capture opened for reading. Columns are mmap'd read-only.
+struct mbus_col_reader {
+	size_t rows;
+	double sample_rate;
+	const uint64_t* timestamp;
+	const uint32_t* address;
+	const uint32_t* length;
+	const uint8_t* control;
+	const uint8_t* error;
+	const uint64_t* payload_offset;
+	const uint8_t* payload;
+
+	// Private
+	void* maps[MBUS_COL_COUNT];
+	size_t map_sizes[MBUS_COL_COUNT];
+};
+
+int mbus_col_open(struct mbus_col_reader*, const char* dir);
+  // Returns 0, or -1 with a message printed to stderr
+void mbus_col_unmap(struct mbus_col_reader*);
+
+#endif // MBUS_COLUMNS_H
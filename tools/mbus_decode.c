@@ -0,0 +1,580 @@
+/* Live MBus decoder for logic analyzer sample streams.
+ *
+ * Reads raw samples from stdin, one byte per sample with CLK and DATA on
+ * configurable bits (e.g. `sigrok-cli ... -O binary`), and prints every
+ * message as soon as its transaction completes.
+ *
+ * Decoding is split into three pipeline stages, each on its own thread (and,
+ * with -A, its own core), connected by lock-free single-producer
+ * single-consumer rings (spsc_ring.h):
+ *
+ *   edges:     reads stdin and turns samples into CLK / DATA edge events.
+ *              Runs of unchanged samples are skipped eight at a time.
+ *   protocol:  feeds the edges to the libmbus.c state machine, configured
+ *              as a promiscuous snooper that never drives the bus, and
+ *              collects the completed messages.
+ *   output:    formats the messages, and with -o also appends them to a
+ *              columnar capture (mbus_columns.h) for mbus_colscan. The
+ *              capture is written asynchronously with io_uring, so disk
+ *              latency only reaches the pipeline when the writer runs out
+ *              of buffers, which is reported as stalls at exit.
+ *
+ * Stages never block on each other except when a ring is full or empty; an
+ * idle consumer spins briefly, then yields, then sleeps for at most
+ * WAIT_SLEEP_NS, which bounds the added latency. Each read from stdin is
+ * timestamped, and the delay from then until the message it completed is
+ * printed is reported at exit together with the throughput and ring usage.
+ *
+ * The decoder starts in an unsynchronized state and joins the bus the first
+ * time both lines have been high for the idle gap (-g).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libmbus.h"
+#include "spsc_ring.h"
+#include "mbus_columns.h"
+
+#define READ_SIZE       (64 * 1024)
+#define EDGE_RING_SIZE  (1 << 16)
+#define MSG_RING_SIZE   (1 << 10)
+#define MAX_MSG_LENGTH  1024
+#define WAIT_SPINS      1000
+#define WAIT_YIELDS     100
+#define WAIT_SLEEP_NS   50000
+
+// Edge events, one uint64_t each: sample << 2 | line << 1 | value, or, with
+// EVENT_STAMP set, the CLOCK_MONOTONIC time of the read the following
+// edges came from
+#define EVENT_STAMP     (1ull << 63)
+#define LINE_CLK        0
+#define LINE_DATA       1
+
+enum record_kind {
+	RECORD_MESSAGE,
+	RECORD_ERROR,
+};
+
+struct record {
+	uint64_t start, end;       // Samples
+	uint64_t read_ns;          // When the ending edge was read
+	uint32_t addr;
+	int length;
+	uint8_t kind;
+	uint8_t error;
+	uint8_t snooped;           // Control bits are valid
+	uint8_t cb0, cb1;
+	uint8_t data[MAX_MSG_LENGTH];
+};
+
+static struct config {
+	unsigned clk_bit;
+	unsigned data_bit;
+	double sample_rate;
+	uint64_t idle_gap;
+	bool pin;
+	bool quiet;
+	const char* columns_dir;
+	bool direct;
+} cfg = {
+	.clk_bit = 0,
+	.data_bit = 1,
+	.sample_rate = 0,
+	.idle_gap = 1000,
+	.pin = false,
+	.quiet = false,
+	.columns_dir = NULL,
+	.direct = false,
+};
+
+static struct spsc_ring edge_ring, msg_ring;
+
+// Edge stage results
+static uint64_t samples_read;
+static uint64_t edges_seen;
+static double read_seconds;
+
+// Protocol stage state, only touched by that thread
+static struct MBus_t mbus_cfg;
+static uint8_t rx_buffers[RX_BUFFER_COUNT][MAX_MSG_LENGTH];
+static uint64_t cur_sample, cur_read_ns;
+static uint64_t txn_start;
+static bool txn_open;
+static uint64_t messages_decoded;
+
+// Output stage state and results
+static struct mbus_col_writer* columns;
+static uint64_t latency_sum_ns, latency_max_ns, latency_count;
+
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void wait_backoff(unsigned* waits) {
+	if (*waits < WAIT_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} else if (*waits < WAIT_SPINS + WAIT_YIELDS) {
+		sched_yield();
+	} else {
+		struct timespec ts = { 0, WAIT_SLEEP_NS };
+		nanosleep(&ts, NULL);
+	}
+	(*waits)++;
+}
+
+// Pins the calling thread to the nth CPU it is allowed to run on
+static void pin_to(unsigned nth) {
+	cpu_set_t allowed, one;
+	unsigned cpu, seen = 0;
+
+	if (!cfg.pin) return;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) return;
+	for (cpu=0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed)) continue;
+		if (seen++ < nth) continue;
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+		return;
+	}
+}
+
+
+/* Edge stage */
+
+static void push_edge(uint64_t event) {
+	unsigned waits = 0;
+	uint64_t* slot;
+
+	while (spsc_reserve(&edge_ring, (void**) &slot) == 0) {
+		wait_backoff(&waits);
+	}
+	*slot = event;
+	spsc_commit(&edge_ring, 1);
+}
+
+static void* edge_stage(void* arg) {
+	static uint8_t buf[READ_SIZE];
+	const uint8_t mask = (1 << cfg.clk_bit) | (1 << cfg.data_bit);
+	const uint64_t mask8 = mask * 0x0101010101010101ull;
+	uint64_t sample = 0;
+	uint64_t start = now_ns();
+	uint8_t prev = 0;
+	bool first = true;
+
+	(void) arg;
+	pin_to(0);
+
+	for (;;) {
+		ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+		ssize_t i = 0;
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("read");
+			break;
+		}
+		if (n == 0) break;
+
+		// Edges from this read are stamped with when it returned
+		push_edge(EVENT_STAMP | now_ns());
+
+		if (first) {
+			// Initial levels, so the protocol stage knows where
+			// the lines start
+			prev = buf[0] & mask;
+			push_edge(LINE_CLK << 1 | !!(prev & (1 << cfg.clk_bit)));
+			push_edge(LINE_DATA << 1 | !!(prev & (1 << cfg.data_bit)));
+			first = false;
+		}
+
+		while (i < n) {
+			uint8_t v, changed;
+
+			// Skip runs of unchanged samples eight at a time
+			if (i + 8 <= n) {
+				uint64_t word;
+				memcpy(&word, &buf[i], sizeof(word));
+				if (((word ^ (prev * 0x0101010101010101ull)) & mask8) == 0) {
+					i += 8;
+					continue;
+				}
+			}
+
+			v = buf[i] & mask;
+			changed = v ^ prev;
+			if (changed) {
+				uint64_t s = sample + i;
+				// CLK first: drivers change DATA just after
+				// the CLK edge that tells them to
+				if (changed & (1 << cfg.clk_bit)) {
+					push_edge(s << 2 | LINE_CLK << 1 |
+							!!(v & (1 << cfg.clk_bit)));
+					edges_seen++;
+				}
+				if (changed & (1 << cfg.data_bit)) {
+					push_edge(s << 2 | LINE_DATA << 1 |
+							!!(v & (1 << cfg.data_bit)));
+					edges_seen++;
+				}
+				prev = v;
+			}
+			i++;
+		}
+		sample += n;
+	}
+
+	samples_read = sample;
+	read_seconds = (now_ns() - start) / 1e9;
+	spsc_close(&edge_ring);
+	return NULL;
+}
+
+
+/* Protocol stage */
+
+static void set_gpio_val(unsigned gpio_idx, bool gpio_val) {
+	// Snooping only, never drive the bus
+	(void) gpio_idx;
+	(void) gpio_val;
+}
+
+static struct record* begin_record(enum record_kind kind) {
+	unsigned waits = 0;
+	struct record* r;
+
+	while (spsc_reserve(&msg_ring, (void**) &r) == 0) {
+		wait_backoff(&waits);
+	}
+	r->kind = kind;
+	r->start = txn_start;
+	r->end = cur_sample;
+	r->read_ns = cur_read_ns;
+	r->length = 0;
+	r->snooped = 0;
+	txn_open = false;
+	return r;
+}
+
+static void message(unsigned idx, bool snooped, bool cb0, bool cb1) {
+	struct record* r = begin_record(RECORD_MESSAGE);
+
+	r->addr = mbus_cfg.recv_addrs[idx];
+	r->length = -mbus_cfg.recv_buffer_lengths[idx];
+	memcpy(r->data, (const void*) mbus_cfg.recv_buffers[idx], r->length);
+	r->snooped = snooped;
+	r->cb0 = cb0;
+	r->cb1 = cb1;
+	spsc_commit(&msg_ring, 1);
+	messages_decoded++;
+
+	// Copied out, hand the buffer straight back
+	mbus_cfg.recv_buffer_lengths[idx] = MAX_MSG_LENGTH;
+}
+
+static void snoop_recv(unsigned idx, bool cb0, bool cb1) {
+	message(idx, true, cb0, cb1);
+}
+
+static void recv(unsigned idx) {
+	message(idx, false, 0, 0);
+}
+
+static void error(enum MBus_error_t err) {
+	struct record* r = begin_record(RECORD_ERROR);
+	r->error = err;
+	spsc_commit(&msg_ring, 1);
+}
+
+static void send_done(int bytes_sent, enum MBus_error_t err) {
+	(void) bytes_sent;
+	(void) err;
+}
+
+static void* protocol_stage(void* arg) {
+	bool clk = 1, data = 1, synced = false;
+	uint64_t last_edge = 0;
+	unsigned i;
+
+	(void) arg;
+	pin_to(1);
+
+	mbus_cfg.CLKOUT_gpio = 0;
+	mbus_cfg.DOUT_gpio = 1;
+	mbus_cfg.promiscuous_mode = 1;
+	mbus_cfg.broadcast_channels = 0;
+	// Prefixes that no address can match, so every message is snooped
+	mbus_cfg.short_prefix = 0xf;
+	mbus_cfg.full_prefix = 0xffffffff;
+	mbus_cfg.set_gpio_val = set_gpio_val;
+	mbus_cfg.MBus_send_done = send_done;
+	mbus_cfg.MBus_recv = recv;
+	mbus_cfg.MBus_snoop_recv = snoop_recv;
+	mbus_cfg.MBus_error = error;
+	for (i=0; i < RX_BUFFER_COUNT; i++) {
+		mbus_cfg.recv_buffers[i] = rx_buffers[i];
+		mbus_cfg.recv_buffer_lengths[i] = MAX_MSG_LENGTH;
+	}
+
+	for (;;) {
+		unsigned waits = 0;
+		uint64_t* events;
+		size_t n, j;
+
+		while ((n = spsc_peek(&edge_ring, (void**) &events)) == 0) {
+			if (spsc_closed(&edge_ring)) {
+				if (spsc_peek(&edge_ring, (void**) &events) == 0) {
+					spsc_close(&msg_ring);
+					return NULL;
+				}
+				continue;
+			}
+			wait_backoff(&waits);
+		}
+
+		for (j=0; j < n; j++) {
+			uint64_t e = events[j];
+			bool value = e & 1;
+			bool is_data = (e >> 1) & 1;
+
+			if (e & EVENT_STAMP) {
+				cur_read_ns = e & ~EVENT_STAMP;
+				continue;
+			}
+			cur_sample = e >> 2;
+
+			if (!synced && clk && data &&
+					(cur_sample - last_edge >= cfg.idle_gap)) {
+				MBus_init(&mbus_cfg);
+				synced = true;
+			}
+			last_edge = cur_sample;
+
+			if (is_data) {
+				if (value == data) continue;
+				data = value;
+				if (synced) MBus_DIN_int_handler(data);
+			} else {
+				if (value == clk) continue;
+				clk = value;
+				if (!synced) continue;
+				if (!txn_open) {
+					txn_start = cur_sample;
+					txn_open = true;
+				}
+				MBus_CLKIN_int_handler(clk);
+			}
+		}
+		spsc_release(&edge_ring, n);
+	}
+}
+
+
+/* Output stage */
+
+static void print_time(uint64_t sample) {
+	if (cfg.sample_rate > 0) {
+		printf("%14.6f", sample / cfg.sample_rate);
+	} else {
+		printf("%14llu", (unsigned long long) sample);
+	}
+}
+
+static void print_record(const struct record* r) {
+	int i;
+
+	print_time(r->start);
+	if (r->kind == RECORD_ERROR) {
+		printf("  error %u\n", r->error);
+		return;
+	}
+	if ((r->addr & 0x00ffffff) == 0) {
+		printf("  %02x      ", r->addr >> 24);
+	} else {
+		printf("  %08x", r->addr);
+	}
+	printf(" [%3d]", r->length);
+	for (i=0; i < r->length; i++) printf(" %02x", r->data[i]);
+	if (r->snooped) {
+		if (!r->cb0) {
+			printf(r->cb1 ? "  interrupted (error)" : "  interrupted");
+		} else {
+			printf(r->cb1 ? "  NAK" : "  ACK");
+		}
+	}
+	printf("\n");
+}
+
+static void store_record(const struct record* r) {
+	uint8_t control = 0;
+
+	if (r->kind == RECORD_ERROR) {
+		mbus_col_append(columns, r->start, 0, 0, 0, r->error, NULL);
+		return;
+	}
+	if (r->snooped) {
+		control = MBUS_COL_CB_VALID;
+		if (r->cb0) control |= MBUS_COL_CB0;
+		if (r->cb1) control |= MBUS_COL_CB1;
+	}
+	mbus_col_append(columns, r->start, r->addr, r->length, control, 0,
+			r->data);
+}
+
+static void* output_stage(void* arg) {
+	(void) arg;
+	pin_to(2);
+
+	for (;;) {
+		unsigned waits = 0;
+		struct record* records;
+		size_t n, j;
+
+		while ((n = spsc_peek(&msg_ring, (void**) &records)) == 0) {
+			if (spsc_closed(&msg_ring)) {
+				if (spsc_peek(&msg_ring, (void**) &records) == 0) {
+					fflush(stdout);
+					return NULL;
+				}
+				continue;
+			}
+			// Nothing queued, make what was printed visible
+			if (waits == 0) fflush(stdout);
+			wait_backoff(&waits);
+		}
+
+		for (j=0; j < n; j++) {
+			if (!cfg.quiet) print_record(&records[j]);
+			if (columns) store_record(&records[j]);
+		}
+		if (!cfg.quiet) fflush(stdout);
+		for (j=0; j < n; j++) {
+			uint64_t latency = now_ns() - records[j].read_ns;
+			if (records[j].read_ns == 0) continue;
+			latency_sum_ns += latency;
+			latency_count++;
+			if (latency > latency_max_ns) latency_max_ns = latency;
+		}
+		spsc_release(&msg_ring, n);
+	}
+}
+
+
+static void usage(const char* argv0) {
+	fprintf(stderr,
+"usage: %s [options] < samples\n"
+"  -c bit           CLK bit in each sample byte (default %u)\n"
+"  -d bit           DATA bit in each sample byte (default %u)\n"
+"  -r hz            sample rate, print times in seconds\n"
+"  -g samples       idle gap to synchronize on (default %llu)\n"
+"  -A               pin each stage to its own CPU\n"
+"  -q               do not print messages, only the summary\n"
+"  -o dir           also write messages to a columnar capture in dir\n"
+"  -D               write the capture with O_DIRECT\n",
+		argv0, cfg.clk_bit, cfg.data_bit,
+		(unsigned long long) cfg.idle_gap);
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	struct mbus_col_write_stats write_stats;
+	pthread_t threads[3];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:d:r:g:Aqo:Dh")) != -1) {
+		switch (opt) {
+			case 'c': cfg.clk_bit = atoi(optarg); break;
+			case 'd': cfg.data_bit = atoi(optarg); break;
+			case 'r': cfg.sample_rate = atof(optarg); break;
+			case 'g': cfg.idle_gap = strtoull(optarg, NULL, 0); break;
+			case 'A': cfg.pin = true; break;
+			case 'q': cfg.quiet = true; break;
+			case 'o': cfg.columns_dir = optarg; break;
+			case 'D': cfg.direct = true; break;
+			default: usage(argv[0]);
+		}
+	}
+	if ((cfg.clk_bit > 7) || (cfg.data_bit > 7) ||
+			(cfg.clk_bit == cfg.data_bit)) {
+		usage(argv[0]);
+	}
+
+	if (
+			!spsc_init(&edge_ring, sizeof(uint64_t), EDGE_RING_SIZE) ||
+			!spsc_init(&msg_ring, sizeof(struct record), MSG_RING_SIZE)
+	   ) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	if (cfg.columns_dir) {
+		columns = mbus_col_create(cfg.columns_dir, cfg.sample_rate,
+				cfg.direct);
+		if (columns == NULL) {
+			perror(cfg.columns_dir);
+			return 1;
+		}
+	}
+
+	pthread_create(&threads[0], NULL, edge_stage, NULL);
+	pthread_create(&threads[1], NULL, protocol_stage, NULL);
+	pthread_create(&threads[2], NULL, output_stage, NULL);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	pthread_join(threads[2], NULL);
+
+	if (columns && mbus_col_close(columns, &write_stats)) {
+		fprintf(stderr, "%s: write failed\n", cfg.columns_dir);
+		return 1;
+	}
+
+	fprintf(stderr, "%llu samples in %.3f s (%.1f MS/s), %llu edges, "
+			"%llu messages\n",
+			(unsigned long long) samples_read, read_seconds,
+			read_seconds > 0 ? samples_read / read_seconds / 1e6 : 0,
+			(unsigned long long) edges_seen,
+			(unsigned long long) messages_decoded);
+	fprintf(stderr, "dropped (no room) %u\n",
+			MBus_get_stats()->recv_overflows);
+	fprintf(stderr, "edge ring high water %zu/%d, full %lu; "
+			"message ring high water %zu/%d, full %lu\n",
+			edge_ring.high_water, EDGE_RING_SIZE, edge_ring.full_waits,
+			msg_ring.high_water, MSG_RING_SIZE, msg_ring.full_waits);
+	if (latency_count) {
+		fprintf(stderr, "read to output latency mean %.1f us, max %.1f us\n",
+				latency_sum_ns / 1e3 / latency_count,
+				latency_max_ns / 1e3);
+	}
+	if (cfg.columns_dir) {
+		fprintf(stderr, "capture: %s%s, %llu writes (%llu synchronous), "
+				"%.1f MB, write latency mean %.1f us, max %.1f us; "
+				"stalled %llu times for %.1f ms\n",
+				write_stats.method, write_stats.direct ? ", O_DIRECT" : "",
+				(unsigned long long) write_stats.writes,
+				(unsigned long long) write_stats.sync_writes,
+				write_stats.bytes / 1e6,
+				write_stats.latency_mean_ns / 1e3,
+				write_stats.latency_max_ns / 1e3,
+				(unsigned long long) write_stats.stalls,
+				write_stats.stall_ns / 1e6);
+	}
+
+	spsc_free(&edge_ring);
+	spsc_free(&msg_ring);
+	return 0;
+}
@@ -0,0 +1,368 @@
+/* Edge-level timing harness for the libmbus.c interrupt handlers.
+ *
+ * Drives one node through forwarded, received and transmitted messages, one
+ * CLK edge at a time, and times every MBus_CLKIN_int_handler call on the
+ * host. Two numbers are kept per state the edge starts in:
+ *
+ *   hop      handler entry to the CLKOUT write, the delay this node adds
+ *            to the clock on its way around the ring
+ *   handler  handler entry to return
+ *
+ * For each, the mean, standard deviation and 99.9th percentile are shown.
+ * The spread of hop times across states is the jitter this node adds to
+ * the clock; building with MBUS_CONSTANT_TIME should flatten both columns
+ * (the harness provides get_cycles from the same timer).
+ *
+ * The clock has to cross every node within half a bus period, so the worst
+ * hop latency bounds the bus clock for a ring of a given size (-n).
+ * Absolute numbers are for the host, not a node's microcontroller, but the
+ * distribution over states carries over. The cost of reading the timer is
+ * measured and subtracted, and tails are reported as the 99.9th percentile
+ * since true maxima on a host are set by preemption, not by the handler.
+ *
+ * With -b, address latch edges are also broken down by bit, since the edge
+ * that completes the address does most of the receive setup.
+ *
+ * libmbus.c is included directly so edges can be attributed to its states.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmbus.c"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t ticks(void) {
+	return __rdtsc();
+}
+#elif defined(__aarch64__)
+static inline uint64_t ticks(void) {
+	uint64_t v;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r" (v));
+	return v;
+}
+#else
+static inline uint64_t ticks(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#define STATE_COUNT (ERROR + 1)
+
+static const char* const state_names[STATE_COUNT] = {
+	[IDLE] = "IDLE",
+	[PREARB] = "PREARB",
+	[ARBITRATION] = "ARBITRATION",
+	[PRIO_DRIVE] = "PRIO_DRIVE",
+	[PRIO_LATCH] = "PRIO_LATCH",
+	[ARB_RESERVED_DRIVE] = "ARB_RESERVED_DRIVE",
+	[ARB_RESERVED_LATCH] = "ARB_RESERVED_LATCH",
+	[DRIVE_SHORT_ADDR] = "DRIVE_SHORT_ADDR",
+	[LATCH_SHORT_ADDR] = "LATCH_SHORT_ADDR",
+	[DRIVE_LONG_ADDR] = "DRIVE_LONG_ADDR",
+	[LATCH_LONG_ADDR] = "LATCH_LONG_ADDR",
+	[DRIVE_DATA] = "DRIVE_DATA",
+	[LATCH_DATA] = "LATCH_DATA",
+	[REQUEST_INTERRUPT] = "REQUEST_INTERRUPT",
+	[REQUESTING_INTERRUPT] = "REQUESTING_INTERRUPT",
+	[REQUESTED_INTERRUPT] = "REQUESTED_INTERRUPT",
+	[PRE_BEGIN_CONTROL] = "PRE_BEGIN_CONTROL",
+	[BEGIN_CONTROL] = "BEGIN_CONTROL",
+	[DRIVE_CB0] = "DRIVE_CB0",
+	[LATCH_CB0] = "LATCH_CB0",
+	[DRIVE_CB1] = "DRIVE_CB1",
+	[LATCH_CB1] = "LATCH_CB1",
+	[DRIVE_IDLE] = "DRIVE_IDLE",
+	[BEGIN_IDLE] = "BEGIN_IDLE",
+	[ERROR] = "ERROR",
+};
+
+#define HIST_BINS 4096    // In timer ticks, the last bin is open-ended
+
+struct timing {
+	unsigned long edges;
+	uint64_t hop_sum, handler_sum;
+	unsigned long hop_hist[HIST_BINS];
+	unsigned long handler_hist[HIST_BINS];
+};
+
+static struct timing timings[STATE_COUNT];
+// LATCH_SHORT_ADDR and LATCH_LONG_ADDR edges by the bit they latch
+static struct timing addr_timings[2][32];
+
+static struct MBus_t node;
+static uint8_t rx_buffers[RX_BUFFER_COUNT][64];
+static uint8_t tx_data[64];
+static struct MBus_tx_t tx;
+static bool clk = 1, din = 1;
+static uint64_t clkout_time;
+static bool clkout_written;
+static unsigned errors;
+static uint64_t overhead;   // Ticks taken by reading the timer
+
+static uint32_t get_cycles(void) {
+	return ticks();
+}
+
+static void set_gpio(unsigned idx, bool val) {
+	(void) val;
+	if ((idx == node.CLKOUT_gpio) && !clkout_written) {
+		clkout_time = ticks();
+		clkout_written = true;
+	}
+}
+static void recv(unsigned idx) {
+	node.recv_buffer_lengths[idx] = sizeof(rx_buffers[idx]);
+}
+static void error_cb(enum MBus_error_t err) {
+	(void) err;
+	errors++;
+}
+static void send_done(int bytes, enum MBus_error_t err) {
+	(void) bytes;
+	(void) err;
+}
+
+static unsigned percentile(const unsigned long* hist, unsigned long total,
+		double p) {
+	unsigned long seen = 0;
+	unsigned i;
+	for (i=0; i < HIST_BINS - 1; i++) {
+		seen += hist[i];
+		if (seen >= p * total) break;
+	}
+	return i;
+}
+
+static void account(struct timing* t, uint64_t hop, uint64_t handler) {
+	t->edges++;
+	t->hop_sum += hop;
+	t->hop_hist[hop < HIST_BINS ? hop : HIST_BINS - 1]++;
+	t->handler_sum += handler;
+	t->handler_hist[handler < HIST_BINS ? handler : HIST_BINS - 1]++;
+}
+
+static void clock_edge(void) {
+	enum MBus_state_t from = state;
+	unsigned bit = rx_bit_idx;
+	uint64_t start, end, hop;
+
+	clk = !clk;
+	clkout_written = false;
+	start = ticks();
+	MBus_CLKIN_int_handler(clk);
+	end = ticks();
+
+	hop = clkout_written ? clkout_time - start : end - start;
+	hop = (hop > overhead) ? hop - overhead : 0;
+	end = (end - start > overhead) ? end - overhead : start;
+	account(&timings[from], hop, end - start);
+	if ((from == LATCH_SHORT_ADDR) && (bit < 8)) {
+		account(&addr_timings[0][bit], hop, end - start);
+	} else if ((from == LATCH_LONG_ADDR) && (bit < 32)) {
+		account(&addr_timings[1][bit], hop, end - start);
+	}
+}
+
+// Ignores the open-ended bin, where host preemption lands
+static double stddev(const unsigned long* hist) {
+	double n = 0, sum = 0, sq = 0, mean;
+	unsigned i;
+	for (i=0; i < HIST_BINS - 1; i++) {
+		n += hist[i];
+		sum += (double) hist[i] * i;
+		sq += (double) hist[i] * i * i;
+	}
+	if (n == 0) return 0;
+	mean = sum / n;
+	return sq / n > mean * mean ? sqrt(sq / n - mean * mean) : 0;
+}
+
+static void print_timing(const char* name, const struct timing* t,
+		double scale) {
+	printf("%-21s %10lu %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f\n", name,
+			t->edges, t->hop_sum / scale / t->edges,
+			stddev(t->hop_hist) / scale,
+			percentile(t->hop_hist, t->edges, 0.999) / scale,
+			t->handler_sum / scale / t->edges,
+			stddev(t->handler_hist) / scale,
+			percentile(t->handler_hist, t->edges, 0.999) / scale);
+}
+
+static uint64_t timer_overhead(void) {
+	uint64_t best = UINT64_MAX;
+	unsigned i;
+	for (i=0; i < 100000; i++) {
+		uint64_t a = ticks();
+		uint64_t b = ticks();
+		if (b - a < best) best = b - a;
+	}
+	return best;
+}
+
+static void data(bool val) {
+	if (val == din) return;
+	din = val;
+	MBus_DIN_int_handler(din);
+}
+
+// One transaction as seen by the node. If transmit is set the node sends
+// tx (the mediator is upstream), otherwise an upstream node sends addr.
+static void transaction(bool transmit, uint32_t addr, unsigned addr_bits,
+		unsigned data_bytes) {
+	unsigned i;
+
+	if (transmit) {
+		tx.length = 1 + data_bytes;
+		MBus_queue_send(&tx);
+	} else {
+		data(0);
+	}
+	for (i=0; i < 4; i++) clock_edge();
+	// Nobody upstream asserts priority
+	data(0);
+	for (i=0; i < 3; i++) clock_edge();
+
+	if (transmit) {
+		for (i=0; i < 2 * 8 * (1 + data_bytes); i++) clock_edge();
+	} else {
+		for (i=0; i < addr_bits; i++) {
+			clock_edge();
+			data((addr >> (addr_bits - 1 - i)) & 1);
+			clock_edge();
+		}
+		for (i=0; i < 8 * data_bytes; i++) {
+			clock_edge();
+			data(i & 1);
+			clock_edge();
+		}
+	}
+
+	// Requester holds CLK high, then the mediator interjects
+	if (!clk) clock_edge();
+	for (i=0; i < 3; i++) {
+		data(1);
+		data(0);
+	}
+	data(1);
+	for (i=0; (i < 16) && (state != IDLE); i++) clock_edge();
+}
+
+static double ticks_per_ns(void) {
+	struct timespec a, b;
+	uint64_t t0, t1;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	t0 = ticks();
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+	} while (ns < 20e6);
+	t1 = ticks();
+	return (t1 - t0) / ns;
+}
+
+static void usage(const char* argv0) {
+	fprintf(stderr,
+"usage: %s [options]\n"
+"  -r count         transactions of each kind (default 100000)\n"
+"  -l bytes         payload length (default 8)\n"
+"  -n nodes         ring size for the bus clock bound (default 16)\n"
+"  -b               break address latch edges down by bit\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	unsigned long reps = 100000, r;
+	unsigned length = 8, nodes = 16;
+	unsigned worst_hop = 0;
+	bool by_bit = false;
+	double scale;
+	unsigned i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:l:n:bh")) != -1) {
+		switch (opt) {
+			case 'r': reps = atol(optarg); break;
+			case 'l': length = atoi(optarg); break;
+			case 'n': nodes = atoi(optarg); break;
+			case 'b': by_bit = true; break;
+			default: usage(argv[0]);
+		}
+	}
+	if ((length < 1) || (length >= sizeof(tx_data)) || (nodes < 1)) {
+		usage(argv[0]);
+	}
+
+	node.CLKOUT_gpio = 0;
+	node.DOUT_gpio = 1;
+	node.short_prefix = 0x1;
+	node.full_prefix = 0x012345;
+	node.set_gpio_val = set_gpio;
+	node.MBus_recv = recv;
+	node.MBus_error = error_cb;
+	node.MBus_send_done = send_done;
+	node.get_cycles = get_cycles;
+	for (i=0; i < RX_BUFFER_COUNT; i++) {
+		node.recv_buffers[i] = rx_buffers[i];
+		node.recv_buffer_lengths[i] = sizeof(rx_buffers[i]);
+	}
+	MBus_init(&node);
+
+	tx_data[0] = 0x20;
+	for (i=1; i < sizeof(tx_data); i++) tx_data[i] = i * 37;
+	tx.buf = tx_data;
+	overhead = timer_overhead();
+
+	for (r=0; r < reps; r++) {
+		transaction(false, 0x20, 8, length);           // Forward
+		transaction(false, 0x10, 8, length);           // Receive
+		transaction(false, 0xf0123450, 32, length);    // Receive, long
+		transaction(true, 0, 0, length);               // Transmit
+	}
+
+	scale = ticks_per_ns();
+	printf("%-21s %10s %23s %23s\n", "", "", "---------- hop ---------",
+			"-------- handler -------");
+	printf("%-21s %10s %7s %7s %7s %7s %7s %7s\n", "state (ns)", "edges",
+			"avg", "sd", "p99.9", "avg", "sd", "p99.9");
+	for (i=0; i < STATE_COUNT; i++) {
+		struct timing* t = &timings[i];
+		unsigned hop_tail;
+
+		if (t->edges == 0) continue;
+		print_timing(state_names[i], t, scale);
+		hop_tail = percentile(t->hop_hist, t->edges, 0.999);
+		if (hop_tail > worst_hop) worst_hop = hop_tail;
+	}
+	if (by_bit) {
+		for (i=0; i < 2 * 32; i++) {
+			struct timing* t = &addr_timings[i / 32][i % 32];
+			char name[32];
+
+			if (t->edges == 0) continue;
+			snprintf(name, sizeof(name), "  %s bit %u",
+					i < 32 ? "short" : "long", i % 32 + 1);
+			print_timing(name, t, scale);
+		}
+	}
+	printf("worst hop %.1f ns: bus clock below %.0f kHz for %u nodes\n",
+			worst_hop / scale,
+			1e6 / (2 * nodes * (worst_hop / scale)), nodes);
+#if MBUS_CONSTANT_TIME > 0
+	printf("MBUS_CONSTANT_TIME %u ticks, %u overruns\n", MBUS_CONSTANT_TIME,
+			stats.constant_time_overruns);
+#endif
+	if (errors) printf("%u errors reported\n", errors);
+	return errors ? 1 : 0;
+}
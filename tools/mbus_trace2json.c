@@ -0,0 +1,271 @@
+/* Converts MBus state trace records to a Chrome trace-event / Perfetto JSON
+ * file.
+ *
+ * Input is the records drained from every node with MBus_trace_read, as text,
+ * one record per line:
+ *
+ *   <node> <time> <state> <logical>
+ *
+ * where node is any small integer identifying the node (its ring position is
+ * a good choice) and time, state and logical are the fields of
+ * struct MBus_trace_entry_t. Blank lines and lines starting with '#' are
+ * ignored. Records of different nodes may be interleaved, but the records of
+ * each node must be in the order they were read. The timestamps of all nodes
+ * must share a time base.
+ *
+ * Each node becomes a track showing its arbitration, address, data,
+ * interjection and control phases, labeled with its logical role. Every
+ * data phase a node spent transmitting is linked by a flow arrow to the
+ * overlapping data phases of the nodes that received it. Note that a
+ * transmitter sends the address as part of its data phase.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chrome_trace.h"
+
+// Must match enum MBus_state_t in libmbus.c
+enum state {
+	IDLE,
+	PREARB,
+	ARBITRATION,
+	PRIO_DRIVE,
+	PRIO_LATCH,
+	ARB_RESERVED_DRIVE,
+	ARB_RESERVED_LATCH,
+	DRIVE_SHORT_ADDR,
+	LATCH_SHORT_ADDR,
+	DRIVE_LONG_ADDR,
+	LATCH_LONG_ADDR,
+	DRIVE_DATA,
+	LATCH_DATA,
+	REQUEST_INTERRUPT,
+	REQUESTING_INTERRUPT,
+	REQUESTED_INTERRUPT,
+	PRE_BEGIN_CONTROL,
+	BEGIN_CONTROL,
+	DRIVE_CB0,
+	LATCH_CB0,
+	DRIVE_CB1,
+	LATCH_CB1,
+	DRIVE_IDLE,
+	BEGIN_IDLE,
+	ERROR
+};
+
+// Must match enum MBus_logical_t in libmbus.c
+static const char* const logical_names[] = {
+	"FORWARD",
+	"TRANSMIT",
+	"RECEIVE",
+	"RECEIVE_BROADCAST",
+	"INTERRUPTER",
+};
+#define LOGICAL_TRANSMIT 1
+#define LOGICAL_RECEIVE  2
+
+enum phase {
+	PHASE_IDLE,
+	PHASE_ARBITRATION,
+	PHASE_ADDRESS,
+	PHASE_DATA,
+	PHASE_INTERJECTION,
+	PHASE_CONTROL,
+	PHASE_ERROR,
+};
+
+static const char* const phase_names[] = {
+	"idle",
+	"arbitration",
+	"address",
+	"data",
+	"interjection",
+	"control",
+	"error",
+};
+
+// Same grouping as trace_phase in libmbus.c
+static enum phase state_phase(unsigned s) {
+	if (s == IDLE) return PHASE_IDLE;
+	if (s <= ARB_RESERVED_LATCH) return PHASE_ARBITRATION;
+	if (s <= LATCH_LONG_ADDR) return PHASE_ADDRESS;
+	if (s <= LATCH_DATA) return PHASE_DATA;
+	if (s <= REQUESTED_INTERRUPT) return PHASE_INTERJECTION;
+	if (s <= BEGIN_IDLE) return PHASE_CONTROL;
+	return PHASE_ERROR;
+}
+
+struct record {
+	unsigned node;
+	uint32_t time;
+	unsigned state;
+	unsigned logical;
+	unsigned long seq;        // Input order, keeps the sort stable
+};
+
+struct slice {
+	unsigned node;
+	enum phase phase;
+	unsigned logical;
+	double start, end;        // Microseconds
+};
+
+static double ticks_per_us = 1;
+
+
+static int compare_records(const void* a, const void* b) {
+	const struct record* ra = a;
+	const struct record* rb = b;
+	if (ra->node != rb->node) return ra->node < rb->node ? -1 : 1;
+	return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+static int compare_slices(const void* a, const void* b) {
+	const struct slice* sa = a;
+	const struct slice* sb = b;
+	if (sa->start != sb->start) return sa->start < sb->start ? -1 : 1;
+	return (sa->node > sb->node) - (sa->node < sb->node);
+}
+
+static const char* logical_name(unsigned logical) {
+	if (logical < sizeof(logical_names) / sizeof(logical_names[0])) {
+		return logical_names[logical];
+	}
+	return "?";
+}
+
+static void* grow(void* array, size_t* capacity, size_t count, size_t size) {
+	if (count < *capacity) return array;
+	*capacity = *capacity ? 2 * *capacity : 1024;
+	array = realloc(array, *capacity * size);
+	if (array == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	return array;
+}
+
+static void usage(const char* argv0) {
+	fprintf(stderr,
+"usage: %s [-r ticks_per_second] [input] > trace.json\n"
+"  -r rate          timestamp ticks per second (default 1000000)\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	struct record* records = NULL;
+	struct slice* slices = NULL;
+	size_t record_count = 0, record_capacity = 0;
+	size_t slice_count = 0, slice_capacity = 0;
+	unsigned long flows = 0;
+	char line[256];
+	FILE* in = stdin;
+	size_t i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:h")) != -1) {
+		switch (opt) {
+			case 'r': ticks_per_us = atof(optarg) / 1e6; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (ticks_per_us <= 0) usage(argv[0]);
+	if (optind < argc) {
+		in = fopen(argv[optind], "r");
+		if (in == NULL) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		struct record r;
+		unsigned long time;
+
+		if ((line[0] == '#') || (line[strspn(line, " \t\r\n")] == '\0')) {
+			continue;
+		}
+		if (sscanf(line, "%u %lu %u %u", &r.node, &time, &r.state,
+					&r.logical) != 4) {
+			fprintf(stderr, "bad record: %s", line);
+			return 1;
+		}
+		r.time = time;
+		r.seq = record_count;
+		records = grow(records, &record_capacity, record_count, sizeof(r));
+		records[record_count++] = r;
+	}
+
+	qsort(records, record_count, sizeof(records[0]), compare_records);
+
+	// Each record starts a segment that lasts until the node's next record
+	for (i=0; i < record_count; i++) {
+		struct record* r = &records[i];
+		struct record* next = &records[i + 1];
+		enum phase phase = state_phase(r->state);
+		struct slice* s;
+		uint32_t ticks;
+
+		if (phase == PHASE_IDLE) continue;
+		if ((i + 1 == record_count) || (next->node != r->node)) {
+			// Trace ends mid-transaction
+			ticks = 0;
+		} else {
+			// Unsigned difference copes with the timer wrapping
+			ticks = next->time - r->time;
+		}
+
+		slices = grow(slices, &slice_capacity, slice_count, sizeof(*s));
+		s = &slices[slice_count++];
+		s->node = r->node;
+		s->phase = phase;
+		s->logical = r->logical;
+		s->start = r->time / ticks_per_us;
+		s->end = s->start + ticks / ticks_per_us;
+	}
+
+	qsort(slices, slice_count, sizeof(slices[0]), compare_slices);
+
+	chrome_trace_begin(stdout);
+	for (i=0; i < record_count; i++) {
+		if ((i == 0) || (records[i].node != records[i - 1].node)) {
+			char name[16];
+			snprintf(name, sizeof(name), "node %u", records[i].node);
+			chrome_trace_track(records[i].node, name);
+		}
+	}
+	for (i=0; i < slice_count; i++) {
+		struct slice* s = &slices[i];
+		chrome_trace_slice(s->node, phase_names[s->phase],
+				logical_name(s->logical), s->start, s->end - s->start);
+	}
+
+	// A receiver's data phase starts later than the transmitter's, which
+	// also covers the address, so only later slices need to be searched
+	for (i=0; i < slice_count; i++) {
+		struct slice* tx = &slices[i];
+		if ((tx->phase != PHASE_DATA) || (tx->logical != LOGICAL_TRANSMIT)) {
+			continue;
+		}
+		for (j=i + 1; (j < slice_count) && (slices[j].start < tx->end); j++) {
+			struct slice* rx = &slices[j];
+			if (rx->node == tx->node) continue;
+			if ((rx->phase != PHASE_DATA) || (rx->logical != LOGICAL_RECEIVE)) {
+				continue;
+			}
+			chrome_trace_flow(flows++, "message", tx->node, tx->start,
+					rx->node, (rx->start + rx->end) / 2);
+		}
+	}
+	chrome_trace_end();
+
+	fprintf(stderr, "%zu records, %zu slices, %lu messages\n",
+			record_count, slice_count, flows);
+	return 0;
+}
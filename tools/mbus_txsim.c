@@ -0,0 +1,749 @@
+/* Transaction-level MBus ring simulator.
+ *
+ * Models each message as one bus transaction rather than simulating every
+ * clock edge, so long workloads (days of traffic) run in seconds. For each
+ * transaction the model decides:
+ *
+ *   - arbitration: of all nodes with a message pending when the bus goes
+ *     idle, priority requesters beat regular ones and, within a class, the
+ *     requester closest to the mediator (furthest upstream) wins
+ *   - bus occupancy: the number of CLK edges each phase takes, derived from
+ *     the MBus_state_t sequence in libmbus.c (see the EDGES_* constants)
+ *   - overflow: if the receiver has no free RX buffer at the end of the
+ *     address phase the message is NAK'd, the transaction ends early and
+ *     the sender retries. A message longer than the RX buffers is NAK'd
+ *     once the buffer is full and fails back to the sender, as no retry
+ *     could fit.
+ *
+ * The first transactions can be written as a Chrome trace-event / Perfetto
+ * JSON file (-T) showing each node's bus phases and message flows.
+ *
+ * RX length and buffer occupancy histograms can be written (-H) in the
+ * format mbus_bufadvise reads, to size buffers for a simulated workload.
+ *
+ * Enumeration timing (-E) tabulates the transactions and time the command
+ * sequence of libmbus_enum.c takes to assign short prefixes on rings of up
+ * to MBUS_ENUM_MAX_NODES nodes, with and without a known node count.
+ *
+ * Calibration (-C) checks the per-phase edge counts against the edge-level
+ * model: it drives the real libmbus.c interrupt handlers one edge at a time
+ * for a set of sample messages (fitting, without a buffer, and too long for
+ * the buffer) and compares the edges each one took with the
+ * transaction-level prediction. A sample only matches if the node also
+ * reported the message, or its RX Overflow, and nothing else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmbus.h"
+#include "libmbus_enum.h"
+#include "chrome_trace.h"
+
+/* Edge counts per phase, following MBus_state_t:
+ *
+ *   IDLE -> PREARB -> ARBITRATION -> PRIO_DRIVE -> PRIO_LATCH ->
+ *   ARB_RESERVED_DRIVE -> ARB_RESERVED_LATCH -> DRIVE_SHORT_ADDR
+ *                                                      7 edges
+ *   DRIVE_*_ADDR / LATCH_*_ADDR                        2 edges per bit
+ *   DRIVE_DATA / LATCH_DATA                            2 edges per bit
+ *   REQUEST_INTERRUPT (the last latch leaves CLK high,
+ *   where the transmitter upstream holds it)           0 edges
+ *   ... or, when this node NAKs and holds CLK itself,
+ *   the falling edge it holds and the rising one
+ *   before the interjection                            2 edges
+ *   PRE_BEGIN_CONTROL -> (BEGIN_CONTROL) -> DRIVE_CB0 -> LATCH_CB0 ->
+ *   DRIVE_CB1 -> LATCH_CB1 -> DRIVE_IDLE -> BEGIN_IDLE -> IDLE
+ *                                                      7 edges
+ *
+ * The interjection itself toggles only DATA. Its duration depends on the
+ * mediator and is a parameter (-i, in bus clock cycles).
+ */
+#define EDGES_ARBITRATION   7
+#define EDGES_PER_BIT       2
+#define EDGES_REQUEST       0
+#define EDGES_CONTROL       7
+#define EDGES_NAK_REQUEST   2
+
+#define SHORT_ADDR_BITS     8
+#define LONG_ADDR_BITS      32
+
+#define MAX_NODES           64
+#define MAX_BUFFERS         16
+#define QUEUE_DEPTH         32
+
+struct msg {
+	double created;
+	unsigned dest;
+	unsigned length;
+	bool priority;
+	bool long_addr;
+};
+
+struct node {
+	// Pending transmissions
+	struct msg queue[QUEUE_DEPTH];
+	unsigned head, count;
+	double next_arrival;
+
+	// Time at which each RX buffer is released by the application
+	double buffer_free_at[MAX_BUFFERS];
+
+	// Statistics
+	unsigned long sent, received, naks, drops, arb_losses;
+	unsigned long too_long;   // Failed, longer than the receiver's buffers
+	double latency_sum, latency_max;
+};
+
+static struct config {
+	unsigned nodes;
+	double clock_hz;
+	double duration;
+	double rate;              // Messages per second per node
+	unsigned mean_length;
+	double priority_fraction;
+	double long_fraction;
+	unsigned buffers;
+	unsigned buffer_length;
+	double service_time;      // Seconds until a received buffer is released
+	double interjection_cycles;
+	unsigned seed;
+	const char* trace_path;   // Chrome trace-event output, or NULL
+	unsigned long trace_transactions;
+	const char* hist_path;    // mbus_bufadvise input, or NULL
+	bool enum_table;          // Tabulate enumeration time instead
+	double enum_timeout;      // Enumeration response timeout
+} cfg = {
+	.nodes = 8,
+	.clock_hz = 400e3,
+	.duration = 24 * 3600,
+	.rate = 10,
+	.mean_length = 8,
+	.priority_fraction = 0.05,
+	.long_fraction = 0.1,
+	.buffers = RX_BUFFER_COUNT,
+	.buffer_length = 32,
+	.service_time = 1e-3,
+	.interjection_cycles = 3,
+	.seed = 1,
+	.trace_path = NULL,
+	.trace_transactions = 1000,
+	.hist_path = NULL,
+	.enum_table = false,
+	.enum_timeout = 0,
+};
+
+static struct node nodes[MAX_NODES];
+
+// Same histograms as MBUS_HISTOGRAMS records, summed over all nodes
+static unsigned long length_hist[MBUS_LENGTH_BINS];
+static unsigned long occupancy_hist[MAX_BUFFERS + 1];
+
+
+static unsigned message_edges(unsigned addr_bits, unsigned data_bits) {
+	return EDGES_ARBITRATION + EDGES_PER_BIT * (addr_bits + data_bits) +
+		EDGES_REQUEST + EDGES_CONTROL;
+}
+
+// Data bits a receiver takes of a message it NAKs for lack of buffer space,
+// with buffer_length 0 for no buffer at all. It notices on the first data bit
+// after the byte that did not fit, so without a buffer right after the
+// address. A message just one byte too long ends before that bit and is NAK'd
+// in the control phase instead.
+static unsigned nak_bits(unsigned length, unsigned buffer_length) {
+	if (buffer_length == 0) return 0;
+	if (length == buffer_length + 1) return 8 * length;
+	return 8 * (buffer_length + 1) + 1;
+}
+
+// Edges of such a message. Unless it ended first, the receiver asks for the
+// interjection itself.
+static unsigned nak_edges(unsigned addr_bits, unsigned length,
+		unsigned buffer_length) {
+	unsigned bits = nak_bits(length, buffer_length);
+	return message_edges(addr_bits, bits) +
+		((bits < 8 * length) ? EDGES_NAK_REQUEST : 0);
+}
+
+static double edges_to_seconds(unsigned edges) {
+	return edges / (2 * cfg.clock_hz);
+}
+
+static double interjection_seconds(void) {
+	return cfg.interjection_cycles / cfg.clock_hz;
+}
+
+static double rand_uniform(void) {
+	return (rand() + 1.0) / (RAND_MAX + 2.0);
+}
+
+static double rand_exponential(double rate) {
+	return -log(rand_uniform()) / rate;
+}
+
+static void generate(struct node* n, unsigned self, double now) {
+	struct msg* m;
+
+	n->next_arrival = now + rand_exponential(cfg.rate);
+
+	if (n->count == QUEUE_DEPTH) {
+		n->drops++;
+		return;
+	}
+	m = &n->queue[(n->head + n->count++) % QUEUE_DEPTH];
+	m->created = now;
+	m->dest = rand() % (cfg.nodes - 1);
+	if (m->dest >= self) m->dest++;
+	m->length = 1 + rand() % (2 * cfg.mean_length - 1);
+	m->priority = rand_uniform() < cfg.priority_fraction;
+	m->long_addr = rand_uniform() < cfg.long_fraction;
+}
+
+static void record_length(unsigned length) {
+	unsigned bin = 0;
+	while ((bin < MBUS_LENGTH_BINS - 1) && (length > (1u << bin))) bin++;
+	length_hist[bin]++;
+}
+
+static unsigned held_buffers(struct node* n, double now) {
+	unsigned i, held = 0;
+	for (i=0; i < cfg.buffers; i++) {
+		if (n->buffer_free_at[i] > now) held++;
+	}
+	return held;
+}
+
+static void write_histograms(void) {
+	FILE* f = fopen(cfg.hist_path, "w");
+	unsigned i;
+
+	if (f == NULL) {
+		perror(cfg.hist_path);
+		exit(1);
+	}
+	fprintf(f, "# mbus_txsim, %u nodes\n", cfg.nodes);
+	fprintf(f, "buffers %u %u\n", cfg.buffers, cfg.buffer_length);
+	for (i=0; i < MBUS_LENGTH_BINS; i++) {
+		fprintf(f, "length %u %lu\n", i, length_hist[i]);
+	}
+	for (i=0; i <= cfg.buffers; i++) {
+		fprintf(f, "occupancy %u %lu\n", i, occupancy_hist[i]);
+	}
+	fclose(f);
+}
+
+static int claim_buffer(struct node* n, double now) {
+	unsigned i;
+	for (i=0; i < cfg.buffers; i++) {
+		if (n->buffer_free_at[i] <= now) return i;
+	}
+	return -1;
+}
+
+// Position 0 is immediately downstream of the mediator
+static int arbitrate(void) {
+	int winner = -1;
+	unsigned i;
+	for (i=0; i < cfg.nodes; i++) {
+		struct node* n = &nodes[i];
+		if (n->count == 0) continue;
+		if (winner < 0) {
+			winner = i;
+		} else if (n->queue[n->head].priority &&
+				!nodes[winner].queue[nodes[winner].head].priority) {
+			winner = i;
+		}
+	}
+	for (i=0; i < cfg.nodes; i++) {
+		if ((nodes[i].count > 0) && ((int) i != winner)) {
+			nodes[i].arb_losses++;
+		}
+	}
+	return winner;
+}
+
+// Writes one transaction to the trace. Every node sees every phase, since
+// all nodes forward what they do not send or receive themselves.
+static void trace_transaction(unsigned long id, double start, unsigned sender,
+		unsigned receiver, unsigned addr_bits, unsigned data_bits, bool nak,
+		unsigned request_edges) {
+	double t = 1e6 * start;
+	double arb_us = 1e6 * edges_to_seconds(EDGES_ARBITRATION);
+	double addr_us = 1e6 * edges_to_seconds(EDGES_PER_BIT * addr_bits);
+	double data_us = 1e6 * edges_to_seconds(EDGES_PER_BIT * data_bits);
+	double interject_us = 1e6 * interjection_seconds();
+	double control_us = 1e6 * edges_to_seconds(request_edges + EDGES_CONTROL);
+	unsigned i;
+
+	for (i=0; i < cfg.nodes; i++) {
+		const char* role = "FORWARD";
+		double phase = t;
+
+		if (i == sender) role = "TRANSMIT";
+		if (i == receiver) role = nak ? "RECEIVE (overflow)" : "RECEIVE";
+
+		chrome_trace_slice(i, "arbitration", role, phase, arb_us);
+		phase += arb_us;
+		chrome_trace_slice(i, "address", role, phase, addr_us);
+		phase += addr_us;
+		if (data_bits > 0) {
+			chrome_trace_slice(i, "data", role, phase, data_us);
+			phase += data_us;
+		}
+		chrome_trace_slice(i, "interjection", role, phase, interject_us);
+		phase += interject_us;
+		chrome_trace_slice(i, "control", role, phase, control_us);
+	}
+
+	if (!nak) {
+		double data_start = t + arb_us + addr_us;
+		chrome_trace_flow(id, "message", sender, data_start,
+				receiver, data_start + data_us / 2);
+	}
+}
+
+static void simulate(void) {
+	double now = 0, busy = 0;
+	unsigned long transactions = 0, naks = 0, delivered = 0, drops = 0;
+	unsigned long too_long = 0;
+	clock_t wall = clock();
+	FILE* trace = NULL;
+	unsigned i;
+
+	if (cfg.trace_path) {
+		trace = fopen(cfg.trace_path, "w");
+		if (trace == NULL) {
+			perror(cfg.trace_path);
+			exit(1);
+		}
+		chrome_trace_begin(trace);
+		for (i=0; i < cfg.nodes; i++) {
+			char name[16];
+			snprintf(name, sizeof(name), "node %u", i);
+			chrome_trace_track(i, name);
+		}
+	}
+
+	for (i=0; i < cfg.nodes; i++) {
+		nodes[i].next_arrival = rand_exponential(cfg.rate);
+	}
+
+	while (now < cfg.duration) {
+		struct node* tx;
+		struct node* rx;
+		struct msg* m;
+		unsigned addr_bits;
+		double length;
+		int winner, buf;
+
+		// Deliver arrivals up to now, or skip ahead to the next one if
+		// nothing is pending
+		for (;;) {
+			double next = cfg.duration;
+			bool pending = false;
+			for (i=0; i < cfg.nodes; i++) {
+				while (nodes[i].next_arrival <= now) {
+					generate(&nodes[i], i, nodes[i].next_arrival);
+				}
+				if (nodes[i].count) pending = true;
+				if (nodes[i].next_arrival < next) next = nodes[i].next_arrival;
+			}
+			if (pending || (next >= cfg.duration)) break;
+			now = next;
+		}
+		if (now >= cfg.duration) break;
+
+		winner = arbitrate();
+		if (winner < 0) break;
+		tx = &nodes[winner];
+		m = &tx->queue[tx->head];
+		rx = &nodes[m->dest];
+		addr_bits = m->long_addr ? LONG_ADDR_BITS : SHORT_ADDR_BITS;
+		transactions++;
+
+		buf = claim_buffer(rx, now + edges_to_seconds(
+					EDGES_ARBITRATION + EDGES_PER_BIT * addr_bits));
+		if (buf < 0) {
+			occupancy_hist[cfg.buffers]++;
+		} else {
+			record_length(m->length);
+			if (m->length <= cfg.buffer_length) {
+				occupancy_hist[held_buffers(rx, now)]++;
+			}
+		}
+		if (buf < 0) {
+			// NAK'd, stays queued for retry
+			length = edges_to_seconds(nak_edges(addr_bits, m->length, 0)) +
+				interjection_seconds();
+			tx->naks++;
+			naks++;
+			if (trace && (transactions <= cfg.trace_transactions)) {
+				trace_transaction(transactions, now, winner, m->dest,
+						addr_bits, 0, true, EDGES_NAK_REQUEST);
+			}
+		} else if (m->length > cfg.buffer_length) {
+			// NAK'd once the buffer is full. No retry can fit, so it
+			// fails back to the sender.
+			unsigned bits = nak_bits(m->length, cfg.buffer_length);
+			unsigned edges = nak_edges(addr_bits, m->length,
+					cfg.buffer_length);
+
+			length = edges_to_seconds(edges) + interjection_seconds();
+			tx->naks++;
+			tx->too_long++;
+			naks++;
+			too_long++;
+			if (trace && (transactions <= cfg.trace_transactions)) {
+				trace_transaction(transactions, now, winner, m->dest,
+						addr_bits, bits, true,
+						edges - message_edges(addr_bits, bits));
+			}
+
+			tx->head = (tx->head + 1) % QUEUE_DEPTH;
+			tx->count--;
+		} else {
+			double latency;
+
+			length = edges_to_seconds(message_edges(addr_bits, 8 * m->length)) +
+				interjection_seconds();
+			rx->buffer_free_at[buf] = now + length + cfg.service_time;
+			rx->received++;
+			tx->sent++;
+			delivered++;
+
+			if (trace && (transactions <= cfg.trace_transactions)) {
+				trace_transaction(transactions, now, winner, m->dest,
+						addr_bits, 8 * m->length, false, EDGES_REQUEST);
+			}
+
+			latency = now + length - m->created;
+			tx->latency_sum += latency;
+			if (latency > tx->latency_max) tx->latency_max = latency;
+
+			tx->head = (tx->head + 1) % QUEUE_DEPTH;
+			tx->count--;
+		}
+		now += length;
+		busy += length;
+	}
+
+	if (trace) {
+		chrome_trace_end();
+		fclose(trace);
+	}
+
+	if (cfg.hist_path) write_histograms();
+
+	for (i=0; i < cfg.nodes; i++) drops += nodes[i].drops;
+
+	printf("simulated %.0f s in %.2f s wall\n", cfg.duration,
+			(double) (clock() - wall) / CLOCKS_PER_SEC);
+	printf("transactions %lu, delivered %lu, NAKs %lu, too long %lu, "
+			"queue drops %lu\n",
+			transactions, delivered, naks, too_long, drops);
+	printf("bus utilization %.2f%%\n", 100 * busy / cfg.duration);
+	printf("pos     sent     recv     naks  too-long  arb-lost  mean-lat(us)  max-lat(us)\n");
+	for (i=0; i < cfg.nodes; i++) {
+		struct node* n = &nodes[i];
+		printf("%3u %8lu %8lu %8lu %9lu %9lu %13.1f %12.1f\n", i,
+				n->sent, n->received, n->naks, n->too_long, n->arb_losses,
+				n->sent ? 1e6 * n->latency_sum / n->sent : 0,
+				1e6 * n->latency_max);
+	}
+}
+
+
+/* Edge-level calibration. One libmbus.c node acts as the receiver; this
+ * program plays the upstream transmitter and the mediator. */
+
+static struct MBus_t cal_mbus;
+static uint8_t cal_buffer[64];
+static bool cal_clk, cal_din, cal_clkout;
+static unsigned cal_edges;
+static bool cal_done;
+
+// What the node reported for the current sample
+static int cal_recv_length;           // -1 if MBus_recv was not called
+static unsigned cal_errors;
+static enum MBus_error_t cal_last_error;
+
+static void cal_set_gpio(unsigned idx, bool val) {
+	if (idx == cal_mbus.CLKOUT_gpio) cal_clkout = val;
+}
+static void cal_recv(unsigned idx) {
+	cal_recv_length = -cal_mbus.recv_buffer_lengths[idx];
+	cal_done = true;
+}
+static void cal_error(enum MBus_error_t err) {
+	cal_errors++;
+	cal_last_error = err;
+	cal_done = true;
+}
+static void cal_send_done(int bytes, enum MBus_error_t err) {
+	(void) bytes;
+	(void) err;
+}
+
+static void cal_clock(void) {
+	cal_clk = !cal_clk;
+	cal_edges++;
+	MBus_CLKIN_int_handler(cal_clk);
+}
+
+static void cal_data(bool val) {
+	if (val == cal_din) return;
+	cal_din = val;
+	MBus_DIN_int_handler(cal_din);
+}
+
+// Returns the number of CLK edges the transaction took, up to and including
+// the node's return to IDLE, and sets *sent to the data bits sent before the
+// node asked for the interjection. Returns 0 if the node never completed.
+static unsigned cal_transaction(uint32_t addr, unsigned addr_bits,
+		unsigned data_bits, int buffer_length, unsigned* sent) {
+	unsigned i;
+
+	cal_mbus.recv_buffer_lengths[0] = buffer_length;
+	cal_edges = 0;
+	cal_done = false;
+	cal_recv_length = -1;
+	cal_errors = 0;
+
+	cal_data(0);
+	for (i=0; i < EDGES_ARBITRATION; i++) cal_clock();
+	for (i=0; i < addr_bits; i++) {
+		cal_clock();
+		cal_data((addr >> (addr_bits - 1 - i)) & 1);
+		cal_clock();
+	}
+	// A receiver that has to NAK holds CLK high on a falling edge, which
+	// ends the transmission
+	for (*sent=0; *sent < data_bits; (*sent)++) {
+		cal_clock();
+		if (!cal_clk && cal_clkout) break;
+		cal_data(*sent & 1);
+		cal_clock();
+		if (!cal_clk && cal_clkout) break;
+	}
+	// Requester holds CLK high, then the mediator interjects
+	if (!cal_clk) cal_clock();
+	for (i=0; i < 3; i++) {
+		cal_data(1);
+		cal_data(0);
+	}
+	cal_data(1);
+
+	// The node reports completion one edge before it returns to IDLE
+	while (!cal_done) {
+		if (cal_edges > 2 * message_edges(addr_bits, data_bits)) return 0;
+		cal_clock();
+	}
+	cal_clock();
+	return cal_edges;
+}
+
+// Whether the node reported what the sample should produce: the message, or
+// a single RX Overflow
+static bool cal_outcome(unsigned length, bool overflow) {
+	if (overflow) {
+		return (cal_recv_length < 0) && (cal_errors == 1) &&
+			(cal_last_error == MBUS_ERR_RECV_OVERFLOW);
+	}
+	return (cal_recv_length == (int) length) && (cal_errors == 0);
+}
+
+static int calibrate(void) {
+	static const unsigned lengths[] = { 1, 2, 4, 8, 16, 32 };
+	unsigned i, sent, first, first_model;
+	int long_addr;
+	int mismatches = 0;
+
+	cal_mbus.CLKOUT_gpio = 0;
+	cal_mbus.DOUT_gpio = 1;
+	cal_mbus.short_prefix = 0x1;
+	cal_mbus.full_prefix = 0x012345;
+	cal_mbus.set_gpio_val = cal_set_gpio;
+	cal_mbus.MBus_recv = cal_recv;
+	cal_mbus.MBus_error = cal_error;
+	cal_mbus.MBus_send_done = cal_send_done;
+	cal_mbus.recv_buffers[0] = cal_buffer;
+	// Idle bus, as MBus_init assumes
+	cal_clk = 1;
+	cal_din = 1;
+	MBus_init(&cal_mbus);
+
+	// The first transaction after MBus_init starts from an idle CLK
+	// (high). Each one leaves CLK low, so the rest start from there and
+	// take one edge less.
+	first = cal_transaction(0x10, SHORT_ADDR_BITS, 8, sizeof(cal_buffer), &sent);
+	first_model = message_edges(SHORT_ADDR_BITS, 8) + 1;
+	printf("first after MBus_init: edge-level %u  model %u\n\n",
+			first, first_model);
+	if (!cal_outcome(1, false) || (sent != 8) || (first != first_model)) {
+		mismatches++;
+	}
+
+	printf("addr   len  edge-level  model  no buffer: edge-level  model"
+			"  too long: edge-level  model\n");
+	for (long_addr=0; long_addr <= 1; long_addr++) {
+		uint32_t addr = long_addr ? 0xf0123450 : 0x10;
+		unsigned addr_bits = long_addr ? LONG_ADDR_BITS : SHORT_ADDR_BITS;
+
+		for (i=0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			unsigned bits = 8 * lengths[i];
+			unsigned half = lengths[i] / 2;
+			unsigned model = message_edges(addr_bits, bits);
+			unsigned nak_model = nak_edges(addr_bits, lengths[i], 0);
+			unsigned long_model = nak_edges(addr_bits, lengths[i], half);
+			unsigned edge, nak_edge, long_edge;
+
+			// Fits
+			edge = cal_transaction(addr, addr_bits, bits,
+					sizeof(cal_buffer), &sent);
+			if (!cal_outcome(lengths[i], false) || (sent != bits) ||
+					(edge != model)) {
+				mismatches++;
+			}
+
+			// No buffer
+			nak_edge = cal_transaction(addr, addr_bits, bits, 0, &sent);
+			if (!cal_outcome(0, true) || (nak_edge != nak_model)) {
+				mismatches++;
+			}
+
+			// Buffer for half of it (none for a single byte)
+			long_edge = cal_transaction(addr, addr_bits, bits, half, &sent);
+			if (!cal_outcome(0, true) || (long_edge != long_model)) {
+				mismatches++;
+			}
+
+			printf("%-5s %4u %11u %6u %21u %6u %20u %6u\n",
+					long_addr ? "long" : "short", lengths[i],
+					edge, model, nak_edge, nak_model,
+					long_edge, long_model);
+		}
+	}
+
+	printf("%s\n", mismatches ? "MISMATCH" : "model matches edge-level state machine");
+	return mismatches ? 1 : 0;
+}
+
+
+/* Enumeration timing. Follows the sequence libmbus_enum.c drives, all short
+ * broadcasts: one Invalidate, then per node an Enumerate and the response of
+ * the node that wins arbitration (the others withdraw theirs). Without the
+ * node count a last Enumerate goes unanswered and enumeration ends when its
+ * response timeout expires, unless the last assignable prefix has been
+ * handed out. The mediator is assumed to have no short prefix of its own
+ * (which the driver would skip) and to send each command as soon as the bus
+ * is idle. */
+
+#define ENUM_COMMAND_BYTES  1
+#define ENUM_RESPONSE_BYTES 4
+
+static void enumeration(void) {
+	double command = edges_to_seconds(message_edges(SHORT_ADDR_BITS,
+				8 * ENUM_COMMAND_BYTES)) + interjection_seconds();
+	double response = edges_to_seconds(message_edges(SHORT_ADDR_BITS,
+				8 * ENUM_RESPONSE_BYTES)) + interjection_seconds();
+	unsigned n;
+
+	printf("       known count             unknown count\n");
+	printf("nodes  transactions  time (ms)  transactions  time (ms)\n");
+	for (n=1; n <= MBUS_ENUM_MAX_NODES; n++) {
+		unsigned known_transactions = 1 + 2 * n;
+		unsigned unknown_transactions = known_transactions;
+		double known = command + n * (command + response);
+		double unknown = known;
+
+		// The driver stops at the last assignable prefix either way
+		if (n < MBUS_ENUM_MAX_NODES) {
+			unknown_transactions++;
+			unknown += command + cfg.enum_timeout;
+		}
+		printf("%5u %13u %10.3f %13u %10.3f\n", n,
+				known_transactions, 1e3 * known,
+				unknown_transactions, 1e3 * unknown);
+	}
+}
+
+
+static void usage(const char* argv0) {
+	fprintf(stderr,
+"usage: %s [options]\n"
+"  -n nodes         ring size (default %u)\n"
+"  -c hz            bus clock (default %.0f)\n"
+"  -t seconds       simulated time (default %.0f)\n"
+"  -r rate          messages/s per node (default %.1f)\n"
+"  -l bytes         mean payload length (default %u)\n"
+"  -p fraction      priority messages (default %.2f)\n"
+"  -L fraction      long-address messages (default %.2f)\n"
+"  -b count         RX buffers per node (default %u)\n"
+"  -B bytes         RX buffer length (default %u)\n"
+"  -s seconds       time until a received buffer is released (default %g)\n"
+"  -i cycles        interjection length (default %.0f)\n"
+"  -x seed          random seed (default %u)\n"
+"  -T file          write a Chrome/Perfetto trace of the first transactions\n"
+"  -N count         transactions to trace (default %lu)\n"
+"  -H file          write RX histograms for mbus_bufadvise\n"
+"  -E seconds       tabulate enumeration time with this response timeout\n"
+"                   and exit\n"
+"  -C               calibrate against libmbus.c and exit\n",
+		argv0, cfg.nodes, cfg.clock_hz, cfg.duration, cfg.rate,
+		cfg.mean_length, cfg.priority_fraction, cfg.long_fraction,
+		cfg.buffers, cfg.buffer_length, cfg.service_time,
+		cfg.interjection_cycles, cfg.seed, cfg.trace_transactions);
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:c:t:r:l:p:L:b:B:s:i:x:T:N:H:E:Ch")) != -1) {
+		switch (opt) {
+			case 'n': cfg.nodes = atoi(optarg); break;
+			case 'c': cfg.clock_hz = atof(optarg); break;
+			case 't': cfg.duration = atof(optarg); break;
+			case 'r': cfg.rate = atof(optarg); break;
+			case 'l': cfg.mean_length = atoi(optarg); break;
+			case 'p': cfg.priority_fraction = atof(optarg); break;
+			case 'L': cfg.long_fraction = atof(optarg); break;
+			case 'b': cfg.buffers = atoi(optarg); break;
+			case 'B': cfg.buffer_length = atoi(optarg); break;
+			case 's': cfg.service_time = atof(optarg); break;
+			case 'i': cfg.interjection_cycles = atof(optarg); break;
+			case 'x': cfg.seed = atoi(optarg); break;
+			case 'T': cfg.trace_path = optarg; break;
+			case 'N': cfg.trace_transactions = atol(optarg); break;
+			case 'H': cfg.hist_path = optarg; break;
+			case 'E':
+				cfg.enum_table = true;
+				cfg.enum_timeout = atof(optarg);
+				break;
+			case 'C': return calibrate();
+			default: usage(argv[0]);
+		}
+	}
+	if (
+			(cfg.nodes < 2) || (cfg.nodes > MAX_NODES) ||
+			(cfg.buffers < 1) || (cfg.buffers > MAX_BUFFERS) ||
+			(cfg.mean_length < 1) || (cfg.enum_timeout < 0)
+	   ) {
+		usage(argv[0]);
+	}
+
+	if (cfg.enum_table) {
+		enumeration();
+		return 0;
+	}
+
+	srand(cfg.seed);
+	simulate();
+	return 0;
+}
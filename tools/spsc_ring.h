@@ -0,0 +1,119 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lock-free single-producer single-consumer ring of fixed-size elements.
+ *
+ * The producer and consumer each own one index and only read the other's.
+ * Each side also keeps a private copy of the other side's index and only
+ * reloads it when the ring looks full (or empty), so in steady state the
+ * shared cache lines are touched once per batch rather than per element.
+ *
+ * Elements are reserved and committed in contiguous batches:
+ *
+ *   producer:  n = spsc_reserve(r, &ptr); fill up to n; spsc_commit(r, k);
+ *   consumer:  n = spsc_peek(r, &ptr);    use up to n;  spsc_release(r, k);
+ *
+ * The producer calls spsc_close when done; spsc_closed tells the consumer
+ * that no more elements will follow once the ring is empty.
+ */
+
+#define SPSC_CACHE_LINE 64
+
+struct spsc_ring {
+	unsigned char* buf;
+	size_t elem_size;
+	size_t capacity;           // Elements, power of two
+
+	// Producer
+	_Alignas(SPSC_CACHE_LINE) _Atomic size_t head;
+	size_t tail_cache;
+	size_t high_water;         // Most elements ever queued
+	unsigned long full_waits;  // spsc_reserve calls that found it full
+
+	// Consumer
+	_Alignas(SPSC_CACHE_LINE) _Atomic size_t tail;
+	size_t head_cache;
+
+	_Alignas(SPSC_CACHE_LINE) _Atomic bool closed;
+};
+
+static inline bool spsc_init(struct spsc_ring* r, size_t elem_size,
+		size_t capacity) {
+	memset(r, 0, sizeof(*r));
+	if ((capacity == 0) || (capacity & (capacity - 1))) return false;
+	r->buf = aligned_alloc(SPSC_CACHE_LINE,
+			(elem_size * capacity + SPSC_CACHE_LINE - 1) &
+			~(size_t) (SPSC_CACHE_LINE - 1));
+	r->elem_size = elem_size;
+	r->capacity = capacity;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->closed, false);
+	return r->buf != NULL;
+}
+
+static inline void spsc_free(struct spsc_ring* r) {
+	free(r->buf);
+	r->buf = NULL;
+}
+
+// Returns the number of contiguous free elements at *ptr, possibly 0
+static inline size_t spsc_reserve(struct spsc_ring* r, void** ptr) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t idx = head & (r->capacity - 1);
+	size_t free_count = r->capacity - (head - r->tail_cache);
+
+	if (free_count == 0) {
+		r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+		free_count = r->capacity - (head - r->tail_cache);
+		if (free_count == 0) r->full_waits++;
+	}
+	if (free_count > r->capacity - idx) free_count = r->capacity - idx;
+	*ptr = r->buf + idx * r->elem_size;
+	return free_count;
+}
+
+static inline void spsc_commit(struct spsc_ring* r, size_t count) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed) + count;
+	size_t used = head - r->tail_cache;
+	if (used > r->high_water) r->high_water = used;
+	atomic_store_explicit(&r->head, head, memory_order_release);
+}
+
+// Returns the number of contiguous elements ready at *ptr, possibly 0
+static inline size_t spsc_peek(struct spsc_ring* r, void** ptr) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t idx = tail & (r->capacity - 1);
+	size_t count = r->head_cache - tail;
+
+	if (count == 0) {
+		r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+		count = r->head_cache - tail;
+	}
+	if (count > r->capacity - idx) count = r->capacity - idx;
+	*ptr = r->buf + idx * r->elem_size;
+	return count;
+}
+
+static inline void spsc_release(struct spsc_ring* r, size_t count) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed) + count;
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+}
+
+static inline void spsc_close(struct spsc_ring* r) {
+	atomic_store_explicit(&r->closed, true, memory_order_release);
+}
+
+// True once the producer has closed the ring. Check emptiness again after
+// this returns true, elements committed before closing may still be there.
+static inline bool spsc_closed(struct spsc_ring* r) {
+	return atomic_load_explicit(&r->closed, memory_order_acquire);
+}
+
+#endif // SPSC_RING_H